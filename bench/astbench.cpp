@@ -0,0 +1,92 @@
+// AST allocation: heap allocated nodes vs. nodes in a per-Program arena.
+//
+// usage: astbench [functions] [repeat]
+// Parses a synthetic program and reports allocation count, parse time and teardown time.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Lexer.hpp"
+#include "Parser.hpp"
+#include "Token.hpp"
+
+static std::size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    if(void* p = std::malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+// the arena's upstream resource uses the aligned forms
+void* operator new(std::size_t size, std::align_val_t align) {
+    allocations++;
+    std::size_t a = static_cast<std::size_t>(align);
+    if(void* p = std::aligned_alloc(a, (size + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+static std::string synthetic(int functions) {
+    std::string src = "extern printd x;\n";
+    for(int i = 0; i < functions; i++) {
+        src += "def f" + std::to_string(i) + " a b ->\n"
+               "    var acc = a - 1\n"
+               "    loop i range 0, 10, 1 ->\n"
+               "        acc = acc + i - b + 2\n"
+               "    end\n"
+               "    if acc < b then printd(acc) else f" + std::to_string(i) + "(acc - 1 b) end\n"
+               "end\n";
+    }
+    return src;
+}
+
+static void run(const char* name, const std::vector<Token>& tokens, int repeat, bool use_arena) {
+    double parse = 0, teardown = 0;
+    std::size_t allocs = 0;
+
+    for(int i = 0; i < repeat; i++) {
+        std::vector<Token> copy = tokens;
+
+        std::size_t before = allocations;
+        auto t0 = std::chrono::steady_clock::now();
+        Parser parser(std::move(copy), use_arena);
+        auto root = parser.Parse();
+        auto t1 = std::chrono::steady_clock::now();
+        allocs += allocations - before;
+
+        root.reset();
+        auto t2 = std::chrono::steady_clock::now();
+
+        parse += std::chrono::duration<double>(t1 - t0).count();
+        teardown += std::chrono::duration<double>(t2 - t1).count();
+    }
+
+    std::cout << name << ": " << allocs / repeat << " allocations, "
+              << parse / repeat * 1e3 << " ms parse, "
+              << teardown / repeat * 1e3 << " ms teardown\n";
+}
+
+int main(int argc, char* argv[]) {
+    int functions = argc > 1 ? std::stoi(argv[1]) : 50000;
+    int repeat = argc > 2 ? std::stoi(argv[2]) : 5;
+
+    std::string src = synthetic(functions);
+    Lexer lexer(src);
+    std::vector<Token> tokens;
+    for(Token t = lexer.NextToken(); t.type != TokenType::END_PROG; t = lexer.NextToken()) tokens.push_back(t);
+
+    std::cout << functions << " functions, " << tokens.size() << " tokens\n";
+    run("heap ", tokens, repeat, false);
+    run("arena", tokens, repeat, true);
+}
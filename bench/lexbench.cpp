@@ -0,0 +1,74 @@
+// Lexer throughput: stream-backed Lexer vs. lexing an mmapped file in place.
+//
+// usage: lexbench [file] [repeat]
+// Without a file, a synthetic program of ~8MB is generated in /tmp.
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "Lexer.hpp"
+#include "MappedFile.hpp"
+#include "Token.hpp"
+
+static std::string writeSynthetic() {
+    std::string path = "/tmp/kl_lexbench.kl";
+    std::ofstream out(path);
+    out << "extern printd x;\n\n";
+    for(int i = 0; out.tellp() < 8 * 1024 * 1024; i++) {
+        out << "def function" << i << " argumentOne argumentTwo ->\n"
+            << "    var accumulator = argumentOne - 12345\n"
+            << "    loop counter range 0, 100, 1 ->\n"
+            << "        accumulator = accumulator + counter\n"
+            << "    end\n"
+            << "    if accumulator < argumentTwo then printd(accumulator) else 0 end\n"
+            << "end\n\n";
+    }
+    return path;
+}
+
+static std::size_t drain(Lexer& lexer) {
+    std::size_t n = 0;
+    while(lexer.NextToken().type != TokenType::END_PROG) n++;
+    return n;
+}
+
+template<typename F>
+static void run(const char* name, std::size_t bytes, int repeat, F lexOnce) {
+    std::size_t tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < repeat; i++) tokens += lexOnce();
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+    double mb = double(bytes) * repeat / (1024 * 1024);
+    std::cout << name << ": " << secs.count() << " s, "
+              << mb / secs.count() << " MB/s, "
+              << tokens / secs.count() / 1e6 << " Mtok/s\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : writeSynthetic();
+    int repeat = argc > 2 ? std::stoi(argv[2]) : 10;
+
+    MappedFile probe(path);
+    if(!probe.is_open()) {
+        std::cerr << "Unable to open file: " << path << std::endl;
+        return 1;
+    }
+    std::size_t bytes = probe.contents().size();
+    std::cout << path << ": " << bytes << " bytes x " << repeat << "\n";
+
+    run("istream", bytes, repeat, [&] {
+        std::ifstream f(path);
+        Lexer lexer(f);
+        return drain(lexer);
+    });
+
+    run("mmap   ", bytes, repeat, [&] {
+        MappedFile f(path);
+        Lexer lexer(f.contents());
+        return drain(lexer);
+    });
+}
@@ -0,0 +1,116 @@
+// Scaling of parallel loops: one program on the JIT, run with 1 to N workers.
+//
+// usage: parbench [max workers] [grain] [file]
+// The program (by default a parallel loop of sum, min and max reductions over 2^24 calls of sin) is
+// compiled once at -O2 with the given grain, 0 for the runtime's. main then runs five times for each
+// worker count, doubling up to the maximum (the hardware threads by default), and the mean time is
+// compared with one worker's. The result has to be the same for every worker count: reductions are
+// folded chunk by chunk, and the chunks don't depend on the number of threads.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ASTOptimizer.hpp"
+#include "JIT.hpp"
+#include "LLVMGen.hpp"
+#include "Lexer.hpp"
+#include "MappedFile.hpp"
+#include "ParallelRuntime.hpp"
+#include "Parser.hpp"
+
+static const char* kDefaultProgram = R"(extern sin x;
+
+def main ->
+    var total = 0
+    var lo = 2
+    var hi = 0 - 2
+    parallel loop i range 0, 16777216, 1 reduce sum total, min lo, max hi ->
+        var s = sin(i)
+        total = total + s
+        if s < lo then lo = s else 0 end
+        if hi < s then hi = s else 0 end
+    end
+    total + hi - lo
+end
+)";
+
+static std::unique_ptr<Program> parse(std::string_view src) {
+    Lexer lexer(src);
+    Parser parser(lexer, true);
+    auto root = parser.Parse();
+    if(!root || parser.Errors()) return nullptr;
+
+    std::unique_ptr<Program> program(static_cast<Program*>(root.release()));
+    ASTOptimizer optimizer;
+    program->accept(optimizer);
+    return program;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned maxWorkers = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t grain = argc > 2 ? std::stoull(argv[2]) : 0;
+    constexpr int repeat = 5;
+
+    std::unique_ptr<MappedFile> f;
+    std::string_view src = kDefaultProgram;
+    if(argc > 3) {
+        f = std::make_unique<MappedFile>(argv[3]);
+        if(!f->is_open()) {
+            std::cerr << "Unable to open file: " << argv[3] << std::endl;
+            return 1;
+        }
+        src = f->contents();
+    }
+
+    auto program = parse(src);
+    if(!program) return 1;
+
+    LLVMGen gen(llvm::OptimizationLevel::O2, "native");
+    gen.parallelGrain = grain;
+    program->accept(gen);
+    if(gen.Failed()) return 1;
+    gen.Optimize();
+
+    JIT jit;
+    jit.Add(std::move(gen.mod), std::move(gen.ctx));
+
+    std::vector<unsigned> counts;
+    for(unsigned w = 1; w < maxWorkers; w *= 2) counts.push_back(w);
+    counts.push_back(maxWorkers);
+
+    std::cout << "workers\tresult\tmean (ms)\tspeedup\tefficiency\n";
+    double base = 0, expected = 0;
+    for(unsigned w : counts) {
+        __kl_parallel_set_workers(w);
+
+        // the first run also compiles main and gets the new threads going
+        auto result = jit.Run("main");
+        if(!result) return 1;
+
+        double ms = 0;
+        for(int i = 0; i < repeat; i++) {
+            auto t0 = std::chrono::steady_clock::now();
+            result = jit.Run("main");
+            auto t1 = std::chrono::steady_clock::now();
+            ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        }
+        ms /= repeat;
+        if(w == 1) {
+            base = ms;
+            expected = *result;
+        }
+
+        if(*result != expected) {
+            std::cerr << "result with " << w << " workers differs from one worker's: " << *result << std::endl;
+            return 1;
+        }
+
+        std::cout << w << '\t' << *result << '\t' << ms << '\t' << base / ms << '\t' << base / ms / w << '\n';
+    }
+}
@@ -0,0 +1,113 @@
+// Time to result: the bytecode VM vs. LLVM codegen and the JIT, the paths of --vm and --run.
+//
+// usage: vmbench [repeat] [files...]
+// Each file goes from source to the result of main on both paths, which are timed as a whole and
+// have to agree. Without files the programs in test/ are used, run from the repository root.
+// The AST optimizer is left out: it folds most of these programs down to a constant, which would
+// leave nothing for either path to execute.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BytecodeGen.hpp"
+#include "JIT.hpp"
+#include "LLVMGen.hpp"
+#include "Lexer.hpp"
+#include "MappedFile.hpp"
+#include "Parser.hpp"
+#include "VM.hpp"
+
+static std::unique_ptr<Program> parse(std::string_view src) {
+    Lexer lexer(src);
+    Parser parser(lexer, true);
+    auto root = parser.Parse();
+    if(!root || parser.Errors()) return nullptr;
+
+    return std::unique_ptr<Program>(static_cast<Program*>(root.release()));
+}
+
+static std::optional<double> runVM(std::string_view src) {
+    auto program = parse(src);
+    if(!program) return std::nullopt;
+
+    NativeRegistry natives;
+    BytecodeGen gen(natives);
+    program->accept(gen);
+    if(gen.Failed()) return std::nullopt;
+
+    VM vm(gen.module);
+    return vm.Run("main");
+}
+
+static std::optional<double> runJIT(std::string_view src) {
+    auto program = parse(src);
+    if(!program) return std::nullopt;
+
+    LLVMGen gen;
+    program->accept(gen);
+    if(gen.Failed()) return std::nullopt;
+    gen.Optimize();
+
+    JIT jit;
+    jit.Add(std::move(gen.mod), std::move(gen.ctx));
+    return jit.Run("main");
+}
+
+// milliseconds of the first run, which pays for any one-time setup, and the mean of the rest
+template<typename F>
+static std::optional<double> measure(F run, std::string_view src, int repeat, double& first, double& rest) {
+    std::optional<double> result;
+    first = rest = 0;
+    for(int i = 0; i < repeat; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        result = run(src);
+        auto t1 = std::chrono::steady_clock::now();
+        if(!result) return std::nullopt;
+
+        double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        if(i == 0) first = ms;
+        else rest += ms;
+    }
+    if(repeat > 1) rest /= repeat - 1;
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int repeat = argc > 1 ? std::stoi(argv[1]) : 10;
+    std::vector<std::string> paths(argv + std::min(argc, 2), argv + argc);
+    if(paths.empty()) {
+        for(const char* name : {"basic", "basic2", "extern", "fibonacci", "if", "loop", "nonneg_sub", "var_assign"}) {
+            paths.push_back(std::string("test/") + name);
+        }
+    }
+
+    std::cout << "file\tresult\tvm first\tvm mean\tjit first\tjit mean (ms)\n";
+    for(const auto& path : paths) {
+        MappedFile f(path);
+        if(!f.is_open()) {
+            std::cerr << "Unable to open file: " << path << std::endl;
+            return 1;
+        }
+
+        double vmFirst, vmRest, jitFirst, jitRest;
+        auto vm = measure(runVM, f.contents(), repeat, vmFirst, vmRest);
+        auto jit = measure(runJIT, f.contents(), repeat, jitFirst, jitRest);
+        if(!vm || !jit) {
+            // a file without a main, or one that fails to compile on either path
+            std::cout << path << "\tskipped\n";
+            continue;
+        }
+        if(*vm != *jit) {
+            std::cerr << path << ": the VM returned " << *vm << " and the JIT " << *jit << std::endl;
+            return 1;
+        }
+
+        std::cout << path << '\t' << *vm << '\t' << vmFirst << '\t' << vmRest << '\t' << jitFirst << '\t' << jitRest << '\n';
+    }
+}
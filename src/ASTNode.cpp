@@ -1,5 +1,54 @@
 #include "ASTNode.hpp"
 
+#include <new>
+
 ASTNode::~ASTNode() = default;
 
+namespace {
+
+// keeps the node behind it aligned like any other operator new result
+struct alignas(std::max_align_t) AllocHeader {
+    bool in_arena;
+};
+
+}  // namespace
+
+void* ASTNode::operator new(std::size_t size) {
+    void* p = ::operator new(sizeof(AllocHeader) + size);
+    static_cast<AllocHeader*>(p)->in_arena = false;
+    return static_cast<char*>(p) + sizeof(AllocHeader);
+}
+
+void* ASTNode::operator new(std::size_t size, Arena& arena) {
+    void* p = arena.allocate(sizeof(AllocHeader) + size, alignof(AllocHeader));
+    static_cast<AllocHeader*>(p)->in_arena = true;
+    return static_cast<char*>(p) + sizeof(AllocHeader);
+}
+
+void ASTNode::operator delete(void* p) {
+    if(!p) return;
+
+    auto* header = reinterpret_cast<AllocHeader*>(static_cast<char*>(p) - sizeof(AllocHeader));
+    if(!header->in_arena) ::operator delete(header);
+}
+
+// only called if a node constructor throws during placement new
+void ASTNode::operator delete(void*, Arena&) {}
+
+Program::~Program() {
+    if(arenas.empty()) return;
+
+    // everything below the top level is in the arenas, so skip walking the tree and let the arenas
+    // free it all at once
+    for(auto& e : externs) e.release();
+    for(auto& fd : func_defs) fd.release();
+}
 
+const char* string_of_reduction_op(ReductionOp op) {
+    switch(op) {
+        case ReductionOp::Sum: return "sum";
+        case ReductionOp::Min: return "min";
+        case ReductionOp::Max: return "max";
+    }
+    return "?";
+}
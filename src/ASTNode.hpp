@@ -1,9 +1,15 @@
 #ifndef ASTNODE_HPP
 #define ASTNODE_HPP
 
-#include <vector>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <memory_resource>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "Symbol.hpp"
 
 class Visitor;
 class Program;
@@ -20,12 +26,36 @@ class LoopExpr;
 class VarInitExpr;
 class AssignExpr;
 
+// Bump allocator a whole compilation unit's AST can be allocated from
+using Arena = std::pmr::monotonic_buffer_resource;
+
 class ASTNode {
 public:
     virtual ~ASTNode();
     virtual void accept(Visitor& v) = 0;
+
+    // Nodes live either on the heap or in an Arena. Every allocation is prefixed with a tag saying
+    // which, so deleting an arena node (e.g. when a pass replaces it) runs its destructor but leaves
+    // the memory to be reclaimed with the arena.
+    static void* operator new(std::size_t size);
+    static void* operator new(std::size_t size, Arena& arena);
+    static void operator delete(void* p);
+    static void operator delete(void* p, Arena& arena);
 };
 
+// Allocate a node in arena if there is one and on the heap otherwise. A node in an arena must
+// allocate its vectors from the same arena (see memoryFor), since arena nodes are never destroyed
+// when the Program owning the arena goes away.
+template<typename T, typename... Args>
+std::unique_ptr<T> makeNode(Arena* arena, Args&&... args) {
+    if(arena) return std::unique_ptr<T>(new (*arena) T(std::forward<Args>(args)...));
+    return std::make_unique<T>(std::forward<Args>(args)...);
+}
+
+inline std::pmr::memory_resource* memoryFor(Arena* arena) {
+    return arena ? static_cast<std::pmr::memory_resource*>(arena) : std::pmr::get_default_resource();
+}
+
 class Visitor {
 public:
     virtual ~Visitor() = default;
@@ -53,52 +83,60 @@ public:
 
 class Program : public Visitable<Program> {
 public:
-    std::vector<std::unique_ptr<Extern>> externs;
-    std::vector<std::unique_ptr<FuncDef>> func_defs;
+    // Arenas the nodes live in, empty if they are on the heap. A parallel parse gives every chunk
+    // its own arena. Declared first so they are destroyed last.
+    std::vector<std::unique_ptr<Arena>> arenas;
+    std::pmr::vector<std::unique_ptr<Extern>> externs;
+    std::pmr::vector<std::unique_ptr<FuncDef>> func_defs;
+
+    Program(std::pmr::vector<std::unique_ptr<Extern>> externs,
+            std::pmr::vector<std::unique_ptr<FuncDef>> func_defs,
+            std::unique_ptr<Arena> arena = nullptr)
+        : externs(std::move(externs)), func_defs(std::move(func_defs)) {
+        if(arena) arenas.push_back(std::move(arena));
+    }
 
-    Program(std::vector<std::unique_ptr<Extern>> externs,
-            std::vector<std::unique_ptr<FuncDef>> func_defs)
-        : externs(std::move(externs)), func_defs(std::move(func_defs)) {}
+    ~Program() override;
 };
 
 class FuncDef : public Visitable<FuncDef> {
 public:
-    std::string name;
-    std::vector<std::string> params;
+    Symbol name;
+    std::pmr::vector<Symbol> params;
     std::unique_ptr<Block> block;
 
-    FuncDef(std::string name,
-            std::vector<std::string> params,
+    FuncDef(Symbol name,
+            std::pmr::vector<Symbol> params,
             std::unique_ptr<Block> block)
-        : name(std::move(name)), params(std::move(params)), block(std::move(block)) {}
+        : name(name), params(std::move(params)), block(std::move(block)) {}
 };
 
 class Block : public Visitable<Block> {
 public:
-    std::vector<std::unique_ptr<Expr>> exprs;
+    std::pmr::vector<std::unique_ptr<Expr>> exprs;
 
-    explicit Block(std::vector<std::unique_ptr<Expr>> exprs)
+    explicit Block(std::pmr::vector<std::unique_ptr<Expr>> exprs)
         : exprs(std::move(exprs)) {}
 };
 
 class Extern : public Visitable<Extern> {
 public:
-    std::string name;
-    std::vector<std::string> params;
+    Symbol name;
+    std::pmr::vector<Symbol> params;
 
-    Extern(std::string name,
-           std::vector<std::string> params)
-        : name(std::move(name)), params(std::move(params)) {}
+    Extern(Symbol name,
+           std::pmr::vector<Symbol> params)
+        : name(name), params(std::move(params)) {}
 };
 
 class Expr : public ASTNode {};
 
 class VarExpr : public Expr, public Visitable<VarExpr> {
 public:
-    std::string name;
+    Symbol name;
 
-    explicit VarExpr(std::string name)
-        : name(std::move(name)) {}
+    explicit VarExpr(Symbol name)
+        : name(name) {}
 
     // Expr still has the purely virtual accept method from ASTNode. We want the one that Visitable overrides.
     void accept(Visitor& v) override {
@@ -109,9 +147,10 @@ public:
 class NumLiteral : public Expr, public Visitable<NumLiteral> {
 public:
     int val;
+    bool isDouble;  // stands for a double, as a call folded at compile time does
 
-    explicit NumLiteral(int val)
-        : val(val) {}
+    explicit NumLiteral(int val, bool isDouble = false)
+        : val(val), isDouble(isDouble) {}
 
     void accept(Visitor& v) override {
         Visitable<NumLiteral>::accept(v);
@@ -152,32 +191,52 @@ public:
 
 class CallExpr : public Expr, public Visitable<CallExpr> {
 public:
-    std::string name;
-    std::vector<std::unique_ptr<Expr>> args;
+    Symbol name;
+    std::pmr::vector<std::unique_ptr<Expr>> args;
 
-    CallExpr(std::string name,
-             std::vector<std::unique_ptr<Expr>> args)
-        : name(std::move(name)), args(std::move(args)) {}
+    CallExpr(Symbol name,
+             std::pmr::vector<std::unique_ptr<Expr>> args)
+        : name(name), args(std::move(args)) {}
 
     void accept(Visitor& v) override {
         Visitable<CallExpr>::accept(v);
     }
 };
 
+enum class ReductionOp : std::uint8_t { Sum, Min, Max };
+
+// a variable from outside a parallel loop that its iterations combine into with op
+struct Reduction {
+    ReductionOp op;
+    Symbol var;
+};
+
+const char* string_of_reduction_op(ReductionOp op);
+
+// A parallel loop's iterations run on several threads at once, so they must be independent: the
+// body may read the variables around the loop but only assign its reductions, which each chunk of
+// iterations accumulates on its own and are combined in order once the loop is done. Variables the
+// body declares are private to the loop. Backends without threads run it as an ordinary loop, with
+// the same result up to rounding in sums of doubles.
 class LoopExpr : public Expr, public Visitable<LoopExpr> {
 public:
-    std::string name;
+    Symbol name;
     std::unique_ptr<Expr> rangeStart;
     std::unique_ptr<Expr> rangeEnd;
     std::unique_ptr<Expr> step;
     std::unique_ptr<Block> block;
+    bool parallel;
+    std::pmr::vector<Reduction> reductions;
 
-    LoopExpr(std::string name,
+    LoopExpr(Symbol name,
              std::unique_ptr<Expr> rangeStart,
              std::unique_ptr<Expr> rangeEnd,
              std::unique_ptr<Expr> step,
-             std::unique_ptr<Block> block)
-        : name(std::move(name)), rangeStart(std::move(rangeStart)), rangeEnd(std::move(rangeEnd)), step(std::move(step)), block(std::move(block)) {}
+             std::unique_ptr<Block> block,
+             bool parallel = false,
+             std::pmr::vector<Reduction> reductions = {})
+        : name(name), rangeStart(std::move(rangeStart)), rangeEnd(std::move(rangeEnd)), step(std::move(step)), block(std::move(block)),
+          parallel(parallel), reductions(std::move(reductions)) {}
 
     void accept(Visitor& v) override {
         Visitable<LoopExpr>::accept(v);
@@ -186,11 +245,11 @@ public:
 
 class VarInitExpr : public Expr, public Visitable<VarInitExpr> {
 public:
-    std::string name;
+    Symbol name;
     std::unique_ptr<Expr> val;
 
-    VarInitExpr(std::string name, std::unique_ptr<Expr> val)
-        : name(std::move(name)), val(std::move(val)) {}
+    VarInitExpr(Symbol name, std::unique_ptr<Expr> val)
+        : name(name), val(std::move(val)) {}
 
     void accept(Visitor& v) override {
         Visitable<VarInitExpr>::accept(v);
@@ -0,0 +1,399 @@
+#include "ASTOptimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace {
+
+// size and effects of a subtree
+class Summary : public Visitor {
+public:
+    unsigned size = 0;
+    bool calls = false;
+    bool writes = false;    // assigns or declares a variable (a loop declares its own)
+    bool declares = false;  // has a var, which stays defined after the block it is in
+    bool loops = false;
+    std::vector<Symbol> reads;
+    std::vector<Symbol> callees;
+    std::vector<Symbol> declared;  // by a var or as a loop's variable
+
+    bool Effects() const { return calls || writes || loops; }
+
+    void visit(Program&) override {}
+    void visit(FuncDef&) override {}
+    void visit(Extern&) override {}
+
+    void visit(Block& node) override {
+        size++;
+        for(auto& e : node.exprs) e->accept(*this);
+    }
+
+    void visit(VarExpr& node) override {
+        size++;
+        reads.push_back(node.name);
+    }
+
+    void visit(NumLiteral&) override { size++; }
+
+    void visit(BinOp& node) override {
+        size++;
+        node.left->accept(*this);
+        node.right->accept(*this);
+    }
+
+    void visit(IfExpr& node) override {
+        size++;
+        node.cond->accept(*this);
+        node.then->accept(*this);
+        node.elss->accept(*this);
+    }
+
+    void visit(CallExpr& node) override {
+        size++;
+        calls = true;
+        callees.push_back(node.name);
+        for(auto& a : node.args) a->accept(*this);
+    }
+
+    void visit(LoopExpr& node) override {
+        size++;
+        loops = writes = true;
+        declared.push_back(node.name);
+        node.rangeStart->accept(*this);
+        node.rangeEnd->accept(*this);
+        node.step->accept(*this);
+        node.block->accept(*this);
+    }
+
+    void visit(VarInitExpr& node) override {
+        size++;
+        writes = declares = true;
+        declared.push_back(node.name);
+        node.val->accept(*this);
+    }
+
+    void visit(AssignExpr& node) override {
+        size++;
+        writes = true;
+        node.val->accept(*this);
+    }
+};
+
+using Substitution = std::unordered_map<std::uint32_t, Expr*>;
+const Substitution noSubstitution;
+
+template<typename T>
+Summary summarize(T& node) {
+    Summary s;
+    node.accept(s);
+    return s;
+}
+
+// Whether TypeInference is sure to type e as a double, given variables that always are: calls and
+// the literals they fold to are doubles, and a double that takes part in +/- or in either branch of
+// an if makes it one.
+bool isDouble(const Expr& e, const std::vector<Symbol>& doubles) {
+    if(dynamic_cast<const CallExpr*>(&e)) return true;
+    if(auto* lit = dynamic_cast<const NumLiteral*>(&e)) return lit->isDouble;
+    if(auto* var = dynamic_cast<const VarExpr*>(&e)) return std::find(doubles.begin(), doubles.end(), var->name) != doubles.end();
+    if(auto* bin = dynamic_cast<const BinOp*>(&e)) {
+        return bin->op != '<' && (isDouble(*bin->left, doubles) || isDouble(*bin->right, doubles));
+    }
+    if(auto* ifExpr = dynamic_cast<const IfExpr*>(&e)) {
+        auto last = [&](const Block& b) { return !b.exprs.empty() && isDouble(*b.exprs.back(), doubles); };
+        return last(*ifExpr->then) || last(*ifExpr->elss);
+    }
+    return false;
+}
+
+// Whether TypeInference could type e as a double: any variable could be one.
+bool mayBeDouble(const Expr& e) {
+    auto last = [](const Block& b) { return !b.exprs.empty() && mayBeDouble(*b.exprs.back()); };
+    if(auto* lit = dynamic_cast<const NumLiteral*>(&e)) return lit->isDouble;
+    if(auto* bin = dynamic_cast<const BinOp*>(&e)) return bin->op != '<' && (mayBeDouble(*bin->left) || mayBeDouble(*bin->right));
+    if(auto* ifExpr = dynamic_cast<const IfExpr*>(&e)) return last(*ifExpr->then) || last(*ifExpr->elss);
+    if(auto* init = dynamic_cast<const VarInitExpr*>(&e)) return mayBeDouble(*init->val);
+    if(auto* assign = dynamic_cast<const AssignExpr*>(&e)) return mayBeDouble(*assign->val);
+    if(dynamic_cast<const LoopExpr*>(&e)) return false;
+    return true;
+}
+
+// Deep copy of an expression into arena (the heap if null), with the parameters in subst replaced
+// by copies of their arguments.
+class Cloner : public Visitor {
+private:
+    Arena* arena;
+    const Substitution& subst;
+    std::unique_ptr<Expr> expr;
+    std::unique_ptr<Block> block;
+
+public:
+    Cloner(Arena* arena, const Substitution& subst) : arena(arena), subst(subst) {}
+
+    std::unique_ptr<Block> Clone(Block& node) {
+        node.accept(*this);
+        return std::move(block);
+    }
+
+    std::unique_ptr<Expr> Clone(Expr& node) {
+        node.accept(*this);
+        return std::move(expr);
+    }
+
+    void visit(Program&) override {}
+    void visit(FuncDef&) override {}
+    void visit(Extern&) override {}
+
+    void visit(Block& node) override {
+        std::pmr::vector<std::unique_ptr<Expr>> exprs(memoryFor(arena));
+        for(auto& e : node.exprs) exprs.push_back(Clone(*e));
+        block = makeNode<Block>(arena, std::move(exprs));
+    }
+
+    void visit(VarExpr& node) override {
+        auto it = subst.find(node.name.id);
+        if(it != subst.end()) {
+            // arguments are copied from the call site, which has nothing substituted
+            Cloner plain(arena, noSubstitution);
+            expr = plain.Clone(*it->second);
+        }
+        else {
+            expr = makeNode<VarExpr>(arena, node.name);
+        }
+    }
+
+    void visit(NumLiteral& node) override { expr = makeNode<NumLiteral>(arena, node.val, node.isDouble); }
+
+    void visit(BinOp& node) override {
+        auto left = Clone(*node.left);
+        auto right = Clone(*node.right);
+        expr = makeNode<BinOp>(arena, std::move(left), node.op, std::move(right));
+    }
+
+    void visit(IfExpr& node) override {
+        auto cond = Clone(*node.cond);
+        auto then = Clone(*node.then);
+        auto elss = Clone(*node.elss);
+        expr = makeNode<IfExpr>(arena, std::move(cond), std::move(then), std::move(elss));
+    }
+
+    void visit(CallExpr& node) override {
+        std::pmr::vector<std::unique_ptr<Expr>> args(memoryFor(arena));
+        for(auto& a : node.args) args.push_back(Clone(*a));
+        expr = makeNode<CallExpr>(arena, node.name, std::move(args));
+    }
+
+    void visit(LoopExpr& node) override {
+        auto start = Clone(*node.rangeStart);
+        auto end = Clone(*node.rangeEnd);
+        auto step = Clone(*node.step);
+        auto block = Clone(*node.block);
+        std::pmr::vector<Reduction> reductions(node.reductions.begin(), node.reductions.end(), memoryFor(arena));
+        expr = makeNode<LoopExpr>(arena, node.name, std::move(start), std::move(end), std::move(step), std::move(block),
+                                  node.parallel, std::move(reductions));
+    }
+
+    void visit(VarInitExpr& node) override {
+        expr = makeNode<VarInitExpr>(arena, node.name, Clone(*node.val));
+    }
+
+    void visit(AssignExpr& node) override {
+        auto lhs = Clone(*node.lhs);
+        auto val = Clone(*node.val);
+        expr = makeNode<AssignExpr>(arena, std::move(lhs), std::move(val));
+    }
+};
+
+}  // namespace
+
+void ASTOptimizer::optimize(std::unique_ptr<Expr>& e) {
+    replacement.reset();
+    e->accept(*this);
+    if(replacement) e = std::move(replacement);
+}
+
+void ASTOptimizer::visit(Program& node) {
+    // every definition of a program lives in its arenas, which last as long as it does
+    arena = node.arenas.empty() ? nullptr : node.arenas.front().get();
+    for(auto& fd : node.func_defs) fd->accept(*this);
+    arena = nullptr;
+}
+
+void ASTOptimizer::visit(FuncDef& node) {
+    // a parameter stays a double unless a var or loop of the same name hides it somewhere
+    Summary declarations = summarize(*node.block);
+    doubles.clear();
+    for(Symbol p : node.params) {
+        if(std::find(declarations.declared.begin(), declarations.declared.end(), p) == declarations.declared.end()) {
+            doubles.push_back(p);
+        }
+    }
+
+    node.block->accept(*this);
+
+    // later calls with literal arguments can run it
+    Cloner copy(nullptr, noSubstitution);
+    std::pmr::vector<Symbol> params(node.params.begin(), node.params.end());
+    evaluator.Define(std::make_unique<FuncDef>(node.name, std::move(params), copy.Clone(*node.block)));
+
+    // remember the function if calls to it can be replaced by its body
+    if(node.block->exprs.size() != 1) return;
+    Summary s = summarize(*node.block->exprs[0]);
+    if(s.writes || s.loops || s.size > budget) return;
+    if(std::find(s.callees.begin(), s.callees.end(), node.name) != s.callees.end()) return;
+
+    Inlinable f;
+    f.params.assign(node.params.begin(), node.params.end());
+    f.body = copy.Clone(*node.block->exprs[0]);
+    inlinable[node.name.id] = std::move(f);
+}
+
+void ASTOptimizer::visit(Block& node) {
+    std::pmr::vector<std::unique_ptr<Expr>> exprs(node.exprs.get_allocator());
+    for(auto& e : node.exprs) {
+        optimize(e);
+
+        // an if in statement position is replaced by all of its live branch
+        auto* ifExpr = dynamic_cast<IfExpr*>(e.get());
+        bool last = &e == &node.exprs.back();
+        if(Block* live = ifExpr ? liveBranch(*ifExpr, last) : nullptr) {
+            for(auto& l : live->exprs) exprs.push_back(std::move(l));
+            continue;
+        }
+        exprs.push_back(std::move(e));
+    }
+
+    // the last expression is the value of the block
+    std::pmr::vector<std::unique_ptr<Expr>> kept(node.exprs.get_allocator());
+    for(size_t i = 0; i < exprs.size(); i++) {
+        if(i + 1 < exprs.size() && !summarize(*exprs[i]).Effects()) continue;
+        kept.push_back(std::move(exprs[i]));
+    }
+    node.exprs = std::move(kept);
+}
+
+void ASTOptimizer::visit(Extern&) {}
+
+void ASTOptimizer::visit(VarExpr&) {}
+
+void ASTOptimizer::visit(NumLiteral&) {}
+
+// Integer literals are i64 in codegen (see TypeInference), so folding in 64 bits matches it; the
+// result has to fit back into a literal, and is a double if either operand was.
+void ASTOptimizer::visit(BinOp& node) {
+    optimize(node.left);
+    optimize(node.right);
+
+    auto* left = dynamic_cast<NumLiteral*>(node.left.get());
+    auto* right = dynamic_cast<NumLiteral*>(node.right.get());
+    if(!left || !right) return;
+
+    std::int64_t l = left->val, r = right->val, v;
+    switch(node.op) {
+        case '+': v = l + r; break;
+        case '-': v = l - r; break;
+        case '<': v = l < r; break;
+        default: return;
+    }
+    if(v < std::numeric_limits<int>::min() || v > std::numeric_limits<int>::max()) return;
+
+    bool isDouble = node.op != '<' && (left->isDouble || right->isDouble);
+    replacement = makeNode<NumLiteral>(arena, int(v), isDouble);
+}
+
+// The branch an if with a literal condition always takes, unless the other one declares a
+// variable: that stays defined after the if whichever branch runs. If the if's value is used, it
+// has the type of both branches joined, so the live one only takes its place if that is the same:
+// an integer in place of a double would change what the value flows into to wrapping arithmetic.
+Block* ASTOptimizer::liveBranch(IfExpr& node, bool valueUsed) {
+    auto* cond = dynamic_cast<NumLiteral*>(node.cond.get());
+    if(!cond) return nullptr;
+
+    Block* live = cond->val ? node.then.get() : node.elss.get();
+    Block* dead = cond->val ? node.elss.get() : node.then.get();
+    if(summarize(*dead).declares) return nullptr;
+    if(valueUsed && !dead->exprs.empty() && mayBeDouble(*dead->exprs.back())
+       && (live->exprs.empty() || !isDouble(*live->exprs.back(), doubles))) {
+        return nullptr;
+    }
+    return live;
+}
+
+void ASTOptimizer::visit(IfExpr& node) {
+    optimize(node.cond);
+    node.then->accept(*this);
+    node.elss->accept(*this);
+
+    // in an expression only a single expression can take the if's place; Block splices the rest
+    Block* live = liveBranch(node, true);
+    if(live && live->exprs.size() == 1) replacement = std::move(live->exprs[0]);
+}
+
+void ASTOptimizer::visit(CallExpr& node) {
+    for(auto& a : node.args) optimize(a);
+    replacement = inlineCall(node);
+    if(!replacement) replacement = evaluateCall(node);
+}
+
+std::unique_ptr<Expr> ASTOptimizer::inlineCall(CallExpr& node) {
+    auto it = inlinable.find(node.name.id);
+    if(it == inlinable.end() || it->second.params.size() != node.args.size()) return nullptr;
+    const Inlinable& f = it->second;
+
+    // each argument is copied once per use of its parameter, so it must be free of effects, and
+    // the copies count against the budget. The call converts its arguments to doubles, and the body
+    // only computes the same way without one if they already are: integers add in 64 bits and wrap.
+    Summary body = summarize(*f.body);
+    Substitution subst;
+    unsigned size = body.size;
+    for(size_t i = 0; i < node.args.size(); i++) {
+        Summary arg = summarize(*node.args[i]);
+        if(arg.Effects() || !isDouble(*node.args[i], doubles)) return nullptr;
+
+        subst[f.params[i].id] = node.args[i].get();
+        auto uses = std::count(body.reads.begin(), body.reads.end(), f.params[i]);
+        size += (arg.size - 1) * unsigned(uses);
+    }
+    if(size > budget) return nullptr;
+
+    // the copy is optimized again, now that literal arguments can fold
+    Cloner copy(arena, subst);
+    std::unique_ptr<Expr> inlined = copy.Clone(*f.body);
+    optimize(inlined);
+    return inlined;
+}
+
+std::unique_ptr<Expr> ASTOptimizer::evaluateCall(CallExpr& node) {
+    std::vector<double> args;
+    for(auto& a : node.args) {
+        auto* literal = dynamic_cast<NumLiteral*>(a.get());
+        if(!literal) return nullptr;
+        args.push_back(literal->val);
+    }
+
+    // the call is a double, which a literal can only stand for if it is a whole number; the literal
+    // stays a double so that whatever it flows into is typed as the call would have been
+    auto result = evaluator.Call(node.name, args);
+    if(!result || *result != std::trunc(*result) || (*result == 0 && std::signbit(*result))) return nullptr;
+    if(*result < std::numeric_limits<int>::min() || *result > std::numeric_limits<int>::max()) return nullptr;
+
+    return makeNode<NumLiteral>(arena, int(*result), true);
+}
+
+void ASTOptimizer::visit(LoopExpr& node) {
+    optimize(node.rangeStart);
+    optimize(node.rangeEnd);
+    optimize(node.step);
+    node.block->accept(*this);
+}
+
+void ASTOptimizer::visit(VarInitExpr& node) {
+    optimize(node.val);
+}
+
+void ASTOptimizer::visit(AssignExpr& node) {
+    optimize(node.val);
+}
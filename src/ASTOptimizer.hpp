@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Evaluator.hpp"
+#include "Symbol.hpp"
+
+// Simplifies the AST before codegen:
+// - BinOps of two literals are folded (when the result still fits a literal)
+// - an if with a literal condition is replaced by its live branch
+// - block expressions other than the last are dropped if they have no effects
+// - calls to small functions whose body is a single expression that doesn't assign, declare or
+//   loop, and that don't call themselves, are replaced by the body with the arguments substituted
+//   for the parameters, as long as the arguments have no effects either and are doubles already
+// - other calls with literal arguments are run by the Evaluator and replaced by the result, if it
+//   finishes within its budgets and the result is a whole number that fits a literal, which is
+//   marked as a double like the call
+// Callees are defined before their callers, so the optimizer keeps a copy of every function it can
+// inline as it goes, and works the same on a whole Program as on definitions streamed one at a time.
+class ASTOptimizer : public Visitor {
+private:
+    struct Inlinable {
+        std::vector<Symbol> params;
+        std::unique_ptr<Expr> body;  // on the heap, outliving the Program it came from
+    };
+
+    unsigned budget;  // nodes an inlined call may grow to
+    std::unordered_map<std::uint32_t, Inlinable> inlinable;
+    Evaluator evaluator;
+    Arena* arena;                      // new nodes go where the definition being optimized lives
+    std::unique_ptr<Expr> replacement;  // set by a visit to replace the node it visited
+    std::vector<Symbol> doubles;        // variables of the function being optimized that are always doubles
+
+    void optimize(std::unique_ptr<Expr>& e);
+    Block* liveBranch(IfExpr& node, bool valueUsed);
+    std::unique_ptr<Expr> inlineCall(CallExpr& node);
+    std::unique_ptr<Expr> evaluateCall(CallExpr& node);
+
+public:
+    explicit ASTOptimizer(unsigned budget = 32) : budget(budget), arena(nullptr) {}
+
+    void visit(Program& node) override;
+    void visit(FuncDef& node) override;
+    void visit(Block& node) override;
+    void visit(Extern& node) override;
+    void visit(VarExpr& node) override;
+    void visit(NumLiteral& node) override;
+    void visit(BinOp& node) override;
+    void visit(IfExpr& node) override;
+    void visit(CallExpr& node) override;
+    void visit(LoopExpr& node) override;
+    void visit(VarInitExpr& node) override;
+    void visit(AssignExpr& node) override;
+};
@@ -0,0 +1,59 @@
+#include "Bytecode.hpp"
+
+#include <cmath>
+
+// the runtime in JIT.cpp
+extern "C" double printd(double x);
+extern "C" double putchard(double x);
+
+#define X(name) case Op::name: return #name;
+const char* string_of_op(Op op) {
+    switch(op) { BYTECODE_OPS }
+    return "?";
+}
+#undef X
+
+NativeRegistry::NativeRegistry() {
+    Add(Symbol::intern("printd"), 1, [](const double* a) { return printd(a[0]); });
+    Add(Symbol::intern("putchard"), 1, [](const double* a) { return putchard(a[0]); });
+    Add(Symbol::intern("sin"), 1, [](const double* a) { return std::sin(a[0]); });
+    Add(Symbol::intern("cos"), 1, [](const double* a) { return std::cos(a[0]); });
+    Add(Symbol::intern("sqrt"), 1, [](const double* a) { return std::sqrt(a[0]); });
+    Add(Symbol::intern("exp"), 1, [](const double* a) { return std::exp(a[0]); });
+    Add(Symbol::intern("log"), 1, [](const double* a) { return std::log(a[0]); });
+    Add(Symbol::intern("fabs"), 1, [](const double* a) { return std::fabs(a[0]); });
+    Add(Symbol::intern("pow"), 2, [](const double* a) { return std::pow(a[0], a[1]); });
+}
+
+void NativeRegistry::Add(Symbol name, unsigned arity, Fn fn) {
+    auto it = index.find(name.id);
+    if(it != index.end()) {
+        natives[it->second] = {name, arity, fn};
+        return;
+    }
+    index[name.id] = natives.size();
+    natives.push_back({name, arity, fn});
+}
+
+const NativeRegistry::Native* NativeRegistry::Find(Symbol name) const {
+    auto it = index.find(name.id);
+    return it == index.end() ? nullptr : &natives[it->second];
+}
+
+const BytecodeFunction* BytecodeModule::Find(Symbol name) const {
+    auto it = index.find(name.id);
+    return it == index.end() ? nullptr : &functions[it->second];
+}
+
+void BytecodeModule::Print(std::ostream& os) const {
+    for(const auto& f : functions) {
+        os << f.name << " (" << f.params << " params, " << f.regs << " registers)\n";
+        for(std::size_t pc = 0; pc < f.code.size(); pc++) {
+            const Instr& in = f.code[pc];
+            os << '\t' << pc << '\t' << string_of_op(in.op) << ' ' << in.a << ' ' << in.b << ' ' << in.c;
+            if(in.op == Op::CALL) os << "\t; " << functions[in.b].name;
+            if(in.op == Op::NATIVE) os << "\t; " << natives[in.b].name;
+            os << '\n';
+        }
+    }
+}
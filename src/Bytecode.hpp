@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "Symbol.hpp"
+
+// X(name): the instructions of the bytecode VM. Operands a, b and c are register numbers in the
+// frame of the running function unless noted; integers and bools (0 or 1) live in the i side of a
+// register and doubles in the d side, with the types TypeInference gives them, so no instruction
+// checks a type at run time. Jump targets are instruction numbers in the function.
+#define BYTECODE_OPS \
+    X(LOADI)    /* a = b | c << 16 as a signed 32-bit integer */ \
+    X(LOADI_D)  /* a = the same immediate as a double */ \
+    X(MOV)      /* a = b */ \
+    X(I2D)      /* a = double(b) */ \
+    X(ADD_I)    /* a = b + c, wrapping */ \
+    X(SUB_I)    /* a = b - c, wrapping */ \
+    X(ADDK_I)   /* a = b + c as a signed 16-bit constant */ \
+    X(LT_I)     /* a = b < c */ \
+    X(ADD_D)    /* a = b + c */ \
+    X(SUB_D)    /* a = b - c */ \
+    X(ADDK_D)   /* a = b + c as a signed 16-bit constant */ \
+    X(LT_D)     /* a = b < c or either is NaN */ \
+    X(TRUE_D)   /* a = b != 0, false for NaN */ \
+    X(JMP)      /* jump to c */ \
+    X(JF)       /* jump to c if a is 0 */ \
+    X(JNLT_I)   /* jump to c unless a < b */ \
+    X(JNLT_D)   /* jump to c unless a < b or either is NaN */ \
+    X(JNE_I)    /* jump to c if a != b */ \
+    X(JNE_D)    /* jump to c if a < b or a > b */ \
+    X(CALL)     /* a = function b, with its arguments in c and up, which become its frame */ \
+    X(NATIVE)   /* a = native b, with its arguments in c and up */ \
+    X(RET)      /* return a */
+
+#define X(name) name,
+enum class Op : std::uint16_t {
+    BYTECODE_OPS
+};
+#undef X
+
+const char* string_of_op(Op op);
+
+struct Instr {
+    Op op;
+    std::uint16_t a;
+    std::uint16_t b;
+    std::uint16_t c;
+};
+
+union Reg {
+    std::int64_t i;
+    double d;
+};
+
+// Functions the bytecode can call that aren't written in the language, standing in for the externs
+// the JIT resolves against the host process. Every native takes and returns doubles, like every
+// compiled function.
+class NativeRegistry {
+public:
+    using Fn = double (*)(const double* args);
+
+    struct Native {
+        Symbol name;
+        unsigned arity;
+        Fn fn;
+    };
+
+private:
+    std::vector<Native> natives;
+    std::unordered_map<std::uint32_t, std::size_t> index;
+
+public:
+    // the JIT's runtime (printd, putchard) and the usual libm functions
+    NativeRegistry();
+
+    // replaces an earlier native of the same name
+    void Add(Symbol name, unsigned arity, Fn fn);
+
+    const Native* Find(Symbol name) const;
+};
+
+struct BytecodeFunction {
+    Symbol name;
+    unsigned params;  // arguments arrive in registers 0 to params - 1
+    unsigned regs;    // size of the frame
+    std::vector<Instr> code;
+};
+
+// A whole program: functions call each other by their number here and natives by theirs.
+struct BytecodeModule {
+    std::vector<BytecodeFunction> functions;
+    std::unordered_map<std::uint32_t, std::size_t> index;  // function number by name
+    std::vector<NativeRegistry::Native> natives;
+
+    const BytecodeFunction* Find(Symbol name) const;
+    void Print(std::ostream& os) const;
+};
@@ -0,0 +1,450 @@
+#include "BytecodeGen.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+
+namespace {
+
+// Operands and jump targets are 16 bits
+constexpr unsigned maxOperand = 0xFFFF;
+
+// Whether evaluating an expression can change a variable that is already in scope. A call can't:
+// the callee's frame starts above every register the caller still needs.
+class AssignScan : public Visitor {
+public:
+    bool assigns = false;
+
+    void visit(Program&) override {}
+    void visit(FuncDef&) override {}
+    void visit(Extern&) override {}
+    void visit(VarExpr&) override {}
+    void visit(NumLiteral&) override {}
+
+    void visit(Block& node) override {
+        for(auto& e : node.exprs) e->accept(*this);
+    }
+
+    void visit(BinOp& node) override {
+        node.left->accept(*this);
+        node.right->accept(*this);
+    }
+
+    void visit(IfExpr& node) override {
+        node.cond->accept(*this);
+        node.then->accept(*this);
+        node.elss->accept(*this);
+    }
+
+    void visit(CallExpr& node) override {
+        for(auto& a : node.args) a->accept(*this);
+    }
+
+    // the loop's own variable is a new one
+    void visit(LoopExpr& node) override {
+        node.rangeStart->accept(*this);
+        node.rangeEnd->accept(*this);
+        node.block->accept(*this);
+        node.step->accept(*this);
+    }
+
+    void visit(VarInitExpr& node) override { node.val->accept(*this); }
+
+    void visit(AssignExpr&) override { assigns = true; }
+};
+
+bool assigns(Expr& node) {
+    AssignScan scan;
+    node.accept(scan);
+    return scan.assigns;
+}
+
+}  // namespace
+
+BytecodeGen::BytecodeGen(const NativeRegistry& registry)
+    : registry(registry), f(nullptr), top(0), dest(0), fail(false) {}
+
+void BytecodeGen::error(std::string message) {
+    fail = true;
+    std::cerr << "BytecodeGen: " << message << std::endl;
+}
+
+std::size_t BytecodeGen::emit(Op op, unsigned a, unsigned b, unsigned c) {
+    if(here() == maxOperand) error("function too long: " + f->name.str());
+    f->code.push_back({op, std::uint16_t(a), std::uint16_t(b), std::uint16_t(c)});
+    return here() - 1;
+}
+
+void BytecodeGen::patch(std::size_t jump, std::size_t target) {
+    f->code[jump].c = std::uint16_t(target);
+}
+
+unsigned BytecodeGen::temp() {
+    if(top == maxOperand) {
+        error("too many registers in " + f->name.str());
+        return 0;
+    }
+    unsigned reg = top++;
+    f->regs = std::max(f->regs, top);
+    return reg;
+}
+
+ValueType BytecodeGen::typeOf(const Expr& node) const {
+    auto it = notes.types.find(&node);
+    if(it == notes.types.end() || it->second == ValueType::None) return ValueType::Int;
+    return it->second;
+}
+
+void BytecodeGen::compile(Expr& node, unsigned to) {
+    dest = to;
+    node.accept(*this);
+}
+
+void BytecodeGen::compile(Expr& node, unsigned to, ValueType type) {
+    auto* lit = dynamic_cast<NumLiteral*>(&node);
+    if(lit && type == ValueType::Double) {
+        emit(Op::LOADI_D, to, std::uint32_t(lit->val) & 0xFFFF, std::uint32_t(lit->val) >> 16);
+        return;
+    }
+    compile(node, to);
+    widen(to, typeOf(node), type);
+}
+
+void BytecodeGen::compile(Block& node, unsigned to, ValueType type) {
+    if(node.exprs.empty()) {
+        emit(Op::LOADI, to);
+        widen(to, ValueType::Int, type);
+        return;
+    }
+
+    for(std::size_t i = 0; i + 1 < node.exprs.size(); i++) discard(*node.exprs[i]);
+    compile(*node.exprs.back(), to, type);
+}
+
+void BytecodeGen::discard(Expr& node) {
+    unsigned mark = top;
+    compile(node, temp());
+    top = mark;
+}
+
+// bools are already 0 or 1, so only a double needs converting to; no value is ever narrowed
+void BytecodeGen::widen(unsigned reg, ValueType from, ValueType to) {
+    if(to == ValueType::Double && from != ValueType::Double) emit(Op::I2D, reg, reg);
+}
+
+unsigned BytecodeGen::operand(Expr& node) {
+    if(auto* var = dynamic_cast<VarExpr*>(&node)) {
+        auto it = env.find(var->name.id);
+        if(it != env.end()) return it->second;
+    }
+    unsigned reg = temp();
+    compile(node, reg);
+    return reg;
+}
+
+unsigned BytecodeGen::operand(Expr& node, ValueType type) {
+    if(type != ValueType::Double || typeOf(node) == ValueType::Double) return operand(node);
+
+    // a variable keeps its own type, so it is converted into a temporary
+    unsigned reg = temp();
+    compile(node, reg, type);
+    return reg;
+}
+
+bool BytecodeGen::operands(BinOp& node, unsigned& left, unsigned& right) {
+    bool fp = join(typeOf(*node.left), typeOf(*node.right)) == ValueType::Double;
+    ValueType type = fp ? ValueType::Double : ValueType::Int;
+
+    // a variable on the left is read after the right side runs, so if that can assign to it, its
+    // value is copied first
+    if(assigns(*node.right)) {
+        left = temp();
+        compile(*node.left, left, type);
+    }
+    else {
+        left = operand(*node.left, type);
+    }
+    right = operand(*node.right, type);
+    return fp;
+}
+
+void BytecodeGen::visit(Program& node) {
+    for(const auto& e : node.externs) e->accept(*this);
+
+    // number every function first, so a call can come before the definition
+    for(const auto& fd : node.func_defs) {
+        if(module.index.count(fd->name.id)) {
+            error("redefined function: " + fd->name.str());
+            continue;
+        }
+        module.index[fd->name.id] = module.functions.size();
+        module.functions.push_back({fd->name, unsigned(fd->params.size()), 0, {}});
+    }
+    if(module.functions.size() > maxOperand) error("too many functions");
+    if(fail) return;
+
+    for(const auto& fd : node.func_defs) fd->accept(*this);
+}
+
+void BytecodeGen::visit(FuncDef& node) {
+    auto it = module.index.find(node.name.id);
+    if(it == module.index.end()) {
+        it = module.index.emplace(node.name.id, module.functions.size()).first;
+        module.functions.push_back({node.name, unsigned(node.params.size()), 0, {}});
+    }
+    f = &module.functions[it->second];
+
+    notes = {};
+    types = TypeInference().Function(node, &notes);
+    if(types.size() > maxOperand) {
+        error("too many variables in " + node.name.str());
+        return;
+    }
+
+    env.clear();
+    for(std::size_t i = 0; i < node.params.size(); i++) env[node.params[i].id] = unsigned(i);
+    top = unsigned(types.size());
+    f->regs = top;
+
+    // functions return doubles
+    unsigned res = temp();
+    compile(*node.block, res, ValueType::Double);
+    emit(Op::RET, res);
+}
+
+void BytecodeGen::visit(Block& node) {
+    compile(node, dest, node.exprs.empty() ? ValueType::Int : typeOf(*node.exprs.back()));
+}
+
+void BytecodeGen::visit(Extern& node) {
+    const auto* native = registry.Find(node.name);
+    if(!native) {
+        error("unknown extern: " + node.name.str());
+        return;
+    }
+    if(native->arity != node.params.size()) {
+        error("extern " + node.name.str() + " takes " + std::to_string(native->arity) + " arguments");
+        return;
+    }
+    if(!externs.count(node.name.id)) {
+        externs[node.name.id] = module.natives.size();
+        module.natives.push_back(*native);
+    }
+}
+
+void BytecodeGen::visit(VarExpr& node) {
+    auto it = env.find(node.name.id);
+    if(it == env.end()) {
+        error("unknown variable: " + node.name.str());
+        return;
+    }
+    if(it->second != dest) emit(Op::MOV, dest, it->second);
+}
+
+void BytecodeGen::visit(NumLiteral& node) {
+    emit(node.isDouble ? Op::LOADI_D : Op::LOADI, dest, std::uint32_t(node.val) & 0xFFFF, std::uint32_t(node.val) >> 16);
+}
+
+void BytecodeGen::visit(BinOp& node) {
+    unsigned to = dest;
+    unsigned mark = top;
+
+    // x + k and x - k take a small constant from the instruction
+    auto* lit = dynamic_cast<NumLiteral*>(node.right.get());
+    if(lit && !lit->isDouble && (node.op == '+' || node.op == '-')) {
+        std::int64_t k = node.op == '-' ? -std::int64_t(lit->val) : std::int64_t(lit->val);
+        if(k >= INT16_MIN && k <= INT16_MAX) {
+            bool fp = typeOf(*node.left) == ValueType::Double;
+            unsigned left = operand(*node.left);
+            emit(fp ? Op::ADDK_D : Op::ADDK_I, to, left, std::uint16_t(std::int16_t(k)));
+            top = mark;
+            return;
+        }
+    }
+
+    unsigned left, right;
+    bool fp = operands(node, left, right);
+    switch(node.op) {
+        case '+':
+            emit(fp ? Op::ADD_D : Op::ADD_I, to, left, right);
+            break;
+        case '-':
+            emit(fp ? Op::SUB_D : Op::SUB_I, to, left, right);
+            break;
+        case '<':
+            emit(fp ? Op::LT_D : Op::LT_I, to, left, right);
+            break;
+        default:
+            error(std::string("invalid binary operator: ") + node.op);
+    }
+    top = mark;
+}
+
+void BytecodeGen::visit(IfExpr& node) {
+    unsigned to = dest;
+    unsigned mark = top;
+    ValueType type = typeOf(node);
+
+    // a comparison branches on its operands instead of materializing a bool
+    std::size_t skip;
+    auto* cmp = dynamic_cast<BinOp*>(node.cond.get());
+    if(cmp && cmp->op == '<') {
+        unsigned left, right;
+        bool fp = operands(*cmp, left, right);
+        skip = emit(fp ? Op::JNLT_D : Op::JNLT_I, left, right);
+    }
+    else {
+        unsigned cond = operand(*node.cond);
+        if(typeOf(*node.cond) == ValueType::Double) {
+            unsigned t = temp();
+            emit(Op::TRUE_D, t, cond);
+            cond = t;
+        }
+        skip = emit(Op::JF, cond);
+    }
+    top = mark;
+
+    compile(*node.then, to, type);
+    std::size_t done = emit(Op::JMP);
+    patch(skip, here());
+    compile(*node.elss, to, type);
+    patch(done, here());
+}
+
+void BytecodeGen::visit(CallExpr& node) {
+    unsigned to = dest;
+    unsigned mark = top;
+
+    Op op;
+    std::size_t callee;
+    unsigned arity;
+    if(auto it = module.index.find(node.name.id); it != module.index.end()) {
+        op = Op::CALL;
+        callee = it->second;
+        arity = module.functions[callee].params;
+    }
+    else if(auto ext = externs.find(node.name.id); ext != externs.end()) {
+        op = Op::NATIVE;
+        callee = ext->second;
+        arity = module.natives[callee].arity;
+    }
+    else {
+        error("unknown function: " + node.name.str());
+        return;
+    }
+
+    if(node.args.size() != arity) {
+        error("wrong number of arguments to " + node.name.str());
+        return;
+    }
+
+    // the arguments go in consecutive registers on top, where the callee's frame starts
+    unsigned base = top;
+    for(std::size_t i = 0; i < arity; i++) temp();
+    for(std::size_t i = 0; i < arity; i++) compile(*node.args[i], base + unsigned(i), ValueType::Double);
+
+    emit(op, to, unsigned(callee), base);
+    top = mark;
+}
+
+// LLVMGen::genLoopExpr: the body runs, the step is added to the variable, and the loop ends once
+// the variable equals the end, compared in the wider of their types
+void BytecodeGen::visit(LoopExpr& node) {
+    unsigned to = dest;
+    unsigned mark = top;
+
+    auto slot = notes.vars.find(&node);
+    if(slot == notes.vars.end()) {
+        error("untyped loop variable: " + node.name.str());
+        return;
+    }
+    unsigned var = unsigned(slot->second);
+    ValueType type = types[var];
+
+    compile(*node.rangeStart, var, type);
+    unsigned end = temp();
+    ValueType endType = typeOf(*node.rangeEnd);
+    bool fp = join(type, endType) == ValueType::Double;
+    compile(*node.rangeEnd, end, fp ? ValueType::Double : endType);
+
+    std::optional<unsigned> old;
+    if(auto it = env.find(node.name.id); it != env.end()) old = it->second;
+    env[node.name.id] = var;
+
+    std::size_t body = here();
+    compile(*node.block, temp(), ValueType::None);
+    top = end + 1;
+
+    auto* lit = dynamic_cast<NumLiteral*>(node.step.get());
+    if(lit && lit->val >= INT16_MIN && lit->val <= INT16_MAX) {
+        emit(type == ValueType::Double ? Op::ADDK_D : Op::ADDK_I, var, var, std::uint16_t(std::int16_t(lit->val)));
+    }
+    else {
+        unsigned step = operand(*node.step, type);
+        emit(type == ValueType::Double ? Op::ADD_D : Op::ADD_I, var, var, step);
+    }
+
+    top = end + 1;
+
+    unsigned cur = var;
+    if(fp && type != ValueType::Double) {
+        cur = temp();
+        emit(Op::I2D, cur, var);
+    }
+    emit(fp ? Op::JNE_D : Op::JNE_I, cur, end, unsigned(body));
+
+    if(old) env[node.name.id] = *old;
+    else env.erase(node.name.id);
+    top = mark;
+
+    emit(Op::LOADI, to);
+}
+
+void BytecodeGen::visit(VarInitExpr& node) {
+    unsigned to = dest;
+    if(env.count(node.name.id)) {
+        error("redefined variable: " + node.name.str());
+        return;
+    }
+
+    auto slot = notes.vars.find(&node);
+    if(slot == notes.vars.end()) {
+        error("untyped variable: " + node.name.str());
+        return;
+    }
+    unsigned var = unsigned(slot->second);
+
+    // the value of the declaration is the value before it's converted to the variable's type
+    compile(*node.val, var);
+    if(var != to) emit(Op::MOV, to, var);
+    widen(var, typeOf(*node.val), types[var]);
+    env[node.name.id] = var;
+}
+
+void BytecodeGen::visit(AssignExpr& node) {
+    unsigned to = dest;
+    unsigned mark = top;
+
+    auto* lhs = dynamic_cast<VarExpr*>(node.lhs.get());
+    auto it = lhs ? env.find(lhs->name.id) : env.end();
+    if(it == env.end()) {
+        error("lhs of assign is not a variable");
+        return;
+    }
+    unsigned var = it->second;
+
+    // the value goes in a temporary first if converting it would change the result
+    ValueType from = typeOf(*node.val);
+    if(from == types[var]) {
+        compile(*node.val, var);
+        if(var != to) emit(Op::MOV, to, var);
+    }
+    else {
+        unsigned val = to == var ? temp() : to;
+        compile(*node.val, val);
+        emit(Op::MOV, var, val);
+        widen(var, from, types[var]);
+        if(val != to) emit(Op::MOV, to, val);
+    }
+    top = mark;
+}
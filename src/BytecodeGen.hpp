@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Bytecode.hpp"
+#include "Symbol.hpp"
+#include "TypeInference.hpp"
+
+// Compiles a whole program to register bytecode for the VM, for running it without waiting on LLVM.
+// Each function gets a frame of registers: its variables first, numbered as TypeInference numbers
+// them (so the parameters come first), then temporaries, allocated and freed as a stack while an
+// expression is compiled. Values have the types TypeInference gives them and are converted where
+// LLVMGen converts them, so a program computes the same results on both backends. Calls go to
+// functions of the program by number, which may be defined after the call, and externs to the
+// natives of the registry.
+class BytecodeGen : public Visitor {
+private:
+    const NativeRegistry& registry;
+    std::unordered_map<std::uint32_t, std::size_t> externs;  // native number by name
+
+    BytecodeFunction* f;
+    std::vector<ValueType> types;
+    TypeInference::Annotations notes;
+    std::unordered_map<std::uint32_t, unsigned> env;  // register of each variable in scope
+    unsigned top;                                     // first free register
+    unsigned dest;                                    // where the expression being visited goes
+    bool fail;
+
+    void error(std::string message);
+
+    std::size_t emit(Op op, unsigned a = 0, unsigned b = 0, unsigned c = 0);
+    std::size_t here() const { return f->code.size(); }
+    void patch(std::size_t jump, std::size_t target);
+
+    unsigned temp();
+    ValueType typeOf(const Expr& node) const;
+
+    void compile(Expr& node, unsigned to);
+    void compile(Expr& node, unsigned to, ValueType type);
+    void compile(Block& node, unsigned to, ValueType type);
+    void discard(Expr& node);
+    void widen(unsigned reg, ValueType from, ValueType to);
+
+    // a register holding the value: a variable's own, or a new temporary
+    unsigned operand(Expr& node);
+    unsigned operand(Expr& node, ValueType type);
+
+    // both operands of node in the type it computes in, true for doubles
+    bool operands(BinOp& node, unsigned& left, unsigned& right);
+
+public:
+    BytecodeModule module;
+
+    explicit BytecodeGen(const NativeRegistry& registry);
+
+    bool Failed() const { return fail; }
+
+    void visit(Program& node) override;
+    void visit(FuncDef& node) override;
+    void visit(Block& node) override;
+    void visit(Extern& node) override;
+    void visit(VarExpr& node) override;
+    void visit(NumLiteral& node) override;
+    void visit(BinOp& node) override;
+    void visit(IfExpr& node) override;
+    void visit(CallExpr& node) override;
+    void visit(LoopExpr& node) override;
+    void visit(VarInitExpr& node) override;
+    void visit(AssignExpr& node) override;
+};
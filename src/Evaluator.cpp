@@ -0,0 +1,303 @@
+#include "Evaluator.hpp"
+
+#include <cstring>
+
+namespace {
+
+using Value = Evaluator::Value;
+
+Value boolValue(bool b) {
+    Value v{};
+    v.type = ValueType::Bool;
+    v.b = b;
+    return v;
+}
+
+Value intValue(std::int64_t i) {
+    Value v{};
+    v.type = ValueType::Int;
+    v.i = i;
+    return v;
+}
+
+Value doubleValue(double d) {
+    Value v{};
+    v.type = ValueType::Double;
+    v.d = d;
+    return v;
+}
+
+// LLVMGen::convert: bools are 0 or 1, integers round to the nearest double
+Value convert(Value v, ValueType to) {
+    if(v.type == to) return v;
+    switch(to) {
+        case ValueType::Double:
+            return doubleValue(v.type == ValueType::Bool ? double(v.b) : double(v.i));
+        case ValueType::Int:
+            if(v.type == ValueType::Bool) return intValue(v.b);
+            return intValue(std::int64_t(v.d));
+        default:
+            return boolValue(v.type == ValueType::Int ? v.i & 1 : v.d != 0);
+    }
+}
+
+// LLVMGen::isTrue; a NaN double is false
+bool isTrue(Value v) {
+    switch(v.type) {
+        case ValueType::Bool:
+            return v.b;
+        case ValueType::Int:
+            return v.i != 0;
+        default:
+            return v.d < 0 || v.d > 0;
+    }
+}
+
+// + and - on i64 wrap
+std::int64_t wrap(std::uint64_t i) {
+    return std::int64_t(i);
+}
+
+std::uint64_t bits(double d) {
+    std::uint64_t b;
+    std::memcpy(&b, &d, sizeof(b));
+    return b;
+}
+
+}  // namespace
+
+void Evaluator::Define(std::unique_ptr<FuncDef> def) {
+    Symbol name = def->name;
+
+    // results of an earlier definition of the same name no longer hold
+    auto it = memo.lower_bound({name.id, {}});
+    while(it != memo.end() && it->first.first == name.id) it = memo.erase(it);
+
+    Function f;
+    f.types = TypeInference().Function(*def, &f.notes);
+    f.def = std::move(def);
+    functions[name.id] = std::move(f);
+}
+
+std::optional<double> Evaluator::Call(Symbol name, const std::vector<double>& args) {
+    frame = nullptr;
+    steps = 0;
+    depth = 0;
+    ok = true;
+    return invoke(name, args);
+}
+
+bool Evaluator::step() {
+    if(++steps > max_steps) ok = false;
+    return ok;
+}
+
+std::optional<double> Evaluator::invoke(Symbol name, const std::vector<double>& args) {
+    auto it = functions.find(name.id);
+    if(it == functions.end() || it->second.def->params.size() != args.size()) return std::nullopt;
+    const Function& f = it->second;
+
+    std::pair<std::uint32_t, std::vector<std::uint64_t>> key{name.id, {}};
+    for(double a : args) key.second.push_back(bits(a));
+    auto hit = memo.find(key);
+    if(hit != memo.end()) return hit->second;
+
+    if(depth >= max_depth) return std::nullopt;
+
+    Frame callee{&f, std::vector<std::optional<Value>>(f.types.size()), {}};
+    for(std::size_t i = 0; i < args.size(); i++) {
+        callee.vars[i] = doubleValue(args[i]);
+        callee.env[f.def->params[i].id] = i;
+    }
+
+    Frame* caller = frame;
+    frame = &callee;
+    depth++;
+    f.def->block->accept(*this);
+    depth--;
+    frame = caller;
+    if(!ok) return std::nullopt;
+
+    // functions return doubles
+    double result = convert(res, ValueType::Double).d;
+    memo.emplace(std::move(key), result);
+    return result;
+}
+
+void Evaluator::visit(Program&) {}
+void Evaluator::visit(FuncDef&) {}
+void Evaluator::visit(Extern&) {}
+
+void Evaluator::visit(Block& node) {
+    for(auto& e : node.exprs) {
+        e->accept(*this);
+        if(!ok) return;
+    }
+}
+
+void Evaluator::visit(VarExpr& node) {
+    if(!step()) return;
+
+    auto it = frame->env.find(node.name.id);
+    if(it == frame->env.end() || !frame->vars[it->second]) {
+        ok = false;
+        return;
+    }
+    res = *frame->vars[it->second];
+}
+
+void Evaluator::visit(NumLiteral& node) {
+    if(!step()) return;
+    res = node.isDouble ? doubleValue(node.val) : intValue(node.val);
+}
+
+void Evaluator::visit(BinOp& node) {
+    if(!step()) return;
+
+    node.left->accept(*this);
+    if(!ok) return;
+    Value left = res;
+    node.right->accept(*this);
+    if(!ok) return;
+
+    ValueType type = join(ValueType::Int, join(left.type, res.type));
+    Value l = convert(left, type);
+    Value r = convert(res, type);
+    bool fp = type == ValueType::Double;
+
+    switch(node.op) {
+        case '-':
+            res = fp ? doubleValue(l.d - r.d) : intValue(wrap(std::uint64_t(l.i) - std::uint64_t(r.i)));
+            return;
+        case '+':
+            res = fp ? doubleValue(l.d + r.d) : intValue(wrap(std::uint64_t(l.i) + std::uint64_t(r.i)));
+            return;
+        case '<':
+            // unordered or less than, as in FCmpULT
+            res = boolValue(fp ? !(l.d >= r.d) : l.i < r.i);
+            return;
+        default:
+            ok = false;
+            return;
+    }
+}
+
+void Evaluator::visit(IfExpr& node) {
+    if(!step()) return;
+
+    node.cond->accept(*this);
+    if(!ok) return;
+
+    if(isTrue(res)) node.then->accept(*this);
+    else node.elss->accept(*this);
+    if(!ok) return;
+
+    // the merge takes the wider type of the two branches
+    auto type = frame->f->notes.types.find(&node);
+    if(type == frame->f->notes.types.end()) {
+        ok = false;
+        return;
+    }
+    res = convert(res, type->second);
+}
+
+void Evaluator::visit(CallExpr& node) {
+    if(!step()) return;
+
+    std::vector<double> args;
+    for(auto& a : node.args) {
+        a->accept(*this);
+        if(!ok) return;
+        args.push_back(convert(res, ValueType::Double).d);
+    }
+
+    auto result = invoke(node.name, args);
+    if(!result) {
+        ok = false;
+        return;
+    }
+    res = doubleValue(*result);
+}
+
+// LLVMGen::genLoopExpr: the body runs, the step is added to the variable, and the loop ends once
+// the variable equals the end (ordered on doubles, so a NaN ends it too). The counted form LLVMGen
+// uses when it can runs the same iterations.
+void Evaluator::visit(LoopExpr& node) {
+    if(!step()) return;
+
+    node.rangeStart->accept(*this);
+    if(!ok) return;
+    Value start = res;
+    node.rangeEnd->accept(*this);
+    if(!ok) return;
+    Value end = res;
+
+    auto slot = frame->f->notes.vars.find(&node);
+    if(slot == frame->f->notes.vars.end()) {
+        ok = false;
+        return;
+    }
+    std::size_t var = slot->second;
+    ValueType type = frame->f->types[var];
+
+    auto old = frame->env.find(node.name.id);
+    std::optional<std::size_t> oldVar;
+    if(old != frame->env.end()) oldVar = old->second;
+    frame->env[node.name.id] = var;
+    frame->vars[var] = convert(start, type);
+
+    while(true) {
+        node.block->accept(*this);
+        if(!ok) return;
+        node.step->accept(*this);
+        if(!ok) return;
+
+        Value cur = *frame->vars[var];
+        Value inc = convert(res, type);
+        Value next = type == ValueType::Double ? doubleValue(cur.d + inc.d)
+                                               : intValue(wrap(std::uint64_t(cur.i) + std::uint64_t(inc.i)));
+        frame->vars[var] = next;
+
+        ValueType cmp = join(type, end.type);
+        Value a = convert(next, cmp);
+        Value b = convert(end, cmp);
+        bool more = cmp == ValueType::Double ? a.d < b.d || a.d > b.d : a.i != b.i;
+        if(!more || !step()) break;
+    }
+    if(!ok) return;
+
+    if(oldVar) frame->env[node.name.id] = *oldVar;
+    else frame->env.erase(node.name.id);
+
+    res = intValue(0);
+}
+
+void Evaluator::visit(VarInitExpr& node) {
+    if(!step()) return;
+
+    node.val->accept(*this);
+    if(!ok) return;
+
+    auto slot = frame->f->notes.vars.find(&node);
+    if(slot == frame->f->notes.vars.end()) {
+        ok = false;
+        return;
+    }
+    frame->vars[slot->second] = convert(res, frame->f->types[slot->second]);
+    frame->env[node.name.id] = slot->second;
+}
+
+void Evaluator::visit(AssignExpr& node) {
+    if(!step()) return;
+
+    node.val->accept(*this);
+    if(!ok) return;
+
+    auto* lhs = dynamic_cast<VarExpr*>(node.lhs.get());
+    auto it = lhs ? frame->env.find(lhs->name.id) : frame->env.end();
+    if(it == frame->env.end()) {
+        ok = false;
+        return;
+    }
+    frame->vars[it->second] = convert(res, frame->f->types[it->second]);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Symbol.hpp"
+#include "TypeInference.hpp"
+
+// Runs functions at compile time, for calls whose arguments are all constants. Values have the
+// types TypeInference gives them and are converted exactly where LLVMGen converts them (wrapping
+// i64 arithmetic, IEEE doubles, unordered '<' and ordered '!=' on doubles, the loop stepping and
+// ending rules), so a result is the one the compiled code would compute. Evaluation gives up on a
+// call to anything not defined here (an extern may have effects), on reading a variable no path
+// has set, and when it runs out of steps or recursion depth. Results are remembered per argument
+// list, which is sound since everything it can run is pure.
+class Evaluator : public Visitor {
+public:
+    struct Value {
+        ValueType type;
+        union {
+            bool b;
+            std::int64_t i;
+            double d;
+        };
+    };
+
+private:
+    struct Function {
+        std::unique_ptr<FuncDef> def;
+        std::vector<ValueType> types;
+        TypeInference::Annotations notes;
+    };
+
+    struct Frame {
+        const Function* f;
+        std::vector<std::optional<Value>> vars;
+        std::unordered_map<std::uint32_t, std::size_t> env;
+    };
+
+    std::unordered_map<std::uint32_t, Function> functions;
+    std::map<std::pair<std::uint32_t, std::vector<std::uint64_t>>, double> memo;
+    std::uint64_t max_steps;
+    unsigned max_depth;
+
+    Frame* frame;
+    std::uint64_t steps;
+    unsigned depth;
+    bool ok;
+    Value res;
+
+    bool step();
+    std::optional<double> invoke(Symbol name, const std::vector<double>& args);
+
+public:
+    explicit Evaluator(std::uint64_t max_steps = 1000000, unsigned max_depth = 200)
+        : max_steps(max_steps), max_depth(max_depth), frame(nullptr), steps(0), depth(0), ok(true), res{} {}
+
+    // make a function callable; def must be on the heap and is kept
+    void Define(std::unique_ptr<FuncDef> def);
+
+    // the double the compiled function would return, or nothing if evaluation gave up
+    std::optional<double> Call(Symbol name, const std::vector<double>& args);
+
+    void visit(Program& node) override;
+    void visit(FuncDef& node) override;
+    void visit(Block& node) override;
+    void visit(Extern& node) override;
+    void visit(VarExpr& node) override;
+    void visit(NumLiteral& node) override;
+    void visit(BinOp& node) override;
+    void visit(IfExpr& node) override;
+    void visit(CallExpr& node) override;
+    void visit(LoopExpr& node) override;
+    void visit(VarInitExpr& node) override;
+    void visit(AssignExpr& node) override;
+};
@@ -0,0 +1,145 @@
+#include "FlatAST.hpp"
+
+#include "ASTNode.hpp"
+
+namespace {
+
+// Walks the pointer AST and appends each node to its array. Children are flattened before their
+// parent, so the parent can be written in one go with the Refs of its children.
+class FlatBuilder : public Visitor {
+private:
+    FlatAST& ast;
+
+    template<typename T>
+    static Ref push(std::vector<T>& v, NodeKind kind, T node) {
+        v.push_back(node);
+        return Ref(kind, static_cast<std::uint32_t>(v.size() - 1));
+    }
+
+    template<typename Params>
+    Range symbolRange(const Params& params) {
+        Range r{static_cast<std::uint32_t>(ast.symbols.size()), static_cast<std::uint32_t>(params.size())};
+        ast.symbols.insert(ast.symbols.end(), params.begin(), params.end());
+        return r;
+    }
+
+    // flatten a list of children first, then copy their refs out together so nested lists don't interleave
+    template<typename Children>
+    Range refRange(const Children& children) {
+        std::vector<Ref> flat;
+        flat.reserve(children.size());
+        for(const auto& c : children) flat.push_back(build(*c));
+
+        Range r{static_cast<std::uint32_t>(ast.refs.size()), static_cast<std::uint32_t>(flat.size())};
+        ast.refs.insert(ast.refs.end(), flat.begin(), flat.end());
+        return r;
+    }
+
+public:
+    Ref res;
+
+    explicit FlatBuilder(FlatAST& ast) : ast(ast) {}
+
+    Ref build(ASTNode& node) {
+        node.accept(*this);
+        return res;
+    }
+
+    void visit(Program&) override {}  // FlatAST(Program&) adds the definitions one by one
+
+    void visit(FuncDef& node) override {
+        Range params = symbolRange(node.params);
+        Ref block = build(*node.block);
+        res = push(ast.func_defs, NodeKind::FuncDef, FlatFuncDef{node.name, params, block});
+    }
+
+    void visit(Block& node) override {
+        res = push(ast.blocks, NodeKind::Block, FlatBlock{refRange(node.exprs)});
+    }
+
+    void visit(Extern& node) override {
+        res = push(ast.externs, NodeKind::Extern, FlatExtern{node.name, symbolRange(node.params)});
+    }
+
+    void visit(VarExpr& node) override {
+        res = push(ast.var_exprs, NodeKind::VarExpr, FlatVarExpr{node.name});
+    }
+
+    void visit(NumLiteral& node) override {
+        res = push(ast.num_literals, NodeKind::NumLiteral, FlatNumLiteral{node.val, node.isDouble});
+    }
+
+    void visit(BinOp& node) override {
+        Ref left = build(*node.left);
+        Ref right = build(*node.right);
+        res = push(ast.bin_ops, NodeKind::BinOp, FlatBinOp{left, right, node.op});
+    }
+
+    void visit(IfExpr& node) override {
+        Ref cond = build(*node.cond);
+        Ref then = build(*node.then);
+        Ref elss = build(*node.elss);
+        res = push(ast.if_exprs, NodeKind::IfExpr, FlatIfExpr{cond, then, elss});
+    }
+
+    void visit(CallExpr& node) override {
+        res = push(ast.call_exprs, NodeKind::CallExpr, FlatCallExpr{node.name, refRange(node.args)});
+    }
+
+    void visit(LoopExpr& node) override {
+        Ref start = build(*node.rangeStart);
+        Ref end = build(*node.rangeEnd);
+        Ref step = build(*node.step);
+        Ref block = build(*node.block);
+        Range reductions{static_cast<std::uint32_t>(ast.reductions.size()), static_cast<std::uint32_t>(node.reductions.size())};
+        ast.reductions.insert(ast.reductions.end(), node.reductions.begin(), node.reductions.end());
+        res = push(ast.loop_exprs, NodeKind::LoopExpr, FlatLoopExpr{node.name, start, end, step, block, node.parallel, reductions});
+    }
+
+    void visit(VarInitExpr& node) override {
+        Ref val = build(*node.val);
+        res = push(ast.var_init_exprs, NodeKind::VarInitExpr, FlatVarInitExpr{node.name, val});
+    }
+
+    void visit(AssignExpr& node) override {
+        Ref lhs = build(*node.lhs);
+        Ref val = build(*node.val);
+        res = push(ast.assign_exprs, NodeKind::AssignExpr, FlatAssignExpr{lhs, val});
+    }
+};
+
+}  // namespace
+
+FlatAST::FlatAST(Program& program) {
+    for(auto& e : program.externs) Add(*e);
+    for(auto& fd : program.func_defs) Add(*fd);
+}
+
+Ref FlatAST::Add(ASTNode& node) {
+    FlatBuilder builder(*this);
+    Ref r = builder.build(node);
+    top_level.push_back(r);
+    return r;
+}
+
+void FlatAST::accept(Ref node, FlatVisitor& v) const {
+    std::uint32_t i = node.index();
+
+    switch(node.kind()) {
+        case NodeKind::FuncDef: v.visit(*this, func_defs[i]); return;
+        case NodeKind::Extern: v.visit(*this, externs[i]); return;
+        case NodeKind::Block: v.visit(*this, blocks[i]); return;
+        case NodeKind::VarExpr: v.visit(*this, var_exprs[i]); return;
+        case NodeKind::NumLiteral: v.visit(*this, num_literals[i]); return;
+        case NodeKind::BinOp: v.visit(*this, bin_ops[i]); return;
+        case NodeKind::IfExpr: v.visit(*this, if_exprs[i]); return;
+        case NodeKind::CallExpr: v.visit(*this, call_exprs[i]); return;
+        case NodeKind::LoopExpr: v.visit(*this, loop_exprs[i]); return;
+        case NodeKind::VarInitExpr: v.visit(*this, var_init_exprs[i]); return;
+        case NodeKind::AssignExpr: v.visit(*this, assign_exprs[i]); return;
+    }
+}
+
+void FlatAST::accept(FlatVisitor& v) const {
+    for(Ref r : top_level) accept(r, v);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Symbol.hpp"
+
+// Flat, index based form of the AST for passes over whole programs. Each node type lives in its
+// own contiguous array of small POD structs, and nodes refer to their children with 32-bit Refs
+// instead of pointers; variable length children (block exprs, call args, params) are ranges into
+// shared arrays. A BinOp is 12 bytes here against ~56 in the pointer AST.
+
+enum class NodeKind : std::uint8_t {
+    FuncDef,
+    Extern,
+    Block,
+    VarExpr,
+    NumLiteral,
+    BinOp,
+    IfExpr,
+    CallExpr,
+    LoopExpr,
+    VarInitExpr,
+    AssignExpr,
+};
+
+// node kind in the top 4 bits, index into that kind's array in the rest
+class Ref {
+public:
+    std::uint32_t bits;
+
+    Ref() : bits(0) {}
+    Ref(NodeKind kind, std::uint32_t index) : bits(std::uint32_t(kind) << 28 | index) {}
+
+    NodeKind kind() const { return NodeKind(bits >> 28); }
+    std::uint32_t index() const { return bits & 0x0FFFFFFF; }
+};
+
+// [begin, begin + size) of one of the shared arrays
+struct Range {
+    std::uint32_t begin;
+    std::uint32_t size;
+};
+
+template<typename T>
+class Slice {
+private:
+    const T* first;
+    const T* last;
+
+public:
+    Slice(const T* first, const T* last) : first(first), last(last) {}
+
+    const T* begin() const { return first; }
+    const T* end() const { return last; }
+    std::size_t size() const { return last - first; }
+    const T& operator[](std::size_t i) const { return first[i]; }
+};
+
+struct FlatFuncDef { Symbol name; Range params; Ref block; };
+struct FlatExtern { Symbol name; Range params; };
+struct FlatBlock { Range exprs; };
+struct FlatVarExpr { Symbol name; };
+struct FlatNumLiteral { int val; bool isDouble; };
+struct FlatBinOp { Ref left; Ref right; char op; };
+struct FlatIfExpr { Ref cond; Ref then; Ref elss; };
+struct FlatCallExpr { Symbol name; Range args; };
+struct FlatLoopExpr { Symbol name; Ref rangeStart; Ref rangeEnd; Ref step; Ref block; bool parallel; Range reductions; };
+struct FlatVarInitExpr { Symbol name; Ref val; };
+struct FlatAssignExpr { Ref lhs; Ref val; };
+
+class FlatAST;
+
+class FlatVisitor {
+public:
+    virtual ~FlatVisitor() = default;
+    virtual void visit(const FlatAST& ast, const FlatFuncDef& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatExtern& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatBlock& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatVarExpr& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatNumLiteral& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatBinOp& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatIfExpr& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatCallExpr& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatLoopExpr& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatVarInitExpr& node) = 0;
+    virtual void visit(const FlatAST& ast, const FlatAssignExpr& node) = 0;
+};
+
+class FlatAST {
+public:
+    std::vector<FlatFuncDef> func_defs;
+    std::vector<FlatExtern> externs;
+    std::vector<FlatBlock> blocks;
+    std::vector<FlatVarExpr> var_exprs;
+    std::vector<FlatNumLiteral> num_literals;
+    std::vector<FlatBinOp> bin_ops;
+    std::vector<FlatIfExpr> if_exprs;
+    std::vector<FlatCallExpr> call_exprs;
+    std::vector<FlatLoopExpr> loop_exprs;
+    std::vector<FlatVarInitExpr> var_init_exprs;
+    std::vector<FlatAssignExpr> assign_exprs;
+
+    std::vector<Ref> refs;              // storage for Block::exprs and CallExpr::args
+    std::vector<Symbol> symbols;        // storage for params
+    std::vector<Reduction> reductions;  // storage for LoopExpr::reductions
+
+    // top level definitions in source order
+    std::vector<Ref> top_level;
+
+    FlatAST() = default;
+    explicit FlatAST(Program& program);
+
+    // flatten a FuncDef or Extern and append it to top_level
+    Ref Add(ASTNode& node);
+
+    Slice<Ref> operator[](Range r) const { return Slice<Ref>(refs.data() + r.begin, refs.data() + r.begin + r.size); }
+    Slice<Symbol> symbolsIn(Range r) const { return Slice<Symbol>(symbols.data() + r.begin, symbols.data() + r.begin + r.size); }
+    Slice<Reduction> reductionsIn(Range r) const {
+        return Slice<Reduction>(reductions.data() + r.begin, reductions.data() + r.begin + r.size);
+    }
+
+    void accept(Ref node, FlatVisitor& v) const;
+    void accept(FlatVisitor& v) const;  // every top level definition in order
+};
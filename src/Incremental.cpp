@@ -0,0 +1,122 @@
+#include "Incremental.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Lexer.hpp"
+#include "Parser.hpp"
+#include "Token.hpp"
+
+IncrementalFrontend::IncrementalFrontend(std::string text) : text(std::move(text)) {
+    bool complete;
+    defs = parseRange(0, this->text.size(), 1, complete);
+}
+
+// lex and parse the definitions that start in [begin, end)
+std::vector<IncrementalFrontend::Definition> IncrementalFrontend::parseRange(std::size_t begin, std::size_t end, unsigned int line, bool& complete) {
+    std::vector<Token> tokens;
+    Lexer lexer(text, begin, line);
+    for(Token t = lexer.NextToken(); t.type != TokenType::END_PROG && t.offset < end; t = lexer.NextToken()) {
+        tokens.push_back(t);
+    }
+
+    auto spans = Parser::SplitTopLevel(tokens);
+    complete = spans.empty() || spans.back().complete;
+
+    std::vector<Definition> result;
+    for(const auto& span : spans) {
+        const Token& first = tokens[span.begin];
+        const Token& last = tokens[span.end - 1];
+
+        Parser parser(std::vector<Token>(tokens.begin() + span.begin, tokens.begin() + span.end));
+        auto node = parser.ParseNext();
+
+        Symbol name;
+        if(auto* fd = dynamic_cast<FuncDef*>(node.get())) name = fd->name;
+        else if(auto* e = dynamic_cast<Extern*>(node.get())) name = e->name;
+
+        result.push_back(Definition{first.offset, last.offset + last.length(), first.line, last.line,
+                                    parser.Errors(), name, std::move(node)});
+    }
+
+    return result;
+}
+
+IncrementalFrontend::EditResult IncrementalFrontend::Edit(std::size_t offset, std::size_t length, std::string_view replacement) {
+    EditResult result;
+
+    // definitions [lo, hi) overlap or touch the edited range
+    std::size_t lo = 0;
+    while(lo < defs.size() && defs[lo].end < offset) lo++;
+    std::size_t hi = lo;
+    while(hi < defs.size() && defs[hi].begin <= offset + length) hi++;
+
+    auto source = [&](const Definition& d) { return text.substr(d.begin, d.end - d.begin); };
+    std::vector<std::string> old_text;
+    for(std::size_t i = lo; i < hi; i++) old_text.push_back(source(defs[i]));
+
+    // re-lex from the end of the last untouched definition so text between definitions is covered too
+    unsigned int region_begin = lo > 0 ? defs[lo - 1].end : 0;
+    unsigned int region_line = lo > 0 ? defs[lo - 1].end_line : 1;
+
+    long long delta = static_cast<long long>(replacement.size()) - static_cast<long long>(length);
+    int line_delta = static_cast<int>(std::count(replacement.begin(), replacement.end(), '\n'))
+                   - static_cast<int>(std::count(text.begin() + offset, text.begin() + offset + length, '\n'));
+    text.replace(offset, length, replacement);
+
+    for(std::size_t i = hi; i < defs.size(); i++) {
+        defs[i].begin += delta;
+        defs[i].end += delta;
+        defs[i].line += line_delta;
+        defs[i].end_line += line_delta;
+    }
+
+    // an edit can leave the last definition unterminated, in which case it swallows the ones after it
+    std::vector<Definition> fresh;
+    for(;;) {
+        bool complete;
+        std::size_t region_end = hi < defs.size() ? defs[hi].begin : text.size();
+        fresh = parseRange(region_begin, region_end, region_line, complete);
+        if(complete || hi == defs.size()) break;
+
+        old_text.push_back(source(defs[hi]));
+        hi++;
+    }
+
+    // definitions that come back with the same text keep their AST
+    std::vector<bool> reused(hi - lo, false);
+    for(auto& d : fresh) {
+        std::string s = source(d);
+        bool found = false;
+
+        for(std::size_t i = 0; i < old_text.size(); i++) {
+            if(!reused[i] && old_text[i] == s) {
+                reused[i] = true;
+                d.node = std::move(defs[lo + i].node);
+                found = true;
+                break;
+            }
+        }
+
+        if(!found) result.changed.push_back(d.name);
+    }
+
+    for(std::size_t i = 0; i < old_text.size(); i++) {
+        if(reused[i]) continue;
+        Symbol name = defs[lo + i].name;
+        bool redefined = std::any_of(fresh.begin(), fresh.end(), [&](const Definition& d) { return d.name == name; });
+        if(!redefined) result.removed.push_back(name);
+    }
+
+    defs.erase(defs.begin() + lo, defs.begin() + hi);
+    defs.insert(defs.begin() + lo, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+
+    return result;
+}
+
+int IncrementalFrontend::Errors() const {
+    int n = 0;
+    for(const auto& d : defs) n += d.errors;
+    return n;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Symbol.hpp"
+
+// Front end for a source buffer that keeps being edited, e.g. by tooling that recompiles on every
+// save. The program is kept as a list of top level definitions with their source ranges. An edit
+// re-lexes and re-parses only the definitions it touches (plus any that an unterminated definition
+// runs into), and definitions whose text comes back unchanged keep their existing AST.
+class IncrementalFrontend {
+public:
+    struct Definition {
+        unsigned int begin;     // source range [begin, end)
+        unsigned int end;
+        unsigned int line;      // line of the first token
+        unsigned int end_line;  // line of the last token
+        int errors;
+        Symbol name;
+        std::unique_ptr<ASTNode> node;  // FuncDef or Extern
+    };
+
+    struct EditResult {
+        std::vector<Symbol> changed;  // definitions that are new or were modified
+        std::vector<Symbol> removed;  // definitions that no longer exist
+    };
+
+private:
+    std::string text;
+    std::vector<Definition> defs;
+
+    std::vector<Definition> parseRange(std::size_t begin, std::size_t end, unsigned int line, bool& complete);
+
+public:
+    explicit IncrementalFrontend(std::string text);
+
+    // replace length bytes at offset with replacement
+    EditResult Edit(std::size_t offset, std::size_t length, std::string_view replacement);
+
+    const std::string& Text() const { return text; }
+    const std::vector<Definition>& Definitions() const { return defs; }
+    int Errors() const;
+};
@@ -0,0 +1,133 @@
+#include "JIT.hpp"
+#include "LLVMGen.hpp"
+#include "ObjectCache.hpp"
+#include "ParallelRuntime.hpp"
+#include <cstdio>
+#include <iostream>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/AbsoluteSymbols.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
+#include <utility>
+
+// runtime for jitted programs, the same helpers the tutorial links in
+extern "C" double printd(double x) {
+    std::fprintf(stderr, "%f\n", x);
+    return 0;
+}
+
+extern "C" double putchard(double x) {
+    std::fputc(char(x), stderr);
+    return 0;
+}
+
+namespace {
+
+// Compile step of the JIT that goes through an ObjectCache, keyed on the module as it was added
+class CachingCompiler : public llvm::orc::IRCompileLayer::IRCompiler {
+private:
+    std::unique_ptr<llvm::TargetMachine> tm;
+    std::mutex mutex;  // one target machine, and LLJIT may compile on several threads
+    ObjectCache& cache;
+    llvm::OptimizationLevel level;
+
+public:
+    CachingCompiler(std::unique_ptr<llvm::TargetMachine> tm, ObjectCache& cache, llvm::OptimizationLevel level)
+        : IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(tm->Options)), tm(std::move(tm)), cache(cache), level(level) {}
+
+    llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& mod) override {
+        llvm::SmallVector<char, 0> bitcode;
+        llvm::raw_svector_ostream os(bitcode);
+        llvm::WriteBitcodeToFile(mod, os);
+
+        auto key = ObjectCache::Key(llvm::StringRef(bitcode.data(), bitcode.size()), *tm, level);
+        if(auto hit = cache.Get(key)) return std::move(hit);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        optimizeModule(mod, level, tm.get());
+        auto object = llvm::orc::SimpleCompiler(*tm)(mod);
+        if(object) cache.Put(key, (*object)->getBuffer());
+        return object;
+    }
+};
+
+}  // namespace
+
+JIT::JIT(ObjectCache* cache, llvm::OptimizationLevel level) : fail(false) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::orc::LLJITBuilder builder;
+    if(cache) {
+        builder.setCompileFunctionCreator([cache, level](llvm::orc::JITTargetMachineBuilder jtmb)
+                                              -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            auto tm = jtmb.createTargetMachine();
+            if(!tm) return tm.takeError();
+            return std::make_unique<CachingCompiler>(std::move(*tm), *cache, level);
+        });
+    }
+
+    auto j = builder.create();
+    if(!j) {
+        error(j.takeError());
+        return;
+    }
+    jit = std::move(*j);
+
+    auto& dylib = jit->getMainJITDylib();
+    llvm::orc::SymbolMap runtime;
+    auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+    runtime[jit->mangleAndIntern("printd")] = {llvm::orc::ExecutorAddr::fromPtr(&printd), flags};
+    runtime[jit->mangleAndIntern("putchard")] = {llvm::orc::ExecutorAddr::fromPtr(&putchard), flags};
+    runtime[jit->mangleAndIntern("__kl_parallel_for")] = {llvm::orc::ExecutorAddr::fromPtr(&__kl_parallel_for), flags};
+    runtime[jit->mangleAndIntern("__kl_parallel_chunks")] = {llvm::orc::ExecutorAddr::fromPtr(&__kl_parallel_chunks), flags};
+    if(auto err = dylib.define(llvm::orc::absoluteSymbols(std::move(runtime)))) {
+        error(std::move(err));
+        return;
+    }
+
+    auto process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+    if(!process) {
+        error(process.takeError());
+        return;
+    }
+    dylib.addGenerator(std::move(*process));
+}
+
+void JIT::Add(std::unique_ptr<llvm::Module> mod, std::unique_ptr<llvm::LLVMContext> ctx) {
+    if(fail) return;
+
+    if(auto err = jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(mod), std::move(ctx)))) {
+        error(std::move(err));
+    }
+}
+
+std::optional<double> JIT::Run(const std::string& name) {
+    if(fail) return std::nullopt;
+
+    auto addr = jit->lookup(name);
+    if(!addr) {
+        error(addr.takeError());
+        return std::nullopt;
+    }
+
+    auto* f = addr->toPtr<double (*)()>();
+    return f();
+}
+
+void JIT::error(std::string message) {
+    fail = true;
+    std::cerr << "JIT: " << message << std::endl;
+}
+
+void JIT::error(llvm::Error err) {
+    error(llvm::toString(std::move(err)));
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/Error.h>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+
+class ObjectCache;
+
+// Runs generated modules in process on ORC's LLJIT instead of going through an object file and a
+// link. Externs resolve against the small runtime in JIT.cpp (printd, putchard) and the one of
+// parallel loops, and then against every symbol of the host process, libc and libm included.
+class JIT {
+protected:
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::atomic<bool> fail;  // TieredJIT's compile thread adds modules too
+
+    void error(std::string message);
+    void error(llvm::Error err);
+
+public:
+    // With a cache, modules are added unoptimized: the JIT looks up the object for each one and only
+    // optimizes it at level and compiles it on a miss.
+    explicit JIT(ObjectCache* cache = nullptr, llvm::OptimizationLevel level = llvm::OptimizationLevel::O0);
+    virtual ~JIT() = default;
+
+    bool Failed() const { return fail; }
+
+    // compile lazily on the first lookup of one of its symbols; takes the context along with the module
+    virtual void Add(std::unique_ptr<llvm::Module> mod, std::unique_ptr<llvm::LLVMContext> ctx);
+
+    // call a function taking no arguments, nothing if it can't be found or compiled
+    std::optional<double> Run(const std::string& name);
+};
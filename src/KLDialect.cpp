@@ -0,0 +1,229 @@
+#include "KLDialect.hpp"
+
+#include <cstdint>
+#include <optional>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/CheckedArithmetic.h>
+#include <mlir/Dialect/Affine/IR/AffineOps.h>
+#include <mlir/Dialect/Arith/IR/Arith.h>
+#include <mlir/Dialect/SCF/IR/SCF.h>
+#include <mlir/IR/BuiltinTypes.h>
+#include <mlir/IR/Matchers.h>
+#include <mlir/IR/PatternMatch.h>
+
+MLIR_DEFINE_EXPLICIT_TYPE_ID(KLDialect)
+MLIR_DEFINE_EXPLICIT_TYPE_ID(KLYieldOp)
+MLIR_DEFINE_EXPLICIT_TYPE_ID(KLIfOp)
+MLIR_DEFINE_EXPLICIT_TYPE_ID(KLLoopOp)
+
+KLDialect::KLDialect(mlir::MLIRContext* ctx)
+    : mlir::Dialect(getDialectNamespace(), ctx, mlir::TypeID::get<KLDialect>()) {
+    addOperations<KLYieldOp, KLIfOp, KLLoopOp>();
+}
+
+void KLYieldOp::build(mlir::OpBuilder&, mlir::OperationState& state, mlir::ValueRange values) {
+    state.addOperands(values);
+}
+
+void KLIfOp::build(mlir::OpBuilder&, mlir::OperationState& state, mlir::TypeRange results, mlir::Value cond) {
+    state.addOperands(cond);
+    state.addTypes(results);
+    for(int i = 0; i < 2; i++) state.addRegion()->push_back(new mlir::Block());
+}
+
+// the terminator of a region's only block, if it is a kl.yield
+static KLYieldOp yieldOf(mlir::Region& region) {
+    if(!region.hasOneBlock() || region.front().empty()) return nullptr;
+    return llvm::dyn_cast<KLYieldOp>(&region.front().back());
+}
+
+mlir::LogicalResult KLIfOp::verify() {
+    if(!getCond().getType().isInteger(1)) return emitOpError("condition must be i1");
+    for(mlir::Region& region : getOperation()->getRegions()) {
+        auto yield = yieldOf(region);
+        if(!yield) return emitOpError("branches must be one block ending in kl.yield");
+        if(!llvm::equal(yield->getOperandTypes(), getOperation()->getResultTypes())) {
+            return emitOpError("branches must yield the result types");
+        }
+    }
+    return mlir::success();
+}
+
+void KLLoopOp::build(mlir::OpBuilder&, mlir::OperationState& state, mlir::Value start, mlir::Value end, mlir::ValueRange inits) {
+    state.addOperands(start);
+    state.addOperands(end);
+    state.addOperands(inits);
+    state.addTypes(inits.getTypes());
+
+    auto* body = new mlir::Block();
+    body->addArgument(start.getType(), state.location);
+    for(mlir::Value v : inits) body->addArgument(v.getType(), state.location);
+    state.addRegion()->push_back(body);
+}
+
+mlir::LogicalResult KLLoopOp::verify() {
+    auto yield = yieldOf(getOperation()->getRegion(0));
+    if(!yield) return emitOpError("body must be one block ending in kl.yield");
+
+    // the variable and the step, then the carried variables
+    mlir::Block& body = getOperation()->getRegion(0).front();
+    if(body.getNumArguments() == 0 || yield->getNumOperands() != body.getNumArguments() + 1 ||
+       yield->getOperand(0).getType() != body.getArgument(0).getType() ||
+       yield->getOperand(1).getType() != body.getArgument(0).getType() ||
+       !llvm::equal(llvm::drop_begin(yield->getOperandTypes(), 2), llvm::drop_begin(body.getArgumentTypes()))) {
+        return emitOpError("body must yield the variable, the step and the carried values");
+    }
+    if(!llvm::equal(getInits().getTypes(), getOperation()->getResultTypes())) {
+        return emitOpError("results must have the types of the carried values");
+    }
+    return mlir::success();
+}
+
+namespace {
+
+void lowerIf(mlir::IRRewriter& rewriter, KLIfOp op) {
+    rewriter.setInsertionPoint(op);
+    auto scfIf = rewriter.create<mlir::scf::IfOp>(op.getLoc(), op->getResultTypes(), op.getCond(), false, false);
+
+    for(unsigned i = 0; i < 2; i++) {
+        mlir::Region& region = scfIf->getRegion(i);
+        rewriter.inlineRegionBefore(op->getRegion(i), region, region.end());
+
+        auto yield = llvm::cast<KLYieldOp>(region.front().getTerminator());
+        rewriter.setInsertionPoint(yield);
+        rewriter.replaceOpWithNewOp<mlir::scf::YieldOp>(yield, yield->getOperands());
+    }
+    rewriter.replaceOp(op, scfIf->getResults());
+}
+
+// A counted loop: the variable is an integer the body doesn't assign, and start, end and step are
+// constants with the end a whole number of steps past the start. It runs as an affine.for over the
+// iteration count, with the variable recomputed from the index, which the affine passes can analyze
+// and transform. Other loops can go round forever or decide their count at run time.
+bool lowerToAffine(mlir::IRRewriter& rewriter, KLLoopOp op) {
+    mlir::Block* body = op.getBody();
+    auto yield = llvm::cast<KLYieldOp>(body->getTerminator());
+    if(!op.getStart().getType().isInteger(64) || !op.getEnd().getType().isInteger(64)) return false;
+    if(yield->getOperand(0) != body->getArgument(0)) return false;
+
+    llvm::APInt start, end, step;
+    if(!mlir::matchPattern(op.getStart(), mlir::m_ConstantInt(&start)) ||
+       !mlir::matchPattern(op.getEnd(), mlir::m_ConstantInt(&end)) ||
+       !mlir::matchPattern(yield->getOperand(1), mlir::m_ConstantInt(&step)) || step.isZero()) {
+        return false;
+    }
+
+    std::int64_t k = step.getSExtValue();
+    std::optional<std::int64_t> distance = llvm::checkedSub(end.getSExtValue(), start.getSExtValue());
+    if(!distance || (k == -1 && *distance == INT64_MIN) || *distance % k != 0 || *distance / k <= 0) return false;
+    std::int64_t trips = *distance / k;
+
+    mlir::Location loc = op.getLoc();
+    rewriter.setInsertionPoint(op);
+    auto loop = rewriter.create<mlir::affine::AffineForOp>(loc, 0, trips, 1, op.getInits());
+    mlir::Block* loopBody = loop.getBody();
+    if(!loopBody->empty()) rewriter.eraseOp(&loopBody->back());
+
+    // variable = start + index * step
+    rewriter.setInsertionPointToStart(loopBody);
+    mlir::Type i64 = rewriter.getI64Type();
+    mlir::Value index = rewriter.create<mlir::arith::IndexCastOp>(loc, i64, loop.getInductionVar());
+    mlir::Value scaled = rewriter.create<mlir::arith::MulIOp>(
+        loc, index, rewriter.create<mlir::arith::ConstantOp>(loc, rewriter.getI64IntegerAttr(k)));
+    mlir::Value var = rewriter.create<mlir::arith::AddIOp>(loc, scaled, op.getStart());
+
+    llvm::SmallVector<mlir::Value> args{var};
+    for(mlir::Value carried : loop.getRegionIterArgs()) args.push_back(carried);
+    rewriter.mergeBlocks(body, loopBody, args);
+
+    rewriter.setInsertionPoint(yield);
+    rewriter.replaceOpWithNewOp<mlir::affine::AffineYieldOp>(yield, yield->getOperands().drop_front(2));
+    rewriter.replaceOp(op, loop->getResults());
+    return true;
+}
+
+// Any other loop is a do-while: the body and the exit test make up the before region of an
+// scf.while, which passes the next value of the variable on through an empty after region.
+void lowerToWhile(mlir::IRRewriter& rewriter, KLLoopOp op) {
+    mlir::Location loc = op.getLoc();
+    mlir::Block* body = op.getBody();
+
+    llvm::SmallVector<mlir::Value> inits{op.getStart()};
+    for(mlir::Value v : op.getInits()) inits.push_back(v);
+    llvm::SmallVector<mlir::Type> types(mlir::ValueRange(inits).getTypes());
+    llvm::SmallVector<mlir::Location> locs(types.size(), loc);
+
+    rewriter.setInsertionPoint(op);
+    auto loop = rewriter.create<mlir::scf::WhileOp>(loc, types, inits);
+
+    mlir::Block* before = rewriter.createBlock(&loop.getBefore(), {}, types, locs);
+    rewriter.mergeBlocks(body, before, before->getArguments());
+
+    auto yield = llvm::cast<KLYieldOp>(before->getTerminator());
+    rewriter.setInsertionPoint(yield);
+    mlir::Value var = yield->getOperand(0);
+    mlir::Value step = yield->getOperand(1);
+    mlir::Value end = op.getEnd();
+
+    mlir::Value next, more;
+    if(llvm::isa<mlir::FloatType>(var.getType())) {
+        next = rewriter.create<mlir::arith::AddFOp>(loc, var, step);
+        more = rewriter.create<mlir::arith::CmpFOp>(loc, mlir::arith::CmpFPredicate::ONE, next, end);
+    }
+    else {
+        next = rewriter.create<mlir::arith::AddIOp>(loc, var, step);
+        if(llvm::isa<mlir::FloatType>(end.getType())) {
+            mlir::Value fnext = rewriter.create<mlir::arith::SIToFPOp>(loc, end.getType(), next);
+            more = rewriter.create<mlir::arith::CmpFOp>(loc, mlir::arith::CmpFPredicate::ONE, fnext, end);
+        }
+        else {
+            more = rewriter.create<mlir::arith::CmpIOp>(loc, mlir::arith::CmpIPredicate::ne, next, end);
+        }
+    }
+
+    llvm::SmallVector<mlir::Value> carried{next};
+    for(mlir::Value v : yield->getOperands().drop_front(2)) carried.push_back(v);
+    rewriter.replaceOpWithNewOp<mlir::scf::ConditionOp>(yield, more, carried);
+
+    mlir::Block* after = rewriter.createBlock(&loop.getAfter(), {}, types, locs);
+    rewriter.create<mlir::scf::YieldOp>(loc, after->getArguments());
+
+    rewriter.replaceOp(op, loop->getResults().drop_front());
+}
+
+struct LowerKLPass : public mlir::PassWrapper<LowerKLPass, mlir::OperationPass<mlir::ModuleOp>> {
+    MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(LowerKLPass)
+
+    llvm::StringRef getArgument() const final { return "lower-kl"; }
+    llvm::StringRef getDescription() const final { return "Lower kl.if and kl.loop to the affine and scf dialects"; }
+
+    void getDependentDialects(mlir::DialectRegistry& registry) const override {
+        registry.insert<mlir::affine::AffineDialect, mlir::arith::ArithDialect, mlir::scf::SCFDialect>();
+    }
+
+    void runOnOperation() override {
+        // innermost first, so a loop's body is already lowered when it is moved
+        llvm::SmallVector<mlir::Operation*> ops;
+        getOperation()->walk([&](mlir::Operation* op) {
+            if(llvm::isa<KLIfOp, KLLoopOp>(op)) ops.push_back(op);
+        });
+
+        mlir::IRRewriter rewriter(&getContext());
+        for(mlir::Operation* op : ops) {
+            if(auto i = llvm::dyn_cast<KLIfOp>(op)) {
+                lowerIf(rewriter, i);
+                continue;
+            }
+            auto loop = llvm::cast<KLLoopOp>(op);
+            if(!lowerToAffine(rewriter, loop)) lowerToWhile(rewriter, loop);
+        }
+    }
+};
+
+}  // namespace
+
+std::unique_ptr<mlir::Pass> createLowerKLPass() {
+    return std::make_unique<LowerKLPass>();
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <memory>
+
+#include <mlir/IR/Builders.h>
+#include <mlir/IR/Dialect.h>
+#include <mlir/IR/OpDefinition.h>
+#include <mlir/IR/OperationSupport.h>
+#include <mlir/Pass/Pass.h>
+#include <mlir/Support/TypeID.h>
+
+// The kl dialect: the structured control flow of the language, as MLIRGen emits it. Everything else
+// is already standard (func for functions and calls, arith for values), so the dialect only adds an
+// if and a loop that carry the variables they assign as results, which keeps the IR in SSA form
+// without a CFG. The ops are written by hand rather than generated from ODS, since the build has
+// no TableGen step; they have no custom syntax and print in the generic form.
+class KLDialect : public mlir::Dialect {
+public:
+    explicit KLDialect(mlir::MLIRContext* ctx);
+
+    static constexpr llvm::StringLiteral getDialectNamespace() { return llvm::StringLiteral("kl"); }
+};
+
+// kl.yield: ends the regions of kl.if and kl.loop
+class KLYieldOp : public mlir::Op<KLYieldOp,
+                                  mlir::OpTrait::ZeroRegions,
+                                  mlir::OpTrait::ZeroResults,
+                                  mlir::OpTrait::ZeroSuccessors,
+                                  mlir::OpTrait::VariadicOperands,
+                                  mlir::OpTrait::IsTerminator> {
+public:
+    using Op::Op;
+
+    static constexpr llvm::StringLiteral getOperationName() { return llvm::StringLiteral("kl.yield"); }
+    static llvm::ArrayRef<llvm::StringRef> getAttributeNames() { return {}; }
+
+    static void build(mlir::OpBuilder& builder, mlir::OperationState& state, mlir::ValueRange values);
+};
+
+// kl.if %cond: runs one of its two regions. Each is a single block ending in a kl.yield of the if's
+// results: the value of the if expression, then the variables either branch assigns.
+class KLIfOp : public mlir::Op<KLIfOp,
+                               mlir::OpTrait::NRegions<2>::Impl,
+                               mlir::OpTrait::VariadicResults,
+                               mlir::OpTrait::ZeroSuccessors,
+                               mlir::OpTrait::OneOperand> {
+public:
+    using Op::Op;
+
+    static constexpr llvm::StringLiteral getOperationName() { return llvm::StringLiteral("kl.if"); }
+    static llvm::ArrayRef<llvm::StringRef> getAttributeNames() { return {}; }
+
+    static void build(mlir::OpBuilder& builder, mlir::OperationState& state, mlir::TypeRange results, mlir::Value cond);
+    mlir::LogicalResult verify();
+
+    mlir::Value getCond() { return getOperation()->getOperand(0); }
+    mlir::Block* getThen() { return &getOperation()->getRegion(0).front(); }
+    mlir::Block* getElse() { return &getOperation()->getRegion(1).front(); }
+};
+
+// kl.loop %start, %end, %inits: LoopExpr. The region's block takes the loop variable and the
+// variables the loop carries, and yields the variable as the body left it, the step, and the
+// carried variables. The step is added to the variable and the loop goes round again unless the
+// sum equals the end, compared in the end's type. The results are the carried variables after the
+// last iteration.
+class KLLoopOp : public mlir::Op<KLLoopOp,
+                                 mlir::OpTrait::OneRegion,
+                                 mlir::OpTrait::VariadicResults,
+                                 mlir::OpTrait::ZeroSuccessors,
+                                 mlir::OpTrait::AtLeastNOperands<2>::Impl> {
+public:
+    using Op::Op;
+
+    static constexpr llvm::StringLiteral getOperationName() { return llvm::StringLiteral("kl.loop"); }
+    static llvm::ArrayRef<llvm::StringRef> getAttributeNames() { return {}; }
+
+    static void build(mlir::OpBuilder& builder, mlir::OperationState& state, mlir::Value start, mlir::Value end, mlir::ValueRange inits);
+    mlir::LogicalResult verify();
+
+    mlir::Value getStart() { return getOperation()->getOperand(0); }
+    mlir::Value getEnd() { return getOperation()->getOperand(1); }
+    mlir::OperandRange getInits() { return getOperation()->getOperands().drop_front(2); }
+    mlir::Block* getBody() { return &getOperation()->getRegion(0).front(); }
+};
+
+// Lowers kl.if to scf.if, and kl.loop to an affine.for when its bounds and step are integer
+// constants and its body leaves the variable alone, or to an scf.while otherwise.
+std::unique_ptr<mlir::Pass> createLowerKLPass();
+
+MLIR_DECLARE_EXPLICIT_TYPE_ID(KLDialect)
+MLIR_DECLARE_EXPLICIT_TYPE_ID(KLYieldOp)
+MLIR_DECLARE_EXPLICIT_TYPE_ID(KLIfOp)
+MLIR_DECLARE_EXPLICIT_TYPE_ID(KLLoopOp)
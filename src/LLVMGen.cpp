@@ -1,29 +1,189 @@
 #include "LLVMGen.hpp"
 #include "ASTNode.hpp"
+#include "FlatAST.hpp"
 #include <iostream>
 #include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Analysis/ModuleSummaryAnalysis.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalIFunc.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Metadata.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/MC/TargetRegistry.h>
+#include <llvm/Object/Archive.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/CodeGen.h>
+#include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBufferRef.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/SubtargetFeature.h>
 #include <llvm/TargetParser/Triple.h>
+#include <llvm/TargetParser/X86TargetParser.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <optional>
 #include <system_error>
 #include <vector>
 
+#include "ObjectCache.hpp"
+#include "ParallelRuntime.hpp"
+#include "ThreadPool.hpp"
+
+namespace {
+
+// What the AST of a loop's body or step does, for genLoopExpr to decide ahead of generating it
+// whether the loop can be counted with an integer. Walks both AST forms. Conservative: a nested
+// loop's variable counts as assigned even though it shadows any outer one.
+class LoopScan : public Visitor, public FlatVisitor {
+public:
+    std::vector<Symbol> reads;
+    std::vector<Symbol> assigns;
+    bool calls = false;
+    bool writes = false;    // assigns or defines any variable
+    bool branches = false;  // has an if or a loop
+
+    bool Reads(Symbol name) const { return std::find(reads.begin(), reads.end(), name) != reads.end(); }
+    bool Assigns(Symbol name) const { return std::find(assigns.begin(), assigns.end(), name) != assigns.end(); }
+
+    void visit(Program&) override {}
+    void visit(FuncDef&) override {}
+    void visit(Extern&) override {}
+    void visit(NumLiteral&) override {}
+
+    void visit(Block& node) override {
+        for(auto& e : node.exprs) e->accept(*this);
+    }
+
+    void visit(VarExpr& node) override { reads.push_back(node.name); }
+
+    void visit(BinOp& node) override {
+        node.left->accept(*this);
+        node.right->accept(*this);
+    }
+
+    void visit(IfExpr& node) override {
+        branches = true;
+        node.cond->accept(*this);
+        node.then->accept(*this);
+        node.elss->accept(*this);
+    }
+
+    void visit(CallExpr& node) override {
+        calls = true;
+        for(auto& a : node.args) a->accept(*this);
+    }
+
+    void visit(LoopExpr& node) override {
+        branches = true;
+        writes = true;
+        assigns.push_back(node.name);
+        node.rangeStart->accept(*this);
+        node.rangeEnd->accept(*this);
+        node.step->accept(*this);
+        node.block->accept(*this);
+    }
+
+    void visit(VarInitExpr& node) override {
+        writes = true;
+        assigns.push_back(node.name);
+        node.val->accept(*this);
+    }
+
+    void visit(AssignExpr& node) override {
+        writes = true;
+        if(auto* var = dynamic_cast<VarExpr*>(node.lhs.get())) assigns.push_back(var->name);
+        node.val->accept(*this);
+    }
+
+    void visit(const FlatAST&, const FlatFuncDef&) override {}
+    void visit(const FlatAST&, const FlatExtern&) override {}
+    void visit(const FlatAST&, const FlatNumLiteral&) override {}
+
+    void visit(const FlatAST& ast, const FlatBlock& node) override {
+        for(Ref e : ast[node.exprs]) ast.accept(e, *this);
+    }
+
+    void visit(const FlatAST&, const FlatVarExpr& node) override { reads.push_back(node.name); }
+
+    void visit(const FlatAST& ast, const FlatBinOp& node) override {
+        ast.accept(node.left, *this);
+        ast.accept(node.right, *this);
+    }
+
+    void visit(const FlatAST& ast, const FlatIfExpr& node) override {
+        branches = true;
+        ast.accept(node.cond, *this);
+        ast.accept(node.then, *this);
+        ast.accept(node.elss, *this);
+    }
+
+    void visit(const FlatAST& ast, const FlatCallExpr& node) override {
+        calls = true;
+        for(Ref a : ast[node.args]) ast.accept(a, *this);
+    }
+
+    void visit(const FlatAST& ast, const FlatLoopExpr& node) override {
+        branches = true;
+        writes = true;
+        assigns.push_back(node.name);
+        ast.accept(node.rangeStart, *this);
+        ast.accept(node.rangeEnd, *this);
+        ast.accept(node.step, *this);
+        ast.accept(node.block, *this);
+    }
+
+    void visit(const FlatAST& ast, const FlatVarInitExpr& node) override {
+        writes = true;
+        assigns.push_back(node.name);
+        ast.accept(node.val, *this);
+    }
+
+    void visit(const FlatAST& ast, const FlatAssignExpr& node) override {
+        writes = true;
+        if(node.lhs.kind() == NodeKind::VarExpr) assigns.push_back(ast.var_exprs[node.lhs.index()].name);
+        ast.accept(node.val, *this);
+    }
+};
+
+LLVMGen::LoopShape loopShape(Symbol name, const LoopScan& body, const LoopScan& step) {
+    LLVMGen::LoopShape shape;
+    shape.stepInvariant = !step.calls && !step.writes && !step.Reads(name)
+        && std::none_of(step.reads.begin(), step.reads.end(), [&](Symbol s) { return body.Assigns(s); });
+    shape.assignsVar = body.Assigns(name);
+    shape.straightLine = !body.calls && !body.branches;
+    return shape;
+}
+
+}  // namespace
+
 void LLVMGen::visit(Program& node) {
     for(const auto& e : node.externs) {
         e->accept(*this);
@@ -42,47 +202,203 @@ void LLVMGen::visit(Program& node) {
     }
 }
 
-// TOOD: add prototypes and function redefinition checking
+void LLVMGen::Generate(const FlatAST& ast) {
+    for(Ref r : ast.top_level) {
+        ast.accept(r, *this);
+        if(!res) {
+            error("prog gen failed");
+            return;
+        }
+    }
+}
+
 void LLVMGen::visit(FuncDef& node) {
-    std::vector<llvm::Type*> t(node.params.size(), llvm::Type::getDoubleTy(*ctx));
+    genFuncDef(node.name, node.params, TypeInference().Function(node), [&] { node.block->accept(*this); });
+}
+
+void LLVMGen::visit(Block& node) {
+    genBlock(node.exprs.size(), [&](size_t i) { node.exprs[i]->accept(*this); });
+}
+
+void LLVMGen::visit(Extern& node) {
+    genExtern(node.name, node.params);
+}
+
+void LLVMGen::visit(VarExpr& node) {
+    genVarExpr(node.name);
+}
+
+void LLVMGen::visit(NumLiteral& node) {
+    genNumLiteral(node.val, node.isDouble);
+}
+
+void LLVMGen::visit(BinOp& node) {
+    genBinOp(node.op, [&] { node.left->accept(*this); }, [&] { node.right->accept(*this); });
+}
+
+void LLVMGen::visit(IfExpr& node) {
+    genIfExpr([&] { node.cond->accept(*this); },
+              [&] { node.then->accept(*this); },
+              [&] { node.elss->accept(*this); });
+}
+
+void LLVMGen::visit(CallExpr& node) {
+    genCallExpr(node.name, node.args.size(), [&](size_t i) { node.args[i]->accept(*this); });
+}
+
+void LLVMGen::visit(LoopExpr& node) {
+    LoopScan body, step;
+    node.block->accept(body);
+    node.step->accept(step);
+    if(node.parallel) {
+        genParallelLoopExpr(node.name, loopShape(node.name, body, step), node.reductions, body.reads, body.assigns,
+                            [&] { node.rangeStart->accept(*this); },
+                            [&] { node.rangeEnd->accept(*this); },
+                            [&] { node.step->accept(*this); },
+                            [&] { node.block->accept(*this); });
+        return;
+    }
+    genLoopExpr(node.name, loopShape(node.name, body, step),
+                [&] { node.rangeStart->accept(*this); },
+                [&] { node.rangeEnd->accept(*this); },
+                [&] { node.step->accept(*this); },
+                [&] { node.block->accept(*this); });
+}
+
+void LLVMGen::visit(VarInitExpr& node) {
+    genVarInitExpr(node.name, [&] { node.val->accept(*this); });
+}
+
+void LLVMGen::visit(AssignExpr& node) {
+    genAssignExpr([&] { node.lhs->accept(*this); }, [&] { node.val->accept(*this); });
+}
+
+template<typename T>
+static llvm::ArrayRef<T> toArrayRef(Slice<T> s) {
+    return llvm::ArrayRef<T>(s.begin(), s.size());
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatFuncDef& node) {
+    genFuncDef(node.name, toArrayRef(ast.symbolsIn(node.params)), TypeInference().Function(ast, node),
+               [&] { ast.accept(node.block, *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatBlock& node) {
+    auto exprs = ast[node.exprs];
+    genBlock(exprs.size(), [&](size_t i) { ast.accept(exprs[i], *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatExtern& node) {
+    genExtern(node.name, toArrayRef(ast.symbolsIn(node.params)));
+}
+
+void LLVMGen::visit(const FlatAST&, const FlatVarExpr& node) {
+    genVarExpr(node.name);
+}
+
+void LLVMGen::visit(const FlatAST&, const FlatNumLiteral& node) {
+    genNumLiteral(node.val, node.isDouble);
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatBinOp& node) {
+    genBinOp(node.op, [&] { ast.accept(node.left, *this); }, [&] { ast.accept(node.right, *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatIfExpr& node) {
+    genIfExpr([&] { ast.accept(node.cond, *this); },
+              [&] { ast.accept(node.then, *this); },
+              [&] { ast.accept(node.elss, *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatCallExpr& node) {
+    auto args = ast[node.args];
+    genCallExpr(node.name, args.size(), [&](size_t i) { ast.accept(args[i], *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatLoopExpr& node) {
+    LoopScan body, step;
+    ast.accept(node.block, body);
+    ast.accept(node.step, step);
+    if(node.parallel) {
+        genParallelLoopExpr(node.name, loopShape(node.name, body, step), toArrayRef(ast.reductionsIn(node.reductions)),
+                            body.reads, body.assigns,
+                            [&] { ast.accept(node.rangeStart, *this); },
+                            [&] { ast.accept(node.rangeEnd, *this); },
+                            [&] { ast.accept(node.step, *this); },
+                            [&] { ast.accept(node.block, *this); });
+        return;
+    }
+    genLoopExpr(node.name, loopShape(node.name, body, step),
+                [&] { ast.accept(node.rangeStart, *this); },
+                [&] { ast.accept(node.rangeEnd, *this); },
+                [&] { ast.accept(node.step, *this); },
+                [&] { ast.accept(node.block, *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatVarInitExpr& node) {
+    genVarInitExpr(node.name, [&] { ast.accept(node.val, *this); });
+}
+
+void LLVMGen::visit(const FlatAST& ast, const FlatAssignExpr& node) {
+    genAssignExpr([&] { ast.accept(node.lhs, *this); }, [&] { ast.accept(node.val, *this); });
+}
+
+llvm::Function* LLVMGen::genPrototype(Symbol name, llvm::ArrayRef<Symbol> params) {
+    std::vector<llvm::Type*> t(params.size(), llvm::Type::getDoubleTy(*ctx));
     llvm::FunctionType* ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(*ctx), t, false);
-    llvm::Function* f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, node.name, mod.get());
+    llvm::Function* f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name.str(), mod.get());
     if(!f) {
-        error("failed to create function: " + node.name);
-        res = nullptr;
-        return;
+        error("failed to create function: " + name.str());
+        return nullptr;
     }
 
     size_t i = 0;
-    for(auto& arg : f->args()) arg.setName(node.params[i++]);
+    for(auto& arg : f->args()) arg.setName(params[i++].str());
+
+    return f;
+}
+
+// TOOD: add prototypes and function redefinition checking
+void LLVMGen::genFuncDef(Symbol name, llvm::ArrayRef<Symbol> params, std::vector<ValueType> types, Gen block) {
+    llvm::Function* f = genPrototype(name, params);
+    if(!f) {
+        res = nullptr;
+        return;
+    }
 
     llvm::BasicBlock* bb = llvm::BasicBlock::Create(*ctx, "entry", f);
     builder->SetInsertPoint(bb);
 
     env.clear();
+    vars.clear();
+    varTypes = std::move(types);
+    currentDef.clear();
+    incompletePhis.clear();
+    sealed.clear();
+
+    sealBlock(bb);
     for(auto& arg : f->args()) {
-        auto* alloc = allocLocalVarInFunc(f, arg.getName());
-        builder->CreateStore(&arg, alloc);
-        env[std::string(arg.getName())] = alloc;
+        Slot var = newVariable(params[arg.getArgNo()]);
+        writeVariable(var, bb, &arg);
+        env[params[arg.getArgNo()].id] = var;
     }
 
-    node.block->accept(*this);
+    block();
     if(!res) {
-        error("failed to generate body for function: " + node.name);
+        error("failed to generate body for function: " + name.str());
         f->eraseFromParent();
         return;
     }
-    builder->CreateRet(res);
+    builder->CreateRet(convert(res, llvm::Type::getDoubleTy(*ctx)));
 
     llvm::verifyFunction(*f);
     res = f;
 }
 
-
-void LLVMGen::visit(Block& node) {
+void LLVMGen::genBlock(size_t num_exprs, GenNth expr) {
     // evaluate the block to the value of the last expression (left in res)
-    for(auto& e : node.exprs) {
-        e->accept(*this);
+    for(size_t i = 0; i < num_exprs; i++) {
+        expr(i);
         if(!res) {
             error("block failed while evaluating expr");
             return;
@@ -90,63 +406,58 @@ void LLVMGen::visit(Block& node) {
     }
 }
 
-void LLVMGen::visit(Extern& node) {
+void LLVMGen::genExtern(Symbol name, llvm::ArrayRef<Symbol> params) {
     // create the function without writing the body
-    std::vector<llvm::Type*> t(node.params.size(), llvm::Type::getDoubleTy(*ctx));
-    llvm::FunctionType* ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(*ctx), t, false);
-    llvm::Function* f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, node.name, mod.get());
-    if(!f) {
-        error("failed to create function: " + node.name);
-        res = nullptr;
-        return;
-    }
-
-    size_t i = 0;
-    for(auto& arg : f->args()) arg.setName(node.params[i++]);
-
-    res = f;
+    res = genPrototype(name, params);
 }
 
-void LLVMGen::visit(VarExpr& node) {
-    auto* a = env[node.name];
-    if(!a) {
-        error("unbound variable: " + node.name);
+void LLVMGen::genVarExpr(Symbol name) {
+    auto it = env.find(name.id);
+    if(it == env.end()) {
+        error("unbound variable: " + name.str());
+        res = nullptr;
+        resVar.reset();
+        return;
     }
 
-    res = builder->CreateLoad(a->getAllocatedType(), a, node.name.c_str());
-    resAddr = a;
+    res = readVariable(it->second, builder->GetInsertBlock());
+    resVar = it->second;
 }
 
-// TODO: maybe change AST node from int val to float val
-void LLVMGen::visit(NumLiteral& node) {
-    res = llvm::ConstantFP::get(*ctx, llvm::APFloat(double(node.val)));
+void LLVMGen::genNumLiteral(int val, bool isDouble) {
+    res = isDouble ? llvm::ConstantFP::get(builder->getDoubleTy(), val) : builder->getInt64(val);
 }
 
-void LLVMGen::visit(BinOp& node) {
-    node.left->accept(*this);
+void LLVMGen::genBinOp(char op, Gen left, Gen right) {
+    left();
     if(!res) {
         error("failed to generate lhs of binop node");
         return;
     }
     llvm::Value* lhs = res;
 
-    node.right->accept(*this);
+    right();
     if(!res) {
         error("failed to generate rhs of binop node");
         return;
     }
     llvm::Value* rhs = res;
 
-    switch(node.op) {
+    // bools take part as integers
+    llvm::Type* type = wider(builder->getInt64Ty(), wider(lhs->getType(), rhs->getType()));
+    lhs = convert(lhs, type);
+    rhs = convert(rhs, type);
+    bool fp = type->isDoubleTy();
+
+    switch(op) {
         case '-':
-            res = builder->CreateFSub(lhs, rhs, "sub");
+            res = fp ? builder->CreateFSub(lhs, rhs, "sub") : builder->CreateSub(lhs, rhs, "sub");
             return;
         case '+':
-            res = builder->CreateFAdd(lhs, rhs, "add");
+            res = fp ? builder->CreateFAdd(lhs, rhs, "add") : builder->CreateAdd(lhs, rhs, "add");
             return;
         case '<':
-            res = builder->CreateFCmpULT(lhs, rhs, "lt");
-            res = builder->CreateUIToFP(res, llvm::Type::getDoubleTy(*ctx), "bool");
+            res = fp ? builder->CreateFCmpULT(lhs, rhs, "lt") : builder->CreateICmpSLT(lhs, rhs, "lt");
             return;
         default:
             error("invalid binary operator");
@@ -155,13 +466,13 @@ void LLVMGen::visit(BinOp& node) {
     }
 }
 
-void LLVMGen::visit(IfExpr& node) {
-    node.cond->accept(*this);
+void LLVMGen::genIfExpr(Gen condGen, Gen thenGen, Gen elseGen) {
+    condGen();
     if(!res) {
         error("failed to generate code for if condition");
         return;
     }
-    llvm::Value* cond = builder->CreateFCmpONE(res, llvm::ConstantFP::get(*ctx, llvm::APFloat(0.0)), "cond");
+    llvm::Value* cond = isTrue(res);
 
     llvm::Function* currFunc = builder->GetInsertBlock()->getParent();
     llvm::BasicBlock* then = llvm::BasicBlock::Create(*ctx, "then");
@@ -171,7 +482,8 @@ void LLVMGen::visit(IfExpr& node) {
 
     currFunc->insert(currFunc->end(), then);
     builder->SetInsertPoint(then);
-    node.then->accept(*this);
+    sealBlock(then);
+    thenGen();
     if(!res) {
         error("failed to generate code for then block of if condition");
         return;
@@ -182,7 +494,8 @@ void LLVMGen::visit(IfExpr& node) {
 
     currFunc->insert(currFunc->end(), elss);
     builder->SetInsertPoint(elss);
-    node.elss->accept(*this);
+    sealBlock(elss);
+    elseGen();
     if(!res) {
         error("failed to generate code for else block of if condition");
         return;
@@ -191,140 +504,675 @@ void LLVMGen::visit(IfExpr& node) {
     builder->CreateBr(merge);
     elss = builder->GetInsertBlock();
 
+    // bring both values to the wider type at the end of their branch
+    llvm::Type* type = wider(thenVal->getType(), elseVal->getType());
+    builder->SetInsertPoint(then->getTerminator());
+    thenVal = convert(thenVal, type);
+    builder->SetInsertPoint(elss->getTerminator());
+    elseVal = convert(elseVal, type);
+
     currFunc->insert(currFunc->end(), merge);
     builder->SetInsertPoint(merge);
-    llvm::PHINode* phi = builder->CreatePHI(llvm::Type::getDoubleTy(*ctx), 2, "phi");
+    sealBlock(merge);
+    llvm::PHINode* phi = builder->CreatePHI(type, 2, "phi");
     phi->addIncoming(thenVal, then);
     phi->addIncoming(elseVal, elss);
 
     res = phi;
 }
 
-void LLVMGen::visit(CallExpr& node) {
-    auto* func = mod->getFunction(node.name);
+void LLVMGen::genCallExpr(Symbol name, size_t num_args, GenNth arg) {
+    auto* func = mod->getFunction(name.str());
     if(!func) {
-        error("failed to find function " + node.name + " when generating calling code");
+        error("failed to find function " + name.str() + " when generating calling code");
         res = nullptr;
         return;
     }
 
-    if(node.args.size() != func->arg_size()) {
-        error("function " + node.name + " called with wrong number of arguments");
+    if(num_args != func->arg_size()) {
+        error("function " + name.str() + " called with wrong number of arguments");
         res = nullptr;
         return;
     }
 
     std::vector<llvm::Value*> argValues;
-    for(size_t i = 0; i < node.args.size(); i++) {
-        node.args[i]->accept(*this);
+    for(size_t i = 0; i < num_args; i++) {
+        arg(i);
         if(!res) {
-            error("failed codegen for for argument to funcall: " + node.name);
+            error("failed codegen for for argument to funcall: " + name.str());
             return;
         }
-        argValues.push_back(res);
+        argValues.push_back(convert(res, llvm::Type::getDoubleTy(*ctx)));
     }
 
-    res = builder->CreateCall(func, argValues, "call_" + node.name);
+    res = builder->CreateCall(func, argValues, "call_" + name.str());
 }
 
-void LLVMGen::visit(LoopExpr& node) {
-    node.rangeStart->accept(*this);
+// A loop runs its body, adds the step to the variable and stops once the variable equals the end.
+// When start, end and step are provably integers and the body leaves the variable alone, the loop
+// is counted instead: an i64 counter runs from 0 to a trip count worked out ahead of the loop, and
+// the variable is start + count * step. That gives the loop optimizations and the vectorizer the
+// canonical induction variable and computable trip count they look for.
+void LLVMGen::genLoopExpr(Symbol name, const LoopShape& shape, Gen rangeStart, Gen rangeEnd, Gen stepGen, Gen block) {
+    rangeStart();
     if(!res) {
         error("failed to generate code of loop start val");
         return;
     }
     llvm::Value* start = res;
 
-    node.rangeEnd->accept(*this);
+    rangeEnd();
     if(!res) {
         error("failed to generate code of loop end val");
         return;
     }
     llvm::Value* end = res;
 
+    // a step that can't change between iterations is evaluated once, ahead of the loop
+    llvm::Value* step = nullptr;
+    if(shape.stepInvariant) {
+        stepGen();
+        if(!res) {
+            error("failed to generate code of loop step val");
+            return;
+        }
+        step = res;
+    }
+
+    llvm::Value *start64 = nullptr, *end64 = nullptr, *step64 = nullptr, *tripCount = nullptr;
+    if(step && !shape.assignsVar && (start64 = exactInt(start)) && (end64 = exactInt(end)) && (step64 = exactInt(step)))
+        tripCount = genTripCount(start64, end64, step64);
+
+    Slot loopVar = newVariable(name);
+    llvm::Type* varType = vars[loopVar].type;
+    if(!tripCount) start = convert(start, varType);
+
     auto* currFunc = builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock* preheader = builder->GetInsertBlock();
     llvm::BasicBlock* loopBlock = llvm::BasicBlock::Create(*ctx, "loop", currFunc);
     builder->CreateBr(loopBlock);
 
+    // the loop block isn't sealed until the back-edge to it exists
     builder->SetInsertPoint(loopBlock);
-    auto* loopVar = allocLocalVarInFunc(currFunc, node.name);
-    builder->CreateStore(start, loopVar);
+    llvm::PHINode* count = nullptr;
+    if(tripCount) {
+        count = builder->CreatePHI(builder->getInt64Ty(), 2, "count");
+        count->addIncoming(builder->getInt64(0), preheader);
+        llvm::Value* iv = builder->CreateAdd(start64, builder->CreateMul(count, step64), name.str());
+        writeVariable(loopVar, loopBlock, convert(iv, varType));
+    }
+    else {
+        writeVariable(loopVar, preheader, start);
+    }
 
     // loop var shadows and then restores original value
-    llvm::AllocaInst* oldVarVal = env[node.name];
-    env[node.name] = loopVar;
+    auto old = env.find(name.id);
+    std::optional<Slot> oldVar;
+    if(old != env.end()) oldVar = old->second;
+    env[name.id] = loopVar;
 
-    node.block->accept(*this);
+    block();
     if(!res) {
         error("failed to generate body of loop");
         return;
     }
 
-    node.step->accept(*this);
+    if(!step) {
+        stepGen();
+        if(!res) {
+            error("failed to generate code of loop step val");
+            return;
+        }
+        step = res;
+    }
+
+    llvm::BasicBlock* latch = builder->GetInsertBlock();
+    llvm::BasicBlock* postLoopBlock = llvm::BasicBlock::Create(*ctx, "endLoop", currFunc);
+    if(tripCount) {
+        // the count stays below the trip count, so adding one can't wrap
+        llvm::Value* next = builder->CreateAdd(count, builder->getInt64(1), "nextCount", true);
+        count->addIncoming(next, latch);
+        llvm::Value* endCond = builder->CreateICmpNE(next, tripCount, "loopEndCond");
+        auto* backEdge = builder->CreateCondBr(endCond, loopBlock, postLoopBlock);
+        sealBlock(loopBlock);
+        backEdge->setMetadata(llvm::LLVMContext::MD_loop, loopMetadata(shape, loopBlock));
+    }
+    else {
+        // the variable's type is at least as wide as the step's
+        llvm::Value* curVar = readVariable(loopVar, latch);
+        step = convert(step, varType);
+        llvm::Value* nextVar = varType->isDoubleTy() ? builder->CreateFAdd(curVar, step, "nextLoopVar")
+                                                     : builder->CreateAdd(curVar, step, "nextLoopVar");
+        writeVariable(loopVar, latch, nextVar);
+
+        llvm::Type* cmpType = wider(varType, end->getType());
+        nextVar = convert(nextVar, cmpType);
+        end = convert(end, cmpType);
+        llvm::Value* endCond = cmpType->isDoubleTy() ? builder->CreateFCmpONE(nextVar, end, "loopEndCond")
+                                                     : builder->CreateICmpNE(nextVar, end, "loopEndCond");
+        builder->CreateCondBr(endCond, loopBlock, postLoopBlock);
+        sealBlock(loopBlock);
+    }
+    builder->SetInsertPoint(postLoopBlock);
+    sealBlock(postLoopBlock);
+
+    if(oldVar) env[name.id] = *oldVar;
+    else env.erase(name.id);
+
+    res = builder->getInt64(0);
+}
+
+// A parallel loop is outlined into a function running a chunk [begin, end) of its iterations,
+// void NAME.parallel(ctx, partial, begin, end), which __kl_parallel_for hands out to the runtime's
+// threads. The iterations are counted ahead like those of a counted loop, and each one recomputes
+// the variable as start + index * step. The variables the body reads are copied into ctx. Each
+// chunk accumulates a reduction from its identity (0 for sum, the value before the loop for min and
+// max) and stores it in a partial of its own, and once the loop is done the partials are folded into
+// the variable in the order of the chunks. How the iterations are split into chunks depends only on
+// the trip count and the grain, so a sum of doubles comes out the same whichever threads ran which
+// chunks, though it can differ in the last bits from a sequential loop adding one iteration at a time.
+void LLVMGen::genParallelLoopExpr(Symbol name, const LoopShape& shape, llvm::ArrayRef<Reduction> reductions,
+                                  llvm::ArrayRef<Symbol> reads, llvm::ArrayRef<Symbol> assigns,
+                                  Gen rangeStart, Gen rangeEnd, Gen stepGen, Gen block) {
+    // the iterations have to be independent of each other
+    if(!shape.stepInvariant || shape.assignsVar) {
+        error("parallel loop " + name.str() + " changes its variable or step in the body");
+        res = nullptr;
+        return;
+    }
+
+    std::vector<Slot> reduced;
+    for(const auto& r : reductions) {
+        auto it = env.find(r.var.id);
+        if(it == env.end() || r.var == name) {
+            error("reduction variable " + r.var.str() + " of parallel loop " + name.str() + " isn't declared before it");
+            res = nullptr;
+            return;
+        }
+        if(std::find(reduced.begin(), reduced.end(), it->second) != reduced.end()) {
+            error("variable " + r.var.str() + " is reduced twice by parallel loop " + name.str());
+            res = nullptr;
+            return;
+        }
+        if(r.op == ReductionOp::Sum && vars[it->second].type->isIntegerTy(1)) {
+            error("sum reduction of bool variable " + r.var.str());
+            res = nullptr;
+            return;
+        }
+        reduced.push_back(it->second);
+    }
+
+    // conservative like LoopScan: an inner loop reusing the name of an outer variable assigns it
+    for(Symbol s : assigns) {
+        auto it = env.find(s.id);
+        if(s == name || it == env.end()) continue;
+        if(std::find(reduced.begin(), reduced.end(), it->second) == reduced.end()) {
+            error("parallel loop " + name.str() + " assigns " + s.str() + ", which isn't one of its reductions");
+            res = nullptr;
+            return;
+        }
+    }
+
+    rangeStart();
+    if(!res) {
+        error("failed to generate code of loop start val");
+        return;
+    }
+    llvm::Value* start = res;
+
+    rangeEnd();
+    if(!res) {
+        error("failed to generate code of loop end val");
+        return;
+    }
+    llvm::Value* end = res;
+
+    stepGen();
     if(!res) {
         error("failed to generate code of loop step val");
         return;
     }
     llvm::Value* step = res;
 
-    llvm::Value* loopVarLoaded = builder->CreateLoad(loopVar->getAllocatedType(), loopVar, "loopVarLoad");
-    llvm::Value* nextVar = builder->CreateFAdd(loopVarLoaded, step, "nextLoopVar");
-    llvm::Value* endCond = builder->CreateFCmpONE(nextVar, end, "loopEndCond");
+    llvm::Value *start64 = nullptr, *end64 = nullptr, *step64 = nullptr, *tripCount = nullptr;
+    llvm::Type* doubleTy = llvm::Type::getDoubleTy(*ctx);
+    if((start64 = exactInt(start)) && (end64 = exactInt(end)) && (step64 = exactInt(step)))
+        tripCount = genTripCount(start64, end64, step64);
+    else
+        tripCount = genTripCountFP(convert(start, doubleTy), convert(end, doubleTy), convert(step, doubleTy));
 
-    llvm::BasicBlock* postLoopBlock = llvm::BasicBlock::Create(*ctx, "endLoop", currFunc);
-    builder->CreateCondBr(endCond, loopBlock, postLoopBlock);
-    builder->SetInsertPoint(postLoopBlock);
-    builder->CreateStore(nextVar, loopVar);
+    Slot loopVar = newVariable(name);
+    llvm::Type* varType = vars[loopVar].type;
+    start = convert(start, varType);
+    step = convert(step, varType);
+
+    // what the body reads from around the loop, the reductions aside
+    std::vector<Slot> captured;
+    for(Symbol s : reads) {
+        auto it = env.find(s.id);
+        if(s == name || it == env.end()) continue;
+        if(std::find(captured.begin(), captured.end(), it->second) != captured.end()) continue;
+        if(std::find(reduced.begin(), reduced.end(), it->second) != reduced.end()) continue;
+        captured.push_back(it->second);
+    }
+
+    // ctx is {start, step, captured..., reduced...}, allocated once in the entry block
+    llvm::BasicBlock* outer = builder->GetInsertBlock();
+    llvm::Function* parent = outer->getParent();
+    std::vector<llvm::Type*> fields{varType, varType};
+    std::vector<llvm::Value*> values{start, step};
+    for(Slot v : captured) {
+        fields.push_back(vars[v].type);
+        values.push_back(readVariable(v, outer));
+    }
+    std::vector<llvm::Value*> before;
+    for(Slot v : reduced) {
+        before.push_back(readVariable(v, outer));
+        fields.push_back(vars[v].type);
+        values.push_back(before.back());
+    }
 
-    if(oldVarVal) env[node.name] = oldVarVal;
-    else env.erase(node.name);
+    llvm::StructType* closureType = llvm::StructType::get(*ctx, fields);
+    llvm::IRBuilder<> entryBuilder(&parent->getEntryBlock(), parent->getEntryBlock().begin());
+    llvm::AllocaInst* closure = entryBuilder.CreateAlloca(closureType, nullptr, name.str() + ".ctx");
+    for(unsigned i = 0; i < values.size(); i++) builder->CreateStore(values[i], builder->CreateStructGEP(closureType, closure, i));
 
-    res = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*ctx));
+    auto* ptrTy = builder->getPtrTy();
+    auto* i64 = builder->getInt64Ty();
+    auto* chunkType = llvm::FunctionType::get(builder->getVoidTy(), {ptrTy, ptrTy, i64, i64}, false);
+    llvm::Function* chunk = llvm::Function::Create(chunkType, llvm::Function::InternalLinkage, parent->getName() + ".parallel", mod.get());
+    llvm::Argument* closureArg = chunk->getArg(0);
+    llvm::Argument* partial = chunk->getArg(1);
+    llvm::Argument* begin = chunk->getArg(2);
+    llvm::Argument* endIndex = chunk->getArg(3);
+    closureArg->setName("ctx");
+    partial->setName("partial");
+    begin->setName("begin");
+    endIndex->setName("end");
+
+    // the chunk's blocks are new, so the variables it writes at its entry don't disturb the
+    // function around it
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(*ctx, "entry", chunk);
+    builder->SetInsertPoint(entry);
+    sealBlock(entry);
+    auto field = [&](unsigned i) { return builder->CreateLoad(fields[i], builder->CreateStructGEP(closureType, closureArg, i)); };
+    llvm::Value* chunkStart = field(0);
+    llvm::Value* chunkStep = field(1);
+    for(unsigned i = 0; i < captured.size(); i++) writeVariable(captured[i], entry, field(2 + i));
+    for(unsigned i = 0; i < reduced.size(); i++) {
+        llvm::Value* identity = reductions[i].op == ReductionOp::Sum
+                                    ? static_cast<llvm::Value*>(llvm::Constant::getNullValue(fields[2 + captured.size() + i]))
+                                    : field(2 + captured.size() + i);
+        writeVariable(reduced[i], entry, identity);
+    }
+
+    // runs at least once, the runtime never hands out an empty chunk
+    llvm::BasicBlock* loopBlock = llvm::BasicBlock::Create(*ctx, "loop", chunk);
+    builder->CreateBr(loopBlock);
+    builder->SetInsertPoint(loopBlock);
+    llvm::PHINode* index = builder->CreatePHI(i64, 2, "index");
+    index->addIncoming(begin, entry);
+    llvm::Value* iv = varType->isDoubleTy()
+        ? builder->CreateFAdd(chunkStart, builder->CreateFMul(builder->CreateSIToFP(index, doubleTy), chunkStep), name.str())
+        : builder->CreateAdd(chunkStart, builder->CreateMul(index, chunkStep), name.str());
+    writeVariable(loopVar, loopBlock, iv);
+
+    // variables the body declares go out of scope with it
+    llvm::DenseMap<std::uint32_t, Slot> outerEnv = env;
+    env[name.id] = loopVar;
+
+    block();
+    if(!res) {
+        error("failed to generate body of parallel loop");
+        chunk->eraseFromParent();
+        return;
+    }
+
+    llvm::BasicBlock* latch = builder->GetInsertBlock();
+    llvm::BasicBlock* exit = llvm::BasicBlock::Create(*ctx, "endLoop", chunk);
+    llvm::Value* next = builder->CreateAdd(index, builder->getInt64(1), "nextIndex");
+    index->addIncoming(next, latch);
+    auto* backEdge = builder->CreateCondBr(builder->CreateICmpNE(next, endIndex, "loopEndCond"), loopBlock, exit);
+    sealBlock(loopBlock);
+    backEdge->setMetadata(llvm::LLVMContext::MD_loop, loopMetadata(shape, loopBlock));
+    builder->SetInsertPoint(exit);
+    sealBlock(exit);
+
+    for(unsigned i = 0; i < reduced.size(); i++) {
+        builder->CreateStore(readVariable(reduced[i], exit), builder->CreateConstInBoundsGEP1_64(builder->getInt8Ty(), partial, i * 8));
+    }
+    builder->CreateRetVoid();
+    llvm::verifyFunction(*chunk);
+
+    builder->SetInsertPoint(outer);
+    env = std::move(outerEnv);
+
+    auto parallelFor = mod->getOrInsertFunction("__kl_parallel_for", builder->getVoidTy(), ptrTy, ptrTy, ptrTy, i64, i64, i64);
+    llvm::Value* grain = builder->getInt64(parallelGrain);
+    if(reduced.empty()) {
+        builder->CreateCall(parallelFor, {chunk, closure, llvm::ConstantPointerNull::get(ptrTy), builder->getInt64(0), tripCount, grain});
+        res = builder->getInt64(0);
+        return;
+    }
+
+    // a partial for every chunk, on the heap since there can be tens of thousands
+    llvm::Value* stride = builder->getInt64(reduced.size() * 8);
+    llvm::Value* chunks = builder->CreateCall(mod->getOrInsertFunction("__kl_parallel_chunks", i64, i64, i64), {tripCount, grain}, "chunks");
+    llvm::Value* partials = builder->CreateCall(mod->getOrInsertFunction("malloc", ptrTy, i64), {builder->CreateMul(chunks, stride)}, "partials");
+    builder->CreateCall(parallelFor, {chunk, closure, partials, stride, tripCount, grain});
+
+    // the variables still hold their values from before the loop, which come first
+    genChunkLoop(partials, stride, chunks, [&](llvm::Value* slot) {
+        llvm::BasicBlock* at = builder->GetInsertBlock();
+        for(unsigned i = 0; i < reduced.size(); i++) {
+            llvm::Value* part = builder->CreateLoad(vars[reduced[i]].type, builder->CreateConstInBoundsGEP1_64(builder->getInt8Ty(), slot, i * 8));
+            writeVariable(reduced[i], at, reduce(reductions[i].op, readVariable(reduced[i], at), part));
+        }
+    });
+    builder->CreateCall(mod->getOrInsertFunction("free", builder->getVoidTy(), ptrTy), {partials});
+
+    res = builder->getInt64(0);
 }
 
-void LLVMGen::visit(VarInitExpr& node) {
-    auto* test = env[node.name];
-    if(test) {
-        error("redefined variable: " + node.name);
+llvm::Value* LLVMGen::exactInt(llvm::Value* v) {
+    if(v->getType()->isIntegerTy(64)) return v;
+    if(v->getType()->isIntegerTy(1)) return builder->CreateZExt(v, builder->getInt64Ty());
+
+    // doubles hold every integer up to 2^53; half that keeps the distance from start to end exact too
+    constexpr double limit = double(std::int64_t(1) << 52);
+    if(auto* c = llvm::dyn_cast<llvm::ConstantFP>(v)) {
+        const llvm::APFloat& f = c->getValueAPF();
+        if(!f.isInteger()) return nullptr;
+        double d = f.convertToDouble();
+        if(d < -limit || d > limit) return nullptr;
+        return builder->getInt64(std::int64_t(d));
+    }
+
+    // integers converted to double, e.g. a comparison result
+    if(llvm::isa<llvm::SIToFPInst>(v) || llvm::isa<llvm::UIToFPInst>(v)) {
+        llvm::Value* i = llvm::cast<llvm::CastInst>(v)->getOperand(0);
+        if(!i->getType()->isIntegerTy() || i->getType()->getIntegerBitWidth() > 52) return nullptr;
+        if(llvm::isa<llvm::SIToFPInst>(v)) return builder->CreateSExt(i, builder->getInt64Ty());
+        return builder->CreateZExt(i, builder->getInt64Ty());
+    }
+
+    return nullptr;
+}
+
+// The number of times the body runs: the smallest n >= 1 with start + n * step == end. A loop that
+// never gets there (the end is behind start, or not a whole number of steps away) counts to
+// 2^64 - 1, which is as good as the forever the double loop would run. Folds to a constant when
+// start, end and step are.
+llvm::Value* LLVMGen::genTripCount(llvm::Value* start, llvm::Value* end, llvm::Value* step) {
+    llvm::Value* zero = builder->getInt64(0);
+    llvm::Value* forever = builder->getInt64(~std::uint64_t(0));
+
+    // a zero step reaches the end only if it starts there, after one pass
+    llvm::Value* zeroStep = builder->CreateICmpEQ(step, zero);
+    llvm::Value* once = builder->CreateSelect(builder->CreateICmpEQ(end, start), builder->getInt64(1), forever);
+
+    // end - start can overflow an i64, so the distance and the step's size are taken unsigned in
+    // the direction of the step; the end must then lie ahead of start in that direction
+    llvm::Value* up = builder->CreateICmpSGT(step, zero);
+    llvm::Value* dist = builder->CreateSelect(up, builder->CreateSub(end, start), builder->CreateSub(start, end), "dist");
+    llvm::Value* size = builder->CreateSelect(up, step, builder->CreateSub(zero, step));
+    llvm::Value* ahead = builder->CreateSelect(up, builder->CreateICmpSGT(end, start), builder->CreateICmpSLT(end, start));
+
+    llvm::Value* divisor = builder->CreateSelect(zeroStep, builder->getInt64(1), size);
+    llvm::Value* steps = builder->CreateUDiv(dist, divisor, "steps");
+    llvm::Value* whole = builder->CreateICmpEQ(builder->CreateURem(dist, divisor), zero);
+    llvm::Value* stepping = builder->CreateSelect(builder->CreateAnd(whole, ahead), steps, forever);
+
+    return builder->CreateSelect(zeroStep, once, stepping, "tripCount");
+}
+
+// genTripCount for a range only known as doubles, as when the end is a parameter: the number of
+// steps from start to end if it is a whole one of at least one, else forever.
+llvm::Value* LLVMGen::genTripCountFP(llvm::Value* start, llvm::Value* end, llvm::Value* step) {
+    llvm::Value* forever = builder->getInt64(~std::uint64_t(0));
+    llvm::Value* zero = llvm::ConstantFP::get(*ctx, llvm::APFloat(0.0));
+    llvm::Value* dist = builder->CreateFSub(end, start, "dist");
+
+    llvm::Value* zeroStep = builder->CreateFCmpOEQ(step, zero);
+    llvm::Value* once = builder->CreateSelect(builder->CreateFCmpOEQ(dist, zero), builder->getInt64(1), forever);
+
+    // a count of 2^63 or more doesn't fit the conversion, and is as good as forever anyway
+    llvm::Value* steps = builder->CreateFDiv(dist, step, "steps");
+    llvm::Value* whole = builder->CreateFCmpOEQ(steps, builder->CreateUnaryIntrinsic(llvm::Intrinsic::floor, steps));
+    llvm::Value* inRange = builder->CreateAnd(builder->CreateFCmpOGE(steps, llvm::ConstantFP::get(*ctx, llvm::APFloat(1.0))),
+                                              builder->CreateFCmpOLT(steps, llvm::ConstantFP::get(*ctx, llvm::APFloat(0x1p63))));
+    llvm::Value* stepping = builder->CreateSelect(builder->CreateAnd(whole, inRange), builder->CreateFPToSI(steps, builder->getInt64Ty()), forever);
+
+    return builder->CreateSelect(zeroStep, once, stepping, "tripCount");
+}
+
+// bools compare as 0 and 1
+llvm::Value* LLVMGen::reduce(ReductionOp op, llvm::Value* acc, llvm::Value* v) {
+    llvm::Type* type = acc->getType();
+    auto less = [&](llvm::Value* a, llvm::Value* b) {
+        if(type->isDoubleTy()) return builder->CreateFCmpOLT(a, b);
+        return type->isIntegerTy(1) ? builder->CreateICmpULT(a, b) : builder->CreateICmpSLT(a, b);
+    };
+
+    switch(op) {
+        case ReductionOp::Sum:
+            return type->isDoubleTy() ? builder->CreateFAdd(acc, v, "sum") : builder->CreateAdd(acc, v, "sum");
+        case ReductionOp::Min:
+            return builder->CreateSelect(less(v, acc), v, acc, "min");
+        case ReductionOp::Max:
+            return builder->CreateSelect(less(acc, v), v, acc, "max");
+    }
+    return acc;
+}
+
+void LLVMGen::genChunkLoop(llvm::Value* partials, llvm::Value* stride, llvm::Value* chunks, llvm::function_ref<void(llvm::Value*)> body) {
+    llvm::Function* f = builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock* preheader = builder->GetInsertBlock();
+    llvm::BasicBlock* head = llvm::BasicBlock::Create(*ctx, "partials", f);
+    llvm::BasicBlock* each = llvm::BasicBlock::Create(*ctx, "partial", f);
+    llvm::BasicBlock* done = llvm::BasicBlock::Create(*ctx, "partialsDone", f);
+    builder->CreateBr(head);
+
+    builder->SetInsertPoint(head);
+    llvm::PHINode* c = builder->CreatePHI(builder->getInt64Ty(), 2, "c");
+    c->addIncoming(builder->getInt64(0), preheader);
+    builder->CreateCondBr(builder->CreateICmpULT(c, chunks), each, done);
+
+    builder->SetInsertPoint(each);
+    sealBlock(each);
+    body(builder->CreateInBoundsGEP(builder->getInt8Ty(), partials, builder->CreateMul(c, stride)));
+    c->addIncoming(builder->CreateAdd(c, builder->getInt64(1)), builder->GetInsertBlock());
+    builder->CreateBr(head);
+
+    sealBlock(head);
+    builder->SetInsertPoint(done);
+    sealBlock(done);
+}
+
+// Counted loops always finish. Straight-line bodies, all arithmetic, are asked to be vectorized if
+// every value carried from one iteration to the next is an integer or bool: like #pragma clang loop
+// vectorize(enable), the hint lets reductions over doubles be reassociated, which would change the
+// result from that of -O0. The loop's header has to be sealed, so that its phis are the carried
+// values.
+llvm::MDNode* LLVMGen::loopMetadata(const LoopShape& shape, llvm::BasicBlock* header) {
+    llvm::SmallVector<llvm::Metadata*, 4> ops;
+    ops.push_back(nullptr);  // the loop id refers to itself
+    ops.push_back(llvm::MDNode::get(*ctx, llvm::MDString::get(*ctx, "llvm.loop.mustprogress")));
+    bool integerCarried = llvm::all_of(header->phis(), [](const llvm::PHINode& phi) { return phi.getType()->isIntegerTy(); });
+    if(shape.straightLine && integerCarried) {
+        ops.push_back(llvm::MDNode::get(*ctx, {llvm::MDString::get(*ctx, "llvm.loop.vectorize.enable"),
+                                               llvm::ConstantAsMetadata::get(builder->getTrue())}));
+    }
+
+    llvm::MDNode* loopID = llvm::MDNode::getDistinct(*ctx, ops);
+    loopID->replaceOperandWith(0, loopID);
+    return loopID;
+}
+
+void LLVMGen::genVarInitExpr(Symbol name, Gen valGen) {
+    if(env.count(name.id)) {
+        error("redefined variable: " + name.str());
         res = nullptr;
         return;
     }
 
-    auto* alloc = allocLocalVarInFunc(builder->GetInsertBlock()->getParent(), node.name);
-
-    node.val->accept(*this);
+    valGen();
     if(!res) {
-        error("failed to codegen value of var init: " + node.name);
+        error("failed to codegen value of var init: " + name.str());
         return;
     }
-    auto* val = res;
 
-    builder->CreateStore(val, alloc);
-    env[node.name] = alloc;
+    Slot var = newVariable(name);
+    writeVariable(var, builder->GetInsertBlock(), convert(res, vars[var].type));
+    env[name.id] = var;
 }
 
-void LLVMGen::visit(AssignExpr& node) {
-    node.val->accept(*this);
+void LLVMGen::genAssignExpr(Gen lhs, Gen valGen) {
+    valGen();
     if(!res) {
         error("failed to codegen rhs of assignment");
         return;
     }
     auto* val = res;
 
-    node.lhs->accept(*this);
-    if(!resAddr) {
-        error("failed to get address of lhs of assign");
+    resVar.reset();
+    lhs();
+    if(!resVar) {
+        error("lhs of assign is not a variable");
         res = nullptr;
         return;
     }
 
-    auto* addr = resAddr;
-
-    builder->CreateStore(val, addr);
+    writeVariable(*resVar, builder->GetInsertBlock(), convert(val, vars[*resVar].type));
     res = val;
 }
 
+llvm::Type* LLVMGen::llvmType(ValueType type) {
+    switch(type) {
+        case ValueType::Bool:
+            return builder->getInt1Ty();
+        case ValueType::Int:
+            return builder->getInt64Ty();
+        default:
+            return llvm::Type::getDoubleTy(*ctx);
+    }
+}
+
+llvm::Type* LLVMGen::wider(llvm::Type* a, llvm::Type* b) {
+    if(a->isDoubleTy() || b->isDoubleTy()) return llvm::Type::getDoubleTy(*ctx);
+    return a->getIntegerBitWidth() >= b->getIntegerBitWidth() ? a : b;
+}
+
+llvm::Value* LLVMGen::convert(llvm::Value* v, llvm::Type* to) {
+    llvm::Type* from = v->getType();
+    if(from == to) return v;
+    if(to->isDoubleTy()) {
+        // a bool is 0 or 1, not 0 or -1
+        if(from->isIntegerTy(1)) return builder->CreateUIToFP(v, to, "tofp");
+        return builder->CreateSIToFP(v, to, "tofp");
+    }
+    if(from->isIntegerTy(1)) return builder->CreateZExt(v, to, "toint");
+
+    // never asked for by TypeInference; narrowing is truncation like a C cast
+    if(from->isDoubleTy()) return builder->CreateFPToSI(v, to, "toint");
+    return builder->CreateTrunc(v, to, "toint");
+}
+
+llvm::Value* LLVMGen::isTrue(llvm::Value* v) {
+    if(v->getType()->isIntegerTy(1)) return v;
+    if(v->getType()->isIntegerTy()) return builder->CreateICmpNE(v, llvm::ConstantInt::get(v->getType(), 0), "cond");
+    return builder->CreateFCmpONE(v, llvm::ConstantFP::get(*ctx, llvm::APFloat(0.0)), "cond");
+}
+
+LLVMGen::Slot LLVMGen::newVariable(Symbol name) {
+    // variables are created in the order TypeInference numbers them
+    ValueType type = vars.size() < varTypes.size() ? varTypes[vars.size()] : ValueType::Double;
+    vars.push_back({name, llvmType(type)});
+    return Slot(vars.size() - 1);
+}
+
+void LLVMGen::writeVariable(Slot var, llvm::BasicBlock* block, llvm::Value* val) {
+    currentDef[{block, var}] = val;
+}
+
+llvm::Value* LLVMGen::readVariable(Slot var, llvm::BasicBlock* block) {
+    auto it = currentDef.find({block, var});
+    if(it != currentDef.end() && it->second) return it->second;
+    return readVariableRecursive(var, block);
+}
+
+llvm::Value* LLVMGen::readVariableRecursive(Slot var, llvm::BasicBlock* block) {
+    llvm::Value* val;
+    if(!sealed.count(block)) {
+        auto* phi = newPhi(var, block);
+        incompletePhis[block].emplace_back(phi, var);
+        val = phi;
+    }
+    else if(auto* pred = block->getSinglePredecessor()) {
+        val = readVariable(var, pred);
+    }
+    else if(llvm::pred_empty(block)) {
+        // the entry block, reached by a path on which the variable was never defined (a var in
+        // only one branch of an if), which is what a load of an unset variable would give
+        val = llvm::UndefValue::get(vars[var].type);
+    }
+    else {
+        // recording the phi first ends the search when it comes back around a loop
+        auto* phi = newPhi(var, block);
+        writeVariable(var, block, phi);
+        val = addPhiOperands(var, phi);
+    }
+
+    writeVariable(var, block, val);
+    return val;
+}
+
+llvm::PHINode* LLVMGen::newPhi(Slot var, llvm::BasicBlock* block) {
+    auto* phi = llvm::PHINode::Create(vars[var].type, 0, vars[var].name.str());
+    phi->insertInto(block, block->begin());
+    return phi;
+}
+
+llvm::Value* LLVMGen::addPhiOperands(Slot var, llvm::PHINode* phi) {
+    for(auto* pred : llvm::predecessors(phi->getParent())) phi->addIncoming(readVariable(var, pred), pred);
+    return tryRemoveTrivialPhi(phi);
+}
+
+llvm::Value* LLVMGen::tryRemoveTrivialPhi(llvm::PHINode* phi) {
+    llvm::Value* same = nullptr;
+    for(llvm::Value* op : phi->incoming_values()) {
+        if(op == same || op == phi) continue;
+        if(same) return phi;  // merges at least two values
+        same = op;
+    }
+    if(!same) same = llvm::UndefValue::get(phi->getType());
+
+    // removing this phi may make the phis using it trivial in turn
+    llvm::SmallVector<llvm::WeakVH, 4> users;
+    for(auto* u : phi->users()) {
+        if(u != phi && llvm::isa<llvm::PHINode>(u)) users.emplace_back(u);
+    }
+
+    // currentDef holds tracking handles, so definitions that were this phi follow it to same
+    phi->replaceAllUsesWith(same);
+    phi->eraseFromParent();
+
+    for(auto& u : users) {
+        if(auto* p = llvm::dyn_cast_or_null<llvm::PHINode>(u)) tryRemoveTrivialPhi(p);
+    }
+    return same;
+}
+
+void LLVMGen::sealBlock(llvm::BasicBlock* block) {
+    // taken out of the map first, since completing a phi can add incomplete phis for other blocks
+    auto phis = std::move(incompletePhis[block]);
+    incompletePhis.erase(block);
+    for(auto& [phi, var] : phis) addPhiOperands(var, phi);
+    sealed.insert(block);
+}
+
 void LLVMGen::error(std::string message) {
+    fail = true;
     std::cerr << "LLVMGen: " << message << std::endl;
 }
 
@@ -338,30 +1186,395 @@ void LLVMGen::PrintRes() {
     std::cout << std::endl;
 }
 
-void LLVMGen::EmitObject() {
-    auto targetTripleStr = llvm::sys::getDefaultTargetTriple();
-    auto targetTriple = llvm::Triple(targetTripleStr);
+llvm::CodeGenOptLevel codeGenOptLevel(llvm::OptimizationLevel level) {
+    if(level.getSizeLevel() > 0) return llvm::CodeGenOptLevel::Default;
 
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
+    switch(level.getSpeedupLevel()) {
+        case 0: return llvm::CodeGenOptLevel::None;
+        case 1: return llvm::CodeGenOptLevel::Less;
+        case 2: return llvm::CodeGenOptLevel::Default;
+        default: return llvm::CodeGenOptLevel::Aggressive;
+    }
+}
 
-    std::string err;
+void resolveCPU(const std::string& cpu, std::string& name, std::string& features) {
+    name = cpu;
+    features.clear();
+    if(cpu != "native") return;
+
+    name = llvm::sys::getHostCPUName().str();
+
+    llvm::SubtargetFeatures hostFeatures;
+    for(const auto& f : llvm::sys::getHostCPUFeatures()) hostFeatures.AddFeature(f.first(), f.second);
+    features = hostFeatures.getString();
+}
+
+std::unique_ptr<llvm::TargetMachine> LLVMGen::createTargetMachine(std::string& err) const {
+    static std::once_flag initialized;
+    std::call_once(initialized, [] {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmParsers();
+        llvm::InitializeAllAsmPrinters();
+    });
+
+    auto targetTriple = llvm::Triple(llvm::sys::getDefaultTargetTriple());
     auto target = llvm::TargetRegistry::lookupTarget(targetTriple, err);
-    if(!target) {
+    if(!target) return nullptr;
+
+    std::string cpuName, features;
+    resolveCPU(cpu, cpuName, features);
+
+    llvm::TargetOptions opt;
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+        targetTriple, cpuName, features, opt, llvm::Reloc::PIC_, std::nullopt, codeGenOptLevel(optLevel)));
+}
+
+llvm::TargetMachine* LLVMGen::targetMachine() {
+    if(tm) return tm.get();
+
+    std::string err;
+    tm = createTargetMachine(err);
+    if(!tm) {
         error(err);
+        return nullptr;
+    }
+
+    mod->setDataLayout(tm->createDataLayout());
+    mod->setTargetTriple(tm->getTargetTriple());
+    return tm.get();
+}
+
+void optimizeModule(llvm::Module& mod, llvm::OptimizationLevel level, llvm::TargetMachine* tm, bool thinLTOPreLink) {
+    if(level == llvm::OptimizationLevel::O0) return;
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    llvm::PassBuilder pb(tm);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm = thinLTOPreLink ? pb.buildThinLTOPreLinkDefaultPipeline(level)
+                                                 : pb.buildPerModuleDefaultPipeline(level);
+    mpm.run(mod, mam);
+}
+
+void LLVMGen::Optimize() {
+    if(optLevel == llvm::OptimizationLevel::O0) return;
+    optimizeModule(*mod, optLevel, targetMachine());
+}
+
+void LLVMGen::OptimizeFunction(llvm::Function& f) {
+    if(optLevel == llvm::OptimizationLevel::O0 || f.isDeclaration()) return;
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    llvm::PassBuilder pb(targetMachine());
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::FunctionPassManager fpm = pb.buildFunctionSimplificationPipeline(optLevel, llvm::ThinOrFullLTOPhase::None);
+    fpm.run(f, fam);
+}
+
+// Same test as clang's __builtin_cpu_supports: the mask's first word is checked against
+// __cpu_model.__cpu_features and the rest against __cpu_features2, both filled in by
+// __cpu_indicator_init from compiler-rt or libgcc.
+static llvm::Value* cpuSupports(llvm::IRBuilder<>& b, llvm::Module& mod, const std::array<std::uint32_t, 4>& mask) {
+    auto* i32 = b.getInt32Ty();
+    auto* cpuModelTy = llvm::StructType::get(i32, i32, i32, llvm::ArrayType::get(i32, 1));
+    auto* cpuFeatures2Ty = llvm::ArrayType::get(i32, 3);
+
+    llvm::Value* supported = b.getTrue();
+    for(unsigned i = 0; i < mask.size(); i++) {
+        if(!mask[i]) continue;
+
+        llvm::Value* word;
+        if(i == 0) {
+            auto* cpuModel = mod.getOrInsertGlobal("__cpu_model", cpuModelTy);
+            word = b.CreateConstInBoundsGEP2_32(cpuModelTy, cpuModel, 0, 3);
+            word = b.CreateConstInBoundsGEP2_32(llvm::ArrayType::get(i32, 1), word, 0, 0);
+        }
+        else {
+            auto* cpuFeatures2 = mod.getOrInsertGlobal("__cpu_features2", cpuFeatures2Ty);
+            word = b.CreateConstInBoundsGEP2_32(cpuFeatures2Ty, cpuFeatures2, 0, i - 1);
+        }
+
+        llvm::Value* bits = b.CreateAnd(b.CreateAlignedLoad(i32, word, llvm::Align(4)), mask[i]);
+        supported = b.CreateAnd(supported, b.CreateICmpEQ(bits, b.getInt32(mask[i])));
+    }
+
+    return supported;
+}
+
+// Pure: every call is to a pure function of this module, and nothing else touches memory. The
+// whole language is locals and arithmetic, so only calls to externs (or to functions that make
+// them) can have effects. Starts from everything being pure and drops functions until it settles.
+static llvm::DenseSet<llvm::Function*> pureFunctions(llvm::Module& mod) {
+    llvm::DenseSet<llvm::Function*> pure;
+    for(auto& f : mod) {
+        if(!f.isDeclaration()) pure.insert(&f);
+    }
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(auto& f : mod) {
+            if(!pure.count(&f)) continue;
+            for(auto& inst : llvm::instructions(f)) {
+                bool effects;
+                if(auto* call = llvm::dyn_cast<llvm::CallBase>(&inst)) {
+                    auto* callee = call->getCalledFunction();
+                    effects = !callee || (!callee->isIntrinsic() && !pure.count(callee));
+                }
+                else {
+                    effects = inst.mayReadOrWriteMemory();
+                }
+
+                if(effects) {
+                    pure.erase(&f);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+    return pure;
+}
+
+void LLVMGen::Memoize(unsigned entries) {
+    constexpr unsigned maxParams = 4;
+    constexpr unsigned probes = 4;
+    entries = unsigned(llvm::PowerOf2Ceil(std::max(entries, probes)));
+
+    // recursive: in a call graph cycle, on its own or with others
+    auto pure = pureFunctions(*mod);
+    std::vector<llvm::Function*> memoized;
+    llvm::CallGraph cg(*mod);
+    for(auto scc = llvm::scc_begin(&cg); !scc.isAtEnd(); ++scc) {
+        if(!scc.hasCycle()) continue;
+        for(auto* node : *scc) {
+            auto* f = node->getFunction();
+            if(f && pure.count(f) && f->arg_size() >= 1 && f->arg_size() <= maxParams) memoized.push_back(f);
+        }
+    }
+
+    auto* i64 = builder->getInt64Ty();
+    auto* dbl = llvm::Type::getDoubleTy(*ctx);
+    for(auto* f : memoized) {
+        // The body moves to NAME.uncached and f becomes a lookup in front of it. Recursive calls in
+        // the body still go through f, so every level of the recursion is cached.
+        auto* impl = llvm::Function::Create(f->getFunctionType(), llvm::Function::InternalLinkage,
+                                            f->getName() + ".uncached", mod.get());
+        impl->splice(impl->begin(), f);
+        for(unsigned i = 0; i < f->arg_size(); i++) {
+            impl->getArg(i)->setName(f->getArg(i)->getName());
+            f->getArg(i)->replaceAllUsesWith(impl->getArg(i));
+        }
+
+        // Entries are {seq, args..., result} as i64 bit patterns, padded to 32 or 64 bytes so that
+        // none straddles a cache line. seq is 0 for an empty entry and odd while one is written: a
+        // seqlock, so lookups never wait and a torn read is just a miss.
+        unsigned k = f->arg_size();
+        unsigned words = k + 2 <= 4 ? 4 : 8;
+        auto* entryTy = llvm::ArrayType::get(i64, words);
+        auto* tableTy = llvm::ArrayType::get(entryTy, entries);
+        auto* table = new llvm::GlobalVariable(*mod, tableTy, false, llvm::GlobalValue::InternalLinkage,
+                                               llvm::ConstantAggregateZero::get(tableTy), f->getName() + ".memo");
+        table->setAlignment(llvm::Align(64));
+
+        auto word = [&](llvm::Value* idx, unsigned w) {
+            return builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), idx, builder->getInt64(w)});
+        };
+        auto load = [&](llvm::Value* ptr, llvm::AtomicOrdering order) {
+            auto* l = builder->CreateAlignedLoad(i64, ptr, llvm::Align(8));
+            l->setAtomic(order);
+            return l;
+        };
+        auto store = [&](llvm::Value* val, llvm::Value* ptr, llvm::AtomicOrdering order) {
+            builder->CreateAlignedStore(val, ptr, llvm::Align(8))->setAtomic(order);
+        };
+
+        auto* entry = llvm::BasicBlock::Create(*ctx, "entry", f);
+        auto* miss = llvm::BasicBlock::Create(*ctx, "miss", f);
+        builder->SetInsertPoint(entry);
+
+        std::vector<llvm::Value*> key;
+        llvm::Value* hash = builder->getInt64(0);
+        for(auto& arg : f->args()) {
+            key.push_back(builder->CreateBitCast(&arg, i64));
+            hash = builder->CreateMul(builder->CreateXor(hash, key.back()), builder->getInt64(0x9E3779B97F4A7C15));
+        }
+        hash = builder->CreateXor(hash, builder->CreateLShr(hash, 32));
+        llvm::Value* home = builder->CreateAnd(hash, entries - 1, "home");
+
+        // linear probing over a short window; the first empty entry ends the search
+        builder->SetInsertPoint(miss);
+        auto* slot = builder->CreatePHI(i64, probes + 1, "slot");
+        builder->SetInsertPoint(entry);
+        for(unsigned p = 0; p < probes; p++) {
+            llvm::Value* idx = builder->CreateAnd(builder->CreateAdd(home, builder->getInt64(p)), entries - 1, "idx");
+            llvm::Value* seq = load(word(idx, 0), llvm::AtomicOrdering::Acquire);
+            auto* check = llvm::BasicBlock::Create(*ctx, "check", f);
+            slot->addIncoming(idx, builder->GetInsertBlock());
+            builder->CreateCondBr(builder->CreateICmpEQ(seq, builder->getInt64(0)), miss, check);
+
+            builder->SetInsertPoint(check);
+            llvm::Value* match = builder->CreateICmpEQ(builder->CreateAnd(seq, 1), builder->getInt64(0));
+            for(unsigned i = 0; i < k; i++) {
+                llvm::Value* arg = load(word(idx, 1 + i), llvm::AtomicOrdering::Monotonic);
+                match = builder->CreateAnd(match, builder->CreateICmpEQ(arg, key[i]));
+            }
+            llvm::Value* result = load(word(idx, 1 + k), llvm::AtomicOrdering::Monotonic);
+            builder->CreateFence(llvm::AtomicOrdering::Acquire);
+            llvm::Value* again = load(word(idx, 0), llvm::AtomicOrdering::Monotonic);
+            match = builder->CreateAnd(match, builder->CreateICmpEQ(again, seq));
+
+            auto* hit = llvm::BasicBlock::Create(*ctx, "hit", f);
+            auto* next = p + 1 < probes ? llvm::BasicBlock::Create(*ctx, "probe", f) : miss;
+            if(next == miss) slot->addIncoming(home, check);
+            builder->CreateCondBr(match, hit, next);
+
+            builder->SetInsertPoint(hit);
+            builder->CreateRet(builder->CreateBitCast(result, dbl));
+            if(next != miss) builder->SetInsertPoint(next);
+        }
+
+        // a miss fills the empty entry it stopped at, or evicts the home one; an entry another
+        // thread is writing is left to it
+        miss->moveAfter(&f->back());
+        builder->SetInsertPoint(miss);
+        std::vector<llvm::Value*> args;
+        for(auto& arg : f->args()) args.push_back(&arg);
+        llvm::Value* result = builder->CreateCall(impl, args, "result");
+
+        auto* lock = llvm::BasicBlock::Create(*ctx, "lock", f);
+        auto* fill = llvm::BasicBlock::Create(*ctx, "fill", f);
+        auto* done = llvm::BasicBlock::Create(*ctx, "done", f);
+        llvm::Value* seq = load(word(slot, 0), llvm::AtomicOrdering::Monotonic);
+        builder->CreateCondBr(builder->CreateICmpEQ(builder->CreateAnd(seq, 1), builder->getInt64(0)), lock, done);
+
+        builder->SetInsertPoint(lock);
+        auto* cas = builder->CreateAtomicCmpXchg(word(slot, 0), seq, builder->CreateAdd(seq, builder->getInt64(1)),
+                                                 llvm::MaybeAlign(8), llvm::AtomicOrdering::Acquire,
+                                                 llvm::AtomicOrdering::Monotonic);
+        builder->CreateCondBr(builder->CreateExtractValue(cas, 1), fill, done);
+
+        builder->SetInsertPoint(fill);
+        builder->CreateFence(llvm::AtomicOrdering::Release);
+        for(unsigned i = 0; i < k; i++) store(key[i], word(slot, 1 + i), llvm::AtomicOrdering::Monotonic);
+        store(builder->CreateBitCast(result, i64), word(slot, 1 + k), llvm::AtomicOrdering::Monotonic);
+        store(builder->CreateAdd(seq, builder->getInt64(2)), word(slot, 0), llvm::AtomicOrdering::Release);
+        builder->CreateBr(done);
+
+        builder->SetInsertPoint(done);
+        builder->CreateRet(result);
+
+        llvm::verifyFunction(*f);
+    }
+}
+
+void LLVMGen::Multiversion(const std::vector<std::string>& levels) {
+    for(const auto& level : levels) {
+        if(level != "x86-64-v2" && level != "x86-64-v3" && level != "x86-64-v4") {
+            error("can't multiversion for " + level + ", expected x86-64-v2, x86-64-v3 or x86-64-v4");
+            return;
+        }
+    }
+
+    if(!targetMachine()) return;
+    auto triple = mod->getTargetTriple();
+    if(triple.getArch() != llvm::Triple::x86_64 || !triple.isOSBinFormatELF()) {
+        error("multiversioning needs an x86-64 ELF target");
         return;
     }
 
-    auto cpu = "generic";
-    auto features = "";
-    llvm::TargetOptions opt;
-    auto targetMachine = target->createTargetMachine(targetTriple, cpu, features, opt, llvm::Reloc::PIC_);
+    std::vector<llvm::Function*> funcs;
+    for(auto& f : *mod) {
+        if(!f.isDeclaration() && f.hasExternalLinkage()) funcs.push_back(&f);
+    }
 
-    mod->setDataLayout(targetMachine->createDataLayout());
-    mod->setTargetTriple(targetTriple);
+    // create every clone up front so calls between multiversioned functions can be remapped to the
+    // clone for the same level
+    std::vector<std::vector<llvm::Function*>> clones(levels.size());
+    for(size_t l = 0; l < levels.size(); l++) {
+        for(auto* f : funcs) {
+            auto* clone = llvm::Function::Create(f->getFunctionType(), llvm::Function::InternalLinkage,
+                                                 f->getName() + "." + levels[l], mod.get());
+            clones[l].push_back(clone);
+        }
+    }
+
+    for(size_t l = 0; l < levels.size(); l++) {
+        llvm::ValueToValueMapTy vmap;
+        for(size_t i = 0; i < funcs.size(); i++) vmap[funcs[i]] = clones[l][i];
+
+        for(size_t i = 0; i < funcs.size(); i++) {
+            auto* clone = clones[l][i];
+            auto newArg = clone->arg_begin();
+            for(auto& arg : funcs[i]->args()) {
+                newArg->setName(arg.getName());
+                vmap[&arg] = &*newArg++;
+            }
+
+            llvm::SmallVector<llvm::ReturnInst*, 4> returns;
+            llvm::CloneFunctionInto(clone, funcs[i], vmap, llvm::CloneFunctionChangeType::LocalChangesOnly, returns);
+
+            // the level alone decides the subtarget, whatever -mcpu says
+            clone->addFnAttr("target-cpu", levels[l]);
+            clone->addFnAttr("target-features", "");
+        }
+    }
+
+    auto* ptrTy = llvm::PointerType::getUnqual(*ctx);
+    auto cpuInit = mod->getOrInsertFunction("__cpu_indicator_init", llvm::Type::getVoidTy(*ctx));
+
+    for(size_t i = 0; i < funcs.size(); i++) {
+        auto* f = funcs[i];
+        std::string name = f->getName().str();
+        f->setName(name + ".default");
+        f->setLinkage(llvm::Function::InternalLinkage);
+
+        // resolvers may run before constructors, so initialize the cpu model first like clang does
+        auto* resolver = llvm::Function::Create(llvm::FunctionType::get(ptrTy, false), llvm::Function::InternalLinkage,
+                                                name + ".resolver", mod.get());
+        llvm::IRBuilder<> b(llvm::BasicBlock::Create(*ctx, "entry", resolver));
+        b.CreateCall(cpuInit);
+
+        // later levels win, so check from the least to the most capable
+        std::vector<size_t> order(levels.size());
+        for(size_t l = 0; l < levels.size(); l++) order[l] = l;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return levels[a] < levels[b]; });
+
+        llvm::Value* chosen = f;
+        for(size_t l : order) {
+            llvm::StringRef level = levels[l];
+            auto mask = llvm::X86::getCpuSupportsMask(level);
+            chosen = b.CreateSelect(cpuSupports(b, *mod, mask), clones[l][i], chosen);
+        }
+        b.CreateRet(chosen);
+
+        // calls inside the module already go straight to a version, only other objects use the ifunc
+        llvm::GlobalIFunc::create(f->getFunctionType(), 0, llvm::Function::ExternalLinkage, name, resolver, mod.get());
+    }
+}
+
+void LLVMGen::EmitObject() {
+    auto* targetMachine = this->targetMachine();
+    if(!targetMachine) return;
 
     auto fname = "out.o";
     std::error_code ec;
@@ -382,7 +1595,131 @@ void LLVMGen::EmitObject() {
     dest.flush();
 }
 
-llvm::AllocaInst* LLVMGen::allocLocalVarInFunc(llvm::Function* func, llvm::StringRef varName) {
-    llvm::IRBuilder<> b(&func->getEntryBlock(), func->getEntryBlock().begin());
-    return b.CreateAlloca(llvm::Type::getDoubleTy(*ctx), nullptr, varName);
+// Runs on a pool thread with nothing shared but this: the part is loaded into its own context and
+// gets its own target machine.
+std::string LLVMGen::compilePart(llvm::StringRef bitcode, llvm::SmallVectorImpl<char>& object) const {
+    llvm::LLVMContext partCtx;
+    auto part = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, "part"), partCtx);
+    if(!part) return llvm::toString(part.takeError());
+
+    std::string err;
+    auto partTM = createTargetMachine(err);
+    if(!partTM) return err;
+
+    optimizeModule(**part, optLevel, partTM.get());
+
+    llvm::raw_svector_ostream dest(object);
+    llvm::legacy::PassManager pm;
+    if(partTM->addPassesToEmitFile(pm, dest, nullptr, llvm::CodeGenFileType::ObjectFile)) {
+        return "targetMachine can't emit file of this type";
+    }
+    pm.run(**part);
+    return "";
+}
+
+void LLVMGen::EmitObjectParallel(unsigned jobs, ObjectCache* cache) {
+    // sets the triple and data layout the parts inherit
+    if(!targetMachine()) return;
+
+    // Parts are created in mod's context, which only one thread may use, so they're passed to the
+    // workers as bitcode. How the module is split depends only on the module, never on timing.
+    std::vector<llvm::SmallVector<char, 0>> parts;
+    auto addPart = [&](std::unique_ptr<llvm::Module> part) {
+        parts.emplace_back();
+        llvm::raw_svector_ostream os(parts.back());
+        llvm::WriteBitcodeToFile(*part, os);
+    };
+
+    if(cache) {
+        // one part per definition so that a change only misses the cache for what it touched;
+        // internal functions (multiversion clones and resolvers, uncached bodies) get a private
+        // copy in every part. So do memo tables, which only the one memoized function touches.
+        // CloneModule copies ifuncs whole whatever it is told, so each part keeps only its own and
+        // declares the rest, or every part would define every multiversioned symbol.
+        for(auto& gv : mod->global_values()) {
+            if(gv.isDeclaration() || gv.hasLocalLinkage()) continue;
+
+            llvm::ValueToValueMapTy vmap;
+            auto part = llvm::CloneModule(*mod, vmap, [&](const llvm::GlobalValue* v) {
+                return v == &gv || v->hasLocalLinkage();
+            });
+            for(auto& ifunc : llvm::make_early_inc_range(part->ifuncs())) {
+                if(ifunc.getName() == gv.getName()) continue;
+                auto* decl = llvm::Function::Create(llvm::cast<llvm::FunctionType>(ifunc.getValueType()),
+                                                    llvm::Function::ExternalLinkage, "", part.get());
+                decl->takeName(&ifunc);
+                ifunc.replaceAllUsesWith(decl);
+                ifunc.eraseFromParent();
+            }
+            addPart(std::move(part));
+        }
+    }
+    else {
+        llvm::SplitModule(*mod, jobs, addPart);
+    }
+
+    std::vector<std::string> keys(parts.size());
+    std::vector<llvm::SmallVector<char, 0>> objects(parts.size());
+    std::vector<std::string> errors(parts.size());
+    std::vector<size_t> misses;
+    for(size_t i = 0; i < parts.size(); i++) {
+        if(cache) {
+            keys[i] = ObjectCache::Key(llvm::StringRef(parts[i].data(), parts[i].size()), *tm, optLevel);
+            if(auto hit = cache->Get(keys[i])) {
+                objects[i].assign(hit->getBufferStart(), hit->getBufferEnd());
+                continue;
+            }
+        }
+        misses.push_back(i);
+    }
+
+    if(!misses.empty()) {
+        ThreadPool pool(jobs);
+        std::vector<std::future<void>> done;
+        for(size_t i : misses) {
+            done.push_back(pool.Submit([&, i] {
+                errors[i] = compilePart(llvm::StringRef(parts[i].data(), parts[i].size()), objects[i]);
+                if(cache && errors[i].empty()) cache->Put(keys[i], llvm::StringRef(objects[i].data(), objects[i].size()));
+            }));
+        }
+        for(auto& d : done) d.get();
+    }
+
+    for(const auto& err : errors) {
+        if(!err.empty()) {
+            error(err);
+            return;
+        }
+    }
+
+    if(auto err = writeObjectArchive("out.a", objects)) {
+        error("failed to write out.a: " + llvm::toString(std::move(err)));
+    }
+}
+
+void LLVMGen::WriteThinLTOBitcode(llvm::SmallVectorImpl<char>& bitcode) {
+    if(!targetMachine()) return;
+
+    optimizeModule(*mod, optLevel, tm.get(), true);
+
+    auto index = llvm::buildModuleSummaryIndex(*mod, nullptr, nullptr);
+    llvm::raw_svector_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(*mod, os, false, &index);
+}
+
+llvm::Error writeObjectArchive(llvm::StringRef path, const std::vector<llvm::SmallVector<char, 0>>& objects) {
+    // members in order with zeroed timestamps and ids, so the archive is the same bytes whichever
+    // thread finished its object first
+    std::vector<std::string> names(objects.size());
+    std::vector<llvm::NewArchiveMember> members;
+    for(size_t i = 0; i < objects.size(); i++) {
+        if(objects[i].empty()) continue;
+
+        names[i] = "out." + std::to_string(i) + ".o";
+        llvm::StringRef contents(objects[i].data(), objects[i].size());
+        members.emplace_back(llvm::MemoryBufferRef(contents, names[i]));
+    }
+
+    return llvm::writeArchive(path, members, llvm::SymtabWritingMode::NormalSymtab,
+                              llvm::object::Archive::getDefaultKind(), true, false);
 }
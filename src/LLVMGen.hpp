@@ -2,25 +2,144 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/STLFunctionalExtras.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/ValueHandle.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
-#include <map>
+#include <utility>
+#include <vector>
 
 #include "ASTNode.hpp"
+#include "FlatAST.hpp"
+#include "Symbol.hpp"
+#include "TypeInference.hpp"
+
+class ObjectCache;
+
+// The default new pass manager pipeline for level over a whole module, nothing at O0. tm gives the
+// vectorizer and unroller real costs and may be null. The ThinLTO pre-link pipeline leaves inlining
+// and the passes after it to the link step.
+void optimizeModule(llvm::Module& mod, llvm::OptimizationLevel level, llvm::TargetMachine* tm, bool thinLTOPreLink = false);
+
+llvm::CodeGenOptLevel codeGenOptLevel(llvm::OptimizationLevel level);
+
+// the CPU name and feature string to compile for, host ones for "native"
+void resolveCPU(const std::string& cpu, std::string& name, std::string& features);
+
+// deterministic archive of the non-empty objects, in order
+llvm::Error writeObjectArchive(llvm::StringRef path, const std::vector<llvm::SmallVector<char, 0>>& objects);
+
+class LLVMGen : public Visitor, public FlatVisitor {
+public:
+    using Slot = unsigned;  // a local variable of the function being generated
+
+    // what a loop's AST says about it, worked out before the loop is generated
+    struct LoopShape {
+        bool stepInvariant;  // the step has no side effects and reads nothing the body assigns
+        bool assignsVar;     // the body assigns the loop variable
+        bool straightLine;   // the body has no calls, ifs or inner loops
+    };
 
-class LLVMGen : public Visitor {
 private:
     llvm::Value* res;
-    llvm::AllocaInst* resAddr;
+    std::optional<Slot> resVar;  // the variable res was read from, if it is one
     bool fail;
+    llvm::OptimizationLevel optLevel;
+    std::string cpu;  // "native" for the host CPU and its features
+    std::unique_ptr<llvm::TargetMachine> tm;
+
+    // created on first use; also sets the module's triple and data layout
+    llvm::TargetMachine* targetMachine();
+
+    // a new target machine for the configured cpu and level, safe to call from any thread
+    std::unique_ptr<llvm::TargetMachine> createTargetMachine(std::string& err) const;
+
+    // optimize and compile one bitcode part of the module to an object, returns the error if any
+    std::string compilePart(llvm::StringRef bitcode, llvm::SmallVectorImpl<char>& object) const;
 
     void error(std::string message);
 
-    llvm::AllocaInst* allocLocalVarInFunc(llvm::Function* func, llvm::StringRef varName);
+    // Locals are built straight into SSA form, following Braun et al., "Simple and Efficient
+    // Construction of Static Single Assignment Form". Each block records the current value of every
+    // variable assigned in it. A read in a block without one looks through the predecessors and
+    // places a phi where different values meet. A block is sealed once all of its predecessors are
+    // known; until then (a loop header before its back-edge) reads get a placeholder phi that is
+    // filled in when the block is sealed. Phis that turn out to merge a single value are removed.
+    struct Variable {
+        Symbol name;
+        llvm::Type* type;
+    };
+    std::vector<Variable> vars;
+    std::vector<ValueType> varTypes;  // inferred for the function being generated, by Slot
+    llvm::DenseMap<std::pair<llvm::BasicBlock*, Slot>, llvm::WeakTrackingVH> currentDef;
+    llvm::DenseMap<llvm::BasicBlock*, std::vector<std::pair<llvm::PHINode*, Slot>>> incompletePhis;
+    llvm::DenseSet<llvm::BasicBlock*> sealed;
+
+    Slot newVariable(Symbol name);
+    void writeVariable(Slot var, llvm::BasicBlock* block, llvm::Value* val);
+    llvm::Value* readVariable(Slot var, llvm::BasicBlock* block);
+    llvm::Value* readVariableRecursive(Slot var, llvm::BasicBlock* block);
+    llvm::PHINode* newPhi(Slot var, llvm::BasicBlock* block);
+    llvm::Value* addPhiOperands(Slot var, llvm::PHINode* phi);
+    llvm::Value* tryRemoveTrivialPhi(llvm::PHINode* phi);
+    void sealBlock(llvm::BasicBlock* block);
+
+    // Integers are i64 and bools i1. Values are converted where types meet: in arithmetic, at the
+    // merge of an if, on assignment to a wider variable, and to double at calls and returns.
+    llvm::Type* llvmType(ValueType type);
+    llvm::Type* wider(llvm::Type* a, llvm::Type* b);
+    llvm::Value* convert(llvm::Value* v, llvm::Type* to);
+    llvm::Value* isTrue(llvm::Value* v);
+
+    // Codegen shared by the tree and flat visits. Children are generated through callbacks that
+    // leave their value in res (and resVar for variables), so each node is lowered in one place.
+    using Gen = llvm::function_ref<void()>;
+    using GenNth = llvm::function_ref<void(size_t)>;
+
+    llvm::Function* genPrototype(Symbol name, llvm::ArrayRef<Symbol> params);
+    void genFuncDef(Symbol name, llvm::ArrayRef<Symbol> params, std::vector<ValueType> types, Gen block);
+    void genBlock(size_t num_exprs, GenNth expr);
+    void genExtern(Symbol name, llvm::ArrayRef<Symbol> params);
+    void genVarExpr(Symbol name);
+    void genNumLiteral(int val, bool isDouble);
+    void genBinOp(char op, Gen left, Gen right);
+    void genIfExpr(Gen cond, Gen then, Gen elss);
+    void genCallExpr(Symbol name, size_t num_args, GenNth arg);
+    void genLoopExpr(Symbol name, const LoopShape& shape, Gen rangeStart, Gen rangeEnd, Gen step, Gen block);
+
+    // reads and assigns are the variables the body reads and assigns or declares, by name
+    void genParallelLoopExpr(Symbol name, const LoopShape& shape, llvm::ArrayRef<Reduction> reductions,
+                             llvm::ArrayRef<Symbol> reads, llvm::ArrayRef<Symbol> assigns,
+                             Gen rangeStart, Gen rangeEnd, Gen step, Gen block);
+
+    // v as an i64 if it is an integer or a double provably holding one exactly, else null
+    llvm::Value* exactInt(llvm::Value* v);
+    llvm::Value* genTripCount(llvm::Value* start, llvm::Value* end, llvm::Value* step);
+    llvm::Value* genTripCountFP(llvm::Value* start, llvm::Value* end, llvm::Value* step);
+    llvm::Value* reduce(ReductionOp op, llvm::Value* acc, llvm::Value* v);
+
+    // for(c = 0; c < chunks; c++) body(partials + c * stride), in blocks of its own; the body may
+    // read and write variables
+    void genChunkLoop(llvm::Value* partials, llvm::Value* stride, llvm::Value* chunks, llvm::function_ref<void(llvm::Value*)> body);
+    llvm::MDNode* loopMetadata(const LoopShape& shape, llvm::BasicBlock* header);
+    void genVarInitExpr(Symbol name, Gen val);
+    void genAssignExpr(Gen lhs, Gen val);
 
 public:
-    LLVMGen() : res(nullptr), resAddr(nullptr), fail(false) {
+    explicit LLVMGen(llvm::OptimizationLevel optLevel = llvm::OptimizationLevel::O0, std::string cpu = "generic")
+        : res(nullptr), fail(false), optLevel(optLevel), cpu(std::move(cpu)) {
         ctx = std::make_unique<llvm::LLVMContext>();
         mod = std::make_unique<llvm::Module>("kl", *ctx);
         builder = std::make_unique<llvm::IRBuilder<>>(*ctx);
@@ -29,7 +148,8 @@ public:
     std::unique_ptr<llvm::LLVMContext> ctx;
     std::unique_ptr<llvm::Module> mod;
     std::unique_ptr<llvm::IRBuilder<>> builder;
-    std::map<std::string, llvm::AllocaInst*> env;
+    llvm::DenseMap<std::uint32_t, Slot> env;  // variables in scope, keyed on Symbol::id
+    std::uint64_t parallelGrain = 0;           // iterations per chunk of a parallel loop, 0 for the runtime to choose
 
     void visit(Program& node) override;
     void visit(FuncDef& node) override;
@@ -44,6 +164,50 @@ public:
     void visit(VarInitExpr& node) override;
     void visit(AssignExpr& node) override;
 
+    void visit(const FlatAST& ast, const FlatFuncDef& node) override;
+    void visit(const FlatAST& ast, const FlatExtern& node) override;
+    void visit(const FlatAST& ast, const FlatBlock& node) override;
+    void visit(const FlatAST& ast, const FlatVarExpr& node) override;
+    void visit(const FlatAST& ast, const FlatNumLiteral& node) override;
+    void visit(const FlatAST& ast, const FlatBinOp& node) override;
+    void visit(const FlatAST& ast, const FlatIfExpr& node) override;
+    void visit(const FlatAST& ast, const FlatCallExpr& node) override;
+    void visit(const FlatAST& ast, const FlatLoopExpr& node) override;
+    void visit(const FlatAST& ast, const FlatVarInitExpr& node) override;
+    void visit(const FlatAST& ast, const FlatAssignExpr& node) override;
+
+    // generate every top level definition of a flat program, stopping at the first failure
+    void Generate(const FlatAST& ast);
+
+    bool Failed() const { return fail; }
+
+    // Run the optimization pipeline for the level given at construction over the whole module:
+    // SROA/mem2reg, instcombine, GVN, inlining, loop opts and vectorization. Nothing at O0.
+    void Optimize();
+
+    // The per-function part of the pipeline for code generated one function at a time (the REPL),
+    // where the module isn't complete until the session ends.
+    void OptimizeFunction(llvm::Function& f);
+
+    // Put a memo table of entries (rounded up to a power of two) in front of every pure recursive
+    // function of up to four parameters, keyed on the bits of its arguments. Tables are shared by
+    // all threads and lookups never block. Call after generation and before Multiversion/Optimize.
+    void Memoize(unsigned entries);
+
+    // Replace every defined function with an ifunc that picks, when the object is loaded, a clone
+    // compiled for the best of levels (x86-64-v2..v4) the CPU supports, or the original otherwise.
+    // Clones call each other directly. Call after generation and before Optimize.
+    void Multiversion(const std::vector<std::string>& levels);
+
     void PrintRes();
     void EmitObject();
+
+    // Split the module into up to jobs parts, optimize and compile them on as many threads and
+    // write the objects to the archive out.a. Replaces both Optimize and EmitObject. With a cache
+    // there is one part per definition and only the ones not in the cache are compiled.
+    void EmitObjectParallel(unsigned jobs, ObjectCache* cache = nullptr);
+
+    // Run the ThinLTO pre-link pipeline and write the module as bitcode with its summary, for
+    // linking with the other files of a program in emitThinLTO.
+    void WriteThinLTOBitcode(llvm::SmallVectorImpl<char>& bitcode);
 };
@@ -0,0 +1,155 @@
+#pragma once
+
+// Lexer tables generated at compile time from the TOKEN_TYPES X-macro:
+// - a perfect hash from keyword spelling to TokenType, so recognizing a keyword costs one
+//   hash and one compare no matter how many keywords there are
+// - a DFA over the operator spellings, one table lookup per byte with longest-match semantics
+// - a per-byte character class table for the lexer's dispatch
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "Token.hpp"
+
+namespace lex {
+
+struct Spelling {
+    TokenType type;
+    std::string_view text;
+};
+
+#define X(name, spelling) Spelling{TokenType::name, spelling},
+constexpr Spelling kSpellings[] = { TOKEN_TYPES };
+#undef X
+
+constexpr bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+constexpr bool isKeyword(const Spelling& s) {
+    return !s.text.empty() && isAlpha(s.text[0]);
+}
+
+constexpr bool isOperator(const Spelling& s) {
+    return !s.text.empty() && !isAlpha(s.text[0]);
+}
+
+// ---- keywords ----
+
+constexpr int kKeywordBits = 6;
+constexpr std::size_t kKeywordSlots = std::size_t(1) << kKeywordBits;
+
+// only looks at the length, first, middle and last character so the cost doesn't grow with the identifier
+constexpr std::uint32_t keywordHash(std::string_view s, std::uint32_t mul) {
+    std::uint32_t key = std::uint32_t(static_cast<unsigned char>(s[0]))
+                      | std::uint32_t(static_cast<unsigned char>(s[s.size() / 2])) << 8
+                      | std::uint32_t(static_cast<unsigned char>(s[s.size() - 1])) << 16
+                      | std::uint32_t(s.size()) << 24;
+    return (key * mul) >> (32 - kKeywordBits);
+}
+
+struct KeywordTable {
+    std::uint32_t mul = 0;
+    std::array<TokenType, kKeywordSlots> type{};
+    std::array<std::string_view, kKeywordSlots> text{};
+};
+
+// search for a multiplier that puts every keyword in its own slot
+constexpr KeywordTable buildKeywordTable() {
+    for(std::uint32_t mul = 0x9E3779B1u; mul != 0x9E3779B1u + 2 * 100000; mul += 2) {
+        KeywordTable t;
+        t.mul = mul;
+        bool collision = false;
+
+        for(const auto& s : kSpellings) {
+            if(!isKeyword(s)) continue;
+            auto h = keywordHash(s.text, mul);
+            if(!t.text[h].empty()) {
+                collision = true;
+                break;
+            }
+            t.type[h] = s.type;
+            t.text[h] = s.text;
+        }
+
+        if(!collision) return t;
+    }
+    return KeywordTable{};
+}
+
+constexpr KeywordTable kKeywords = buildKeywordTable();
+static_assert(kKeywords.mul != 0, "no perfect hash found for the keyword set, widen kKeywordBits");
+
+// returns IDENTIFIER for anything that isn't a keyword
+inline TokenType lookupKeyword(std::string_view s) {
+    auto h = keywordHash(s, kKeywords.mul);
+    return kKeywords.text[h] == s ? kKeywords.type[h] : TokenType::IDENTIFIER;
+}
+
+// ---- operators ----
+
+constexpr std::size_t countOperatorStates() {
+    std::size_t n = 1;
+    for(const auto& s : kSpellings)
+        if(isOperator(s)) n += s.text.size();
+    return n;
+}
+
+// upper bound (a trie over the spellings shares prefixes), state 0 is the start state
+constexpr std::size_t kMaxOperatorStates = countOperatorStates();
+static_assert(kMaxOperatorStates < 256, "operator DFA states must fit in a byte");
+
+struct OperatorDFA {
+    std::array<std::array<std::uint8_t, 256>, kMaxOperatorStates> next{};  // 0 = no transition
+    std::array<TokenType, kMaxOperatorStates> type{};
+    std::array<bool, kMaxOperatorStates> accepting{};
+};
+
+constexpr OperatorDFA buildOperatorDFA() {
+    OperatorDFA d;
+    std::size_t states = 1;
+
+    for(const auto& s : kSpellings) {
+        if(!isOperator(s)) continue;
+
+        std::size_t state = 0;
+        for(char c : s.text) {
+            auto& slot = d.next[state][static_cast<unsigned char>(c)];
+            if(!slot) slot = static_cast<std::uint8_t>(states++);
+            state = slot;
+        }
+        d.type[state] = s.type;
+        d.accepting[state] = true;
+    }
+
+    return d;
+}
+
+constexpr OperatorDFA kOperators = buildOperatorDFA();
+
+// ---- character classes ----
+
+enum CharClass : std::uint8_t {
+    OTHER,
+    IDENT_START,
+    DIGIT,
+    OPERATOR_START,
+    WHITESPACE,
+};
+
+constexpr std::array<CharClass, 256> buildCharClasses() {
+    std::array<CharClass, 256> t{};
+    for(int c = 0; c < 256; c++) {
+        if(isAlpha(static_cast<char>(c))) t[c] = IDENT_START;
+        else if(c >= '0' && c <= '9') t[c] = DIGIT;
+        else if(kOperators.next[0][c]) t[c] = OPERATOR_START;
+        else if(c == ' ' || (c >= '\t' && c <= '\r')) t[c] = WHITESPACE;
+    }
+    return t;
+}
+
+constexpr std::array<CharClass, 256> kCharClasses = buildCharClasses();
+
+}  // namespace lex
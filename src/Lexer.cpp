@@ -1,103 +1,102 @@
 #include "Lexer.hpp"
 #include "Token.hpp"
-#include <cctype>
+#include "LexTables.hpp"
+#include "Scan.hpp"
+#include <cstdint>
+#include <iterator>
 #include <string>
 
-Lexer::Lexer(std::istream& f) : f(f), line(1), col(0), first(true) {
-    c = f.get();
+Lexer::Lexer(std::istream& f)
+    : owned(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()), line(1) {
+    begin = owned.data();
+    cur = begin;
+    end = begin + owned.size();
+    line_start = begin;
 }
 
-void Lexer::NextChar() {
-    if(c == EOF) return;
+Lexer::Lexer(std::string_view src)
+    : begin(src.data()), cur(src.data()), end(src.data() + src.size()), line_start(src.data()), line(1) {}
 
-    c = f.get();
-    col++;
-
-    if(c == '\n') {
-        line++;
-        col = 0;
+Lexer::Lexer(std::string_view src, std::size_t start, unsigned int line)
+    : begin(src.data()), cur(src.data() + start), end(src.data() + src.size()), line_start(src.data()), line(line) {
+    for(const char* p = cur; p != begin; p--) {
+        if(p[-1] == '\n') {
+            line_start = p - 1;
+            break;
+        }
     }
 }
 
+// columns on the first line start at 0, later lines count from the newline so they start at 1
+unsigned int Lexer::col(const char* p) const {
+    return p - line_start;
+}
+
+Token Lexer::make(TokenType type, const char* start, std::string_view data, Symbol sym) const {
+    return Token(type, data, line, col(start), start - begin, sym);
+}
+
 Token Lexer::TokenizeIdentifier() {
-    std::string data;
-    unsigned int curr_line = line;
-    unsigned int curr_col = col;
+    const char* start = cur;
+    cur = scanIdentifier(cur, end);
 
-    while(std::isalnum(c)) {
-        data += c;
-        NextChar();
-    }
+    std::string_view data(start, cur - start);
+    TokenType type = lex::lookupKeyword(data);
+    if(type != TokenType::IDENTIFIER) return make(type, start);
 
-    first = true;  // c has the first character of what should be part of the next token
-
-    if(data == "def") return Token(TokenType::DEF, "", curr_line, curr_col);
-    else if(data == "if") return Token(TokenType::IF, "", curr_line, curr_col);
-    else if(data == "then") return Token(TokenType::THEN, "", curr_line, curr_col);
-    else if(data == "else") return Token(TokenType::ELSE, "", curr_line, curr_col);
-    else if(data == "loop") return Token(TokenType::LOOP, "", curr_line, curr_col);
-    else if(data == "range") return Token(TokenType::RANGE, "", curr_line, curr_col);
-    else if(data == "extern") return Token(TokenType::EXTERN, "", curr_line, curr_col);
-    else if(data == "var") return Token(TokenType::VAR, "", curr_line, curr_col);
-    else if(data == "end") return Token(TokenType::END, "", curr_line, curr_col);
-    else return Token(TokenType::IDENTIFIER, data, curr_line, curr_col);
+    return make(type, start, data, Symbol::intern(data));
 }
 
 Token Lexer::TokenizeNumber() {
-    std::string data;
-    unsigned int curr_line = line;
-    unsigned int curr_col = col;
+    const char* start = cur;
+    cur = scanNumber(cur, end);
+
+    return make(TokenType::NUMBER, start, std::string_view(start, cur - start));
+}
 
-    while(std::isdigit(c) || c == '.') {
-        data += c;
-        NextChar();
+// longest match through the operator DFA
+Token Lexer::TokenizeOperator() {
+    const char* start = cur;
+    const char* matched = nullptr;
+    TokenType type = TokenType::END_PROG;
+
+    std::uint8_t state = 0;
+    for(const char* p = cur; p != end; p++) {
+        state = lex::kOperators.next[state][static_cast<unsigned char>(*p)];
+        if(!state) break;
+        if(lex::kOperators.accepting[state]) {
+            matched = p + 1;
+            type = lex::kOperators.type[state];
+        }
     }
 
-    first = true;
+    if(!matched) {
+        // a prefix of some operator that isn't an operator itself, skip it like any stray character
+        cur++;
+        return NextToken();
+    }
 
-    return Token(TokenType::NUMBER, data, curr_line, curr_col);
+    cur = matched;
+    return make(type, start);
 }
 
 Token Lexer::NextToken() {
-    if(c == EOF) return Token(TokenType::END_PROG, "", line, col);
-
-    if(!first) NextChar();
-    else first = false;
-
-    if(std::isalpha(c)) return TokenizeIdentifier();
-    else if(std::isdigit(c)) return TokenizeNumber();
-
-    else if(c == '+') return Token(TokenType::PLUS, "", line, col);
-
-    else if(c == '(') return Token(TokenType::LPAR, "", line, col);
-    else if(c == ')') return Token(TokenType::RPAR, "", line, col);
-    else if(c == ';') return Token(TokenType::SEMICOLON, "", line, col);
-    else if(c == ',') return Token(TokenType::COMMA, "", line, col);
-    else if(c == '=') return Token(TokenType::ASSIGN, "", line, col);
-
-    else if(c == '<') {
-        if(f.peek() == '=') {
-            NextChar();
-            return Token(TokenType::LE, "", line, col);
-        }
-        else return Token(TokenType::LT, "", line, col);
+    // skip whitespace and any characters that don't start a token
+    while(cur != end) {
+        unsigned int newlines = 0;
+        cur = scanWhitespace(cur, end, newlines, line_start);  // the newline itself is column 0 of the new line
+        line += newlines;
+        if(cur == end) break;
+
+        if(lex::kCharClasses[static_cast<unsigned char>(*cur)] != lex::OTHER) break;
+        cur++;
     }
 
-    else if(c == '>') {
-        if(f.peek() == '=') {
-            NextChar();
-            return Token(TokenType::GE, "", line, col);
-        }
-        else return Token(TokenType::GT, "", line, col);
-    }
+    if(cur == end) return make(TokenType::END_PROG, cur);
 
-    else if(c == '-') {
-        if(f.peek() == '>') {
-            NextChar();
-            return Token(TokenType::ARROW, "", line, col);
-        }
-        else return Token(TokenType::MINUS, "", line, col);
+    switch(lex::kCharClasses[static_cast<unsigned char>(*cur)]) {
+        case lex::IDENT_START: return TokenizeIdentifier();
+        case lex::DIGIT: return TokenizeNumber();
+        default: return TokenizeOperator();
     }
-
-    else return NextToken();
 }
@@ -1,21 +1,38 @@
 #pragma once
 
 #include "Token.hpp"
+#include <cstddef>
 #include <istream>
+#include <string>
+#include <string_view>
 
+// Tokens hold string_views into the source buffer, so the buffer has to outlive them.
+// Constructing from a stream reads it into a buffer owned by the Lexer; constructing
+// from a string_view (e.g. a MappedFile) lexes it in place without copying.
 class Lexer {
 private:
-    char c;
-    std::istream& f;
+    std::string owned;
+    const char* begin;       // token offsets are measured from here
+    const char* cur;
+    const char* end;
+    const char* line_start;  // position col is measured from
     unsigned int line;
-    unsigned int col;
-    bool first;
 
-    void NextChar();
+    unsigned int col(const char* p) const;
+    Token make(TokenType type, const char* start, std::string_view data = "", Symbol sym = Symbol()) const;
     Token TokenizeIdentifier();
     Token TokenizeNumber();
+    Token TokenizeOperator();
 
 public:
     explicit Lexer(std::istream& f);
+    explicit Lexer(std::string_view src);
+
+    // resume lexing src at offset start, which is on the given line
+    Lexer(std::string_view src, std::size_t start, unsigned int line);
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
     Token NextToken();
 };
@@ -0,0 +1,479 @@
+#include "MLIRGen.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <utility>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mlir/Conversion/AffineToStandard/AffineToStandard.h>
+#include <mlir/Conversion/ArithToLLVM/ArithToLLVM.h>
+#include <mlir/Conversion/ControlFlowToLLVM/ControlFlowToLLVM.h>
+#include <mlir/Conversion/FuncToLLVM/ConvertFuncToLLVMPass.h>
+#include <mlir/Conversion/ReconcileUnrealizedCasts/ReconcileUnrealizedCasts.h>
+#include <mlir/Conversion/SCFToControlFlow/SCFToControlFlow.h>
+#include <mlir/Dialect/Affine/IR/AffineOps.h>
+#include <mlir/Dialect/Affine/Passes.h>
+#include <mlir/Dialect/Arith/IR/Arith.h>
+#include <mlir/Dialect/ControlFlow/IR/ControlFlow.h>
+#include <mlir/Dialect/Func/IR/FuncOps.h>
+#include <mlir/Dialect/LLVMIR/LLVMDialect.h>
+#include <mlir/Dialect/SCF/IR/SCF.h>
+#include <mlir/IR/Verifier.h>
+#include <mlir/Pass/PassManager.h>
+#include <mlir/Target/LLVMIR/Dialect/Builtin/BuiltinToLLVMIRTranslation.h>
+#include <mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h>
+#include <mlir/Target/LLVMIR/Export.h>
+#include <mlir/Transforms/Passes.h>
+
+#include "KLDialect.hpp"
+
+namespace {
+
+// What a region can change: the variables it declares and the names it assigns to
+class RegionScan : public Visitor {
+public:
+    std::vector<const VarInitExpr*> declared;
+    std::vector<Symbol> names;
+
+    void visit(Program&) override {}
+    void visit(FuncDef&) override {}
+    void visit(Extern&) override {}
+    void visit(VarExpr&) override {}
+    void visit(NumLiteral&) override {}
+
+    void visit(Block& node) override {
+        for(auto& e : node.exprs) e->accept(*this);
+    }
+
+    void visit(BinOp& node) override {
+        node.left->accept(*this);
+        node.right->accept(*this);
+    }
+
+    void visit(IfExpr& node) override {
+        node.cond->accept(*this);
+        node.then->accept(*this);
+        node.elss->accept(*this);
+    }
+
+    void visit(CallExpr& node) override {
+        for(auto& a : node.args) a->accept(*this);
+    }
+
+    // the loop's own variable is out of scope once it ends
+    void visit(LoopExpr& node) override {
+        node.rangeStart->accept(*this);
+        node.rangeEnd->accept(*this);
+        node.block->accept(*this);
+        node.step->accept(*this);
+    }
+
+    void visit(VarInitExpr& node) override {
+        declared.push_back(&node);
+        node.val->accept(*this);
+    }
+
+    void visit(AssignExpr& node) override {
+        if(auto* var = dynamic_cast<VarExpr*>(node.lhs.get())) names.push_back(var->name);
+        node.val->accept(*this);
+    }
+};
+
+ValueType valueType(mlir::Value v) {
+    mlir::Type type = v.getType();
+    if(type.isF64()) return ValueType::Double;
+    if(type.isInteger(1)) return ValueType::Bool;
+    return ValueType::Int;
+}
+
+}  // namespace
+
+MLIRGen::MLIRGen() : builder(&context), fail(false) {
+    context.loadDialect<KLDialect,
+                        mlir::affine::AffineDialect,
+                        mlir::arith::ArithDialect,
+                        mlir::cf::ControlFlowDialect,
+                        mlir::func::FuncDialect,
+                        mlir::LLVM::LLVMDialect,
+                        mlir::scf::SCFDialect>();
+    module = mlir::ModuleOp::create(builder.getUnknownLoc());
+}
+
+void MLIRGen::error(std::string message) {
+    fail = true;
+    std::cerr << "MLIRGen: " << message << std::endl;
+}
+
+mlir::Location MLIRGen::loc() {
+    return builder.getUnknownLoc();
+}
+
+mlir::Type MLIRGen::mlirType(ValueType type) {
+    switch(type) {
+        case ValueType::Bool:
+            return builder.getI1Type();
+        case ValueType::Int:
+            return builder.getI64Type();
+        default:
+            return builder.getF64Type();
+    }
+}
+
+mlir::Value MLIRGen::zero(ValueType type) {
+    switch(type) {
+        case ValueType::Double:
+            return builder.create<mlir::arith::ConstantOp>(loc(), builder.getF64FloatAttr(0));
+        case ValueType::Bool:
+            return builder.create<mlir::arith::ConstantOp>(loc(), builder.getIntegerAttr(builder.getI1Type(), 0));
+        default:
+            return builder.create<mlir::arith::ConstantOp>(loc(), builder.getI64IntegerAttr(0));
+    }
+}
+
+// LLVMGen::convert; nothing is ever narrowed, since a variable has the join of the types assigned to it
+mlir::Value MLIRGen::convert(mlir::Value v, ValueType to) {
+    ValueType from = valueType(v);
+    if(from == to || to < from) return v;
+    if(to == ValueType::Double) {
+        if(from == ValueType::Bool) return builder.create<mlir::arith::UIToFPOp>(loc(), builder.getF64Type(), v);
+        return builder.create<mlir::arith::SIToFPOp>(loc(), builder.getF64Type(), v);
+    }
+    return builder.create<mlir::arith::ExtUIOp>(loc(), builder.getI64Type(), v);
+}
+
+// LLVMGen::isTrue; a NaN double is false
+mlir::Value MLIRGen::isTrue(mlir::Value v) {
+    switch(valueType(v)) {
+        case ValueType::Bool:
+            return v;
+        case ValueType::Int:
+            return builder.create<mlir::arith::CmpIOp>(loc(), mlir::arith::CmpIPredicate::ne, v, zero(ValueType::Int));
+        default:
+            return builder.create<mlir::arith::CmpFOp>(loc(), mlir::arith::CmpFPredicate::ONE, v, zero(ValueType::Double));
+    }
+}
+
+ValueType MLIRGen::typeOf(const Expr& node) const {
+    auto it = notes.types.find(&node);
+    if(it == notes.types.end() || it->second == ValueType::None) return ValueType::Int;
+    return it->second;
+}
+
+mlir::Value MLIRGen::current(std::size_t slot) {
+    return values[slot] ? values[slot] : zero(types[slot]);
+}
+
+std::vector<std::size_t> MLIRGen::carried(const std::vector<const VarInitExpr*>& declared, const std::vector<Symbol>& names) {
+    std::vector<std::size_t> slots;
+    for(const auto* d : declared) {
+        auto it = notes.vars.find(d);
+        if(it != notes.vars.end()) slots.push_back(it->second);
+    }
+    for(Symbol name : names) {
+        auto it = env.find(name.id);
+        if(it != env.end()) slots.push_back(it->second);
+    }
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+    return slots;
+}
+
+void MLIRGen::Print(llvm::raw_ostream& os) {
+    module->print(os);
+}
+
+std::unique_ptr<llvm::Module> MLIRGen::Lower(llvm::LLVMContext& ctx) {
+    if(mlir::failed(mlir::verify(*module))) {
+        error("invalid module");
+        return nullptr;
+    }
+
+    // the kl ops become affine and scf, which are cleaned up and then lowered with everything else
+    // to the LLVM dialect
+    mlir::PassManager pm(&context);
+    pm.addPass(createLowerKLPass());
+    pm.addPass(mlir::createCanonicalizerPass());
+    pm.addPass(mlir::createCSEPass());
+    pm.addNestedPass<mlir::func::FuncOp>(mlir::affine::createAffineLoopInvariantCodeMotionPass());
+    pm.addPass(mlir::createLowerAffinePass());
+    pm.addPass(mlir::createSCFToControlFlowPass());
+    pm.addPass(mlir::createArithToLLVMConversionPass());
+    pm.addPass(mlir::createConvertControlFlowToLLVMPass());
+    pm.addPass(mlir::createConvertFuncToLLVMPass());
+    pm.addPass(mlir::createReconcileUnrealizedCastsPass());
+    if(mlir::failed(pm.run(*module))) {
+        error("lowering to the LLVM dialect failed");
+        return nullptr;
+    }
+
+    mlir::registerBuiltinDialectTranslation(context);
+    mlir::registerLLVMDialectTranslation(context);
+    auto mod = mlir::translateModuleToLLVMIR(*module, ctx, "kl");
+    if(!mod) error("translation to LLVM IR failed");
+    return mod;
+}
+
+void MLIRGen::visit(Program& node) {
+    for(const auto& e : node.externs) e->accept(*this);
+
+    // every function can be called before its definition
+    for(const auto& fd : node.func_defs) arity[fd->name.id] = fd->params.size();
+    for(const auto& fd : node.func_defs) fd->accept(*this);
+}
+
+void MLIRGen::visit(Extern& node) {
+    arity[node.name.id] = node.params.size();
+    if(module->lookupSymbol(node.name.str())) return;
+
+    builder.setInsertionPointToEnd(module->getBody());
+    llvm::SmallVector<mlir::Type> params(node.params.size(), builder.getF64Type());
+    auto f = builder.create<mlir::func::FuncOp>(loc(), node.name.str(), builder.getFunctionType(params, {builder.getF64Type()}));
+    f.setPrivate();
+}
+
+void MLIRGen::visit(FuncDef& node) {
+    // a definition replaces an extern of the same name
+    if(auto existing = module->lookupSymbol<mlir::func::FuncOp>(node.name.str())) {
+        if(!existing.isDeclaration()) {
+            error("redefined function: " + node.name.str());
+            return;
+        }
+        existing.erase();
+    }
+    arity[node.name.id] = node.params.size();
+
+    builder.setInsertionPointToEnd(module->getBody());
+    llvm::SmallVector<mlir::Type> params(node.params.size(), builder.getF64Type());
+    auto f = builder.create<mlir::func::FuncOp>(loc(), node.name.str(), builder.getFunctionType(params, {builder.getF64Type()}));
+    mlir::Block* entry = f.addEntryBlock();
+    builder.setInsertionPointToStart(entry);
+
+    notes = {};
+    types = TypeInference().Function(node, &notes);
+    env.clear();
+    values.assign(types.size(), mlir::Value());
+    for(std::size_t i = 0; i < node.params.size(); i++) {
+        env[node.params[i].id] = i;
+        values[i] = entry->getArgument(unsigned(i));
+    }
+
+    genBlock(*node.block);
+    if(!res) {
+        error("failed to emit function: " + node.name.str());
+        f.erase();
+        return;
+    }
+
+    // functions return doubles
+    builder.create<mlir::func::ReturnOp>(loc(), convert(res, ValueType::Double));
+}
+
+void MLIRGen::genBlock(Block& node) {
+    res = zero(ValueType::Int);
+    for(auto& e : node.exprs) {
+        e->accept(*this);
+        if(!res) return;
+    }
+}
+
+void MLIRGen::visit(Block& node) {
+    genBlock(node);
+}
+
+void MLIRGen::visit(VarExpr& node) {
+    auto it = env.find(node.name.id);
+    if(it == env.end()) {
+        error("unknown variable: " + node.name.str());
+        res = nullptr;
+        return;
+    }
+    res = current(it->second);
+}
+
+void MLIRGen::visit(NumLiteral& node) {
+    if(node.isDouble) res = builder.create<mlir::arith::ConstantOp>(loc(), builder.getF64FloatAttr(node.val));
+    else res = builder.create<mlir::arith::ConstantOp>(loc(), builder.getI64IntegerAttr(node.val));
+}
+
+void MLIRGen::visit(BinOp& node) {
+    node.left->accept(*this);
+    if(!res) return;
+    mlir::Value left = res;
+    node.right->accept(*this);
+    if(!res) return;
+    mlir::Value right = res;
+
+    ValueType type = join(ValueType::Int, join(valueType(left), valueType(right)));
+    left = convert(left, type);
+    right = convert(right, type);
+    bool fp = type == ValueType::Double;
+
+    switch(node.op) {
+        case '+':
+            if(fp) res = builder.create<mlir::arith::AddFOp>(loc(), left, right);
+            else res = builder.create<mlir::arith::AddIOp>(loc(), left, right);
+            return;
+        case '-':
+            if(fp) res = builder.create<mlir::arith::SubFOp>(loc(), left, right);
+            else res = builder.create<mlir::arith::SubIOp>(loc(), left, right);
+            return;
+        case '<':
+            // unordered or less than, as in LLVMGen
+            if(fp) res = builder.create<mlir::arith::CmpFOp>(loc(), mlir::arith::CmpFPredicate::ULT, left, right);
+            else res = builder.create<mlir::arith::CmpIOp>(loc(), mlir::arith::CmpIPredicate::slt, left, right);
+            return;
+        default:
+            error(std::string("invalid binary operator: ") + node.op);
+            res = nullptr;
+    }
+}
+
+void MLIRGen::visit(IfExpr& node) {
+    node.cond->accept(*this);
+    if(!res) return;
+    mlir::Value cond = isTrue(res);
+
+    RegionScan scan;
+    node.then->accept(scan);
+    node.elss->accept(scan);
+    std::vector<std::size_t> slots = carried(scan.declared, scan.names);
+
+    // the value of the if in the wider type of the branches, then the variables
+    ValueType type = typeOf(node);
+    llvm::SmallVector<mlir::Type> results{mlirType(type)};
+    for(std::size_t s : slots) results.push_back(mlirType(types[s]));
+    auto op = builder.create<KLIfOp>(loc(), results, cond);
+
+    // each branch starts from the values before the if
+    std::vector<mlir::Value> before = values;
+    for(auto [block, branch] : {std::make_pair(op.getThen(), node.then.get()), std::make_pair(op.getElse(), node.elss.get())}) {
+        values = before;
+        builder.setInsertionPointToStart(block);
+        genBlock(*branch);
+        if(!res) return;
+
+        llvm::SmallVector<mlir::Value> yields{convert(res, type)};
+        for(std::size_t s : slots) yields.push_back(current(s));
+        builder.create<KLYieldOp>(loc(), yields);
+    }
+
+    builder.setInsertionPointAfter(op);
+    values = std::move(before);
+    for(std::size_t i = 0; i < slots.size(); i++) values[slots[i]] = op->getResult(unsigned(i + 1));
+    res = op->getResult(0);
+}
+
+void MLIRGen::visit(CallExpr& node) {
+    auto it = arity.find(node.name.id);
+    if(it == arity.end()) {
+        error("unknown function: " + node.name.str());
+        res = nullptr;
+        return;
+    }
+    if(node.args.size() != it->second) {
+        error("wrong number of arguments to " + node.name.str());
+        res = nullptr;
+        return;
+    }
+
+    // arguments are passed as doubles
+    llvm::SmallVector<mlir::Value> args;
+    for(auto& a : node.args) {
+        a->accept(*this);
+        if(!res) return;
+        args.push_back(convert(res, ValueType::Double));
+    }
+
+    auto call = builder.create<mlir::func::CallOp>(loc(), node.name.str(), mlir::TypeRange{builder.getF64Type()}, args);
+    res = call->getResult(0);
+}
+
+void MLIRGen::visit(LoopExpr& node) {
+    auto slot = notes.vars.find(&node);
+    if(slot == notes.vars.end()) {
+        error("untyped loop variable: " + node.name.str());
+        res = nullptr;
+        return;
+    }
+    std::size_t var = slot->second;
+    ValueType type = types[var];
+
+    node.rangeStart->accept(*this);
+    if(!res) return;
+    mlir::Value start = convert(res, type);
+    node.rangeEnd->accept(*this);
+    if(!res) return;
+    mlir::Value end = convert(res, join(type, valueType(res)));
+
+    RegionScan scan;
+    node.block->accept(scan);
+    node.step->accept(scan);
+    std::vector<std::size_t> slots = carried(scan.declared, scan.names);
+    slots.erase(std::remove(slots.begin(), slots.end(), var), slots.end());
+
+    llvm::SmallVector<mlir::Value> inits;
+    for(std::size_t s : slots) inits.push_back(current(s));
+    auto op = builder.create<KLLoopOp>(loc(), start, end, inits);
+    mlir::Block* body = op.getBody();
+
+    std::vector<mlir::Value> before = values;
+    std::optional<std::size_t> old;
+    if(auto it = env.find(node.name.id); it != env.end()) old = it->second;
+    env[node.name.id] = var;
+    values[var] = body->getArgument(0);
+    for(std::size_t i = 0; i < slots.size(); i++) values[slots[i]] = body->getArgument(unsigned(i + 1));
+
+    builder.setInsertionPointToStart(body);
+    genBlock(*node.block);
+    if(!res) return;
+    node.step->accept(*this);
+    if(!res) return;
+
+    llvm::SmallVector<mlir::Value> yields{current(var), convert(res, type)};
+    for(std::size_t s : slots) yields.push_back(current(s));
+    builder.create<KLYieldOp>(loc(), yields);
+
+    builder.setInsertionPointAfter(op);
+    values = std::move(before);
+    for(std::size_t i = 0; i < slots.size(); i++) values[slots[i]] = op->getResult(unsigned(i));
+    if(old) env[node.name.id] = *old;
+    else env.erase(node.name.id);
+
+    res = builder.create<mlir::arith::ConstantOp>(loc(), builder.getI64IntegerAttr(0));
+}
+
+void MLIRGen::visit(VarInitExpr& node) {
+    if(env.count(node.name.id)) {
+        error("redefined variable: " + node.name.str());
+        res = nullptr;
+        return;
+    }
+
+    node.val->accept(*this);
+    if(!res) return;
+
+    auto slot = notes.vars.find(&node);
+    if(slot == notes.vars.end()) {
+        error("untyped variable: " + node.name.str());
+        res = nullptr;
+        return;
+    }
+    values[slot->second] = convert(res, types[slot->second]);
+    env[node.name.id] = slot->second;
+}
+
+void MLIRGen::visit(AssignExpr& node) {
+    node.val->accept(*this);
+    if(!res) return;
+
+    auto* lhs = dynamic_cast<VarExpr*>(node.lhs.get());
+    auto it = lhs ? env.find(lhs->name.id) : env.end();
+    if(it == env.end()) {
+        error("lhs of assign is not a variable");
+        res = nullptr;
+        return;
+    }
+    values[it->second] = convert(res, types[it->second]);
+}
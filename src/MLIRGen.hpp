@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <mlir/IR/Builders.h>
+#include <mlir/IR/BuiltinOps.h>
+#include <mlir/IR/MLIRContext.h>
+#include <mlir/IR/OwningOpRef.h>
+#include <mlir/IR/Value.h>
+
+#include "ASTNode.hpp"
+#include "Symbol.hpp"
+#include "TypeInference.hpp"
+
+// Emits a whole program as MLIR, an alternative to LLVMGen: functions and calls in the func
+// dialect, values in arith with the types TypeInference gives them (i1, i64, f64, converted where
+// LLVMGen converts them), and ifs and loops as the structured ops of the kl dialect. Variables are
+// SSA values from the start: each one's current value is tracked while its function is emitted, and
+// an if or loop returns the variables its regions assign as extra results. Lower() then runs the
+// program down through affine, scf and arith to the LLVM dialect and translates it to LLVM IR.
+class MLIRGen : public Visitor {
+private:
+    mlir::MLIRContext context;
+    mlir::OpBuilder builder;
+    mlir::OwningOpRef<mlir::ModuleOp> module;
+
+    std::unordered_map<std::uint32_t, std::size_t> arity;  // of every function and extern, by name
+    std::vector<ValueType> types;                           // of the function being emitted, by slot
+    TypeInference::Annotations notes;
+    std::unordered_map<std::uint32_t, std::size_t> env;     // slot of each variable in scope
+    std::vector<mlir::Value> values;                        // current value of each slot, null before it is set
+    mlir::Value res;
+    bool fail;
+
+    void error(std::string message);
+
+    mlir::Location loc();
+    mlir::Type mlirType(ValueType type);
+    mlir::Value zero(ValueType type);
+    mlir::Value convert(mlir::Value v, ValueType to);
+    mlir::Value isTrue(mlir::Value v);
+    ValueType typeOf(const Expr& node) const;
+
+    // the current value of a slot, zero of its type where no path has set it
+    mlir::Value current(std::size_t slot);
+
+    // the slots of the variables a region declares and of those in scope it assigns by name, which
+    // an if or loop carries out as results; a name a region rebinds may add a slot needlessly
+    std::vector<std::size_t> carried(const std::vector<const VarInitExpr*>& declared, const std::vector<Symbol>& names);
+
+    void genBlock(Block& node);
+
+public:
+    MLIRGen();
+
+    bool Failed() const { return fail; }
+
+    // the module in the kl dialect, before lowering
+    void Print(llvm::raw_ostream& os);
+
+    // lower and translate the module into ctx, null if a pass fails
+    std::unique_ptr<llvm::Module> Lower(llvm::LLVMContext& ctx);
+
+    void visit(Program& node) override;
+    void visit(FuncDef& node) override;
+    void visit(Block& node) override;
+    void visit(Extern& node) override;
+    void visit(VarExpr& node) override;
+    void visit(NumLiteral& node) override;
+    void visit(BinOp& node) override;
+    void visit(IfExpr& node) override;
+    void visit(CallExpr& node) override;
+    void visit(LoopExpr& node) override;
+    void visit(VarInitExpr& node) override;
+    void visit(AssignExpr& node) override;
+};
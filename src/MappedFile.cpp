@@ -0,0 +1,39 @@
+#include "MappedFile.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) : data(nullptr), size(0), ok(false) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return;
+    }
+
+    size = st.st_size;
+    ok = true;
+
+    // mmap can't map an empty file, an empty view is fine for the lexer
+    if(size > 0) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            size = 0;
+            ok = false;
+        } else {
+            data = static_cast<const char*>(p);
+            madvise(p, size, MADV_SEQUENTIAL);
+        }
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if(data) munmap(const_cast<char*>(data), size);
+}
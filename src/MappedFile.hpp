@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Read-only view of a whole source file. The file is mmapped so the lexer can hand out
+// string_views into it without copying; Tokens produced from it are only valid while
+// the MappedFile is alive.
+class MappedFile {
+private:
+    const char* data;
+    std::size_t size;
+    bool ok;
+
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool is_open() const { return ok; }
+    std::string_view contents() const { return std::string_view(data, size); }
+};
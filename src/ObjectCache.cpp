@@ -0,0 +1,110 @@
+#include "ObjectCache.hpp"
+#include <fcntl.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/CachePruning.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA256.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <sys/stat.h>
+#include <utility>
+
+ObjectCache::ObjectCache(std::string dir, std::uint64_t max_bytes)
+    : dir(std::move(dir)), max_bytes(max_bytes), hits(0), misses(0), stores(0) {
+    llvm::sys::fs::create_directories(this->dir);
+}
+
+ObjectCache::~ObjectCache() {
+    Prune();
+}
+
+std::string ObjectCache::DefaultDir() {
+    llvm::SmallString<128> path;
+    if(!llvm::sys::path::cache_directory(path)) path = ".";
+    llvm::sys::path::append(path, "kaleidoscope");
+    return std::string(path);
+}
+
+std::string ObjectCache::pathFor(const std::string& key) const {
+    // the prefix is what pruneCache recognizes as an entry
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, "llvmcache-" + key);
+    return std::string(path);
+}
+
+std::string ObjectCache::Key(llvm::StringRef bitcode, const llvm::TargetMachine& tm, llvm::OptimizationLevel level) {
+    llvm::SHA256 hash;
+    auto field = [&](llvm::StringRef s) {
+        hash.update(s);
+        hash.update(llvm::StringRef("\0", 1));
+    };
+
+    field(LLVM_VERSION_STRING);
+    field(tm.getTargetTriple().str());
+    field(tm.getTargetCPU());
+    field(tm.getTargetFeatureString());
+    field(std::to_string(level.getSpeedupLevel()) + "/" + std::to_string(level.getSizeLevel()));
+    field(std::to_string(static_cast<int>(tm.getRelocationModel())) + "/" +
+          std::to_string(static_cast<int>(tm.getCodeModel())) + "/" +
+          std::to_string(static_cast<int>(tm.getOptLevel())));
+    field(bitcode);
+
+    return llvm::toHex(hash.result(), true);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> ObjectCache::Get(const std::string& key) {
+    auto path = pathFor(key);
+    auto buf = llvm::MemoryBuffer::getFile(path, false, false);
+    if(!buf) {
+        misses++;
+        return nullptr;
+    }
+
+    // eviction goes by access time, which noatime mounts never update on a read
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+    hits++;
+    return std::move(*buf);
+}
+
+void ObjectCache::Put(const std::string& key, llvm::StringRef object) {
+    // Write under a unique name and rename into place, so a concurrent Get never sees half an
+    // entry. The name lacks the entry prefix, or another process's Prune could delete it mid-write.
+    llvm::SmallString<128> model(dir);
+    llvm::sys::path::append(model, "tmp-" + key + ".%%%%%%");
+    int fd;
+    llvm::SmallString<128> tmp;
+    if(llvm::sys::fs::createUniqueFile(model, fd, tmp)) return;
+    {
+        llvm::raw_fd_ostream os(fd, true);
+        os << object;
+        if(os.has_error()) {
+            os.clear_error();
+            llvm::sys::fs::remove(tmp);
+            return;
+        }
+    }
+
+    if(llvm::sys::fs::rename(tmp, pathFor(key))) {
+        llvm::sys::fs::remove(tmp);
+        return;
+    }
+    stores++;
+}
+
+void ObjectCache::Prune() {
+    llvm::CachePruningPolicy policy;
+    policy.Interval = std::chrono::seconds(0);  // every time, not once per interval
+    policy.MaxSizeBytes = max_bytes;
+    llvm::pruneCache(dir, policy);
+}
+
+void ObjectCache::PrintStats(std::ostream& os) const {
+    std::uint64_t lookups = hits + misses;
+    os << "object cache: " << hits << " hits, " << misses << " misses";
+    if(lookups) os << " (" << hits * 100 / lookups << "% hit rate)";
+    os << ", " << stores << " stored in " << dir << "\n";
+}
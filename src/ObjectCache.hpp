@@ -0,0 +1,50 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+// Persistent cache of compiled objects, shared by every run of the compiler. Entries are keyed on
+// a SHA-256 of the unoptimized bitcode together with everything else that decides the machine
+// code: LLVM version, triple, CPU, features, optimization levels, relocation and code model. A key
+// is only ever written with the object for that input, so entries never need invalidating, only
+// evicting.
+//
+// Each entry is a file in the cache directory. Hits refresh the file's times, and Prune (run when
+// the cache is destroyed) deletes the least recently used entries until the directory fits in
+// max_bytes. Safe to use from several threads and several processes at once.
+class ObjectCache {
+private:
+    std::string dir;
+    std::uint64_t max_bytes;
+    std::atomic<std::uint64_t> hits;
+    std::atomic<std::uint64_t> misses;
+    std::atomic<std::uint64_t> stores;
+
+    std::string pathFor(const std::string& key) const;
+
+public:
+    ObjectCache(std::string dir, std::uint64_t max_bytes);
+    ~ObjectCache();
+
+    ObjectCache(const ObjectCache&) = delete;
+    ObjectCache& operator=(const ObjectCache&) = delete;
+
+    // $XDG_CACHE_HOME/kaleidoscope or ~/.cache/kaleidoscope
+    static std::string DefaultDir();
+
+    static std::string Key(llvm::StringRef bitcode, const llvm::TargetMachine& tm, llvm::OptimizationLevel level);
+
+    // the object stored under key, null on a miss
+    std::unique_ptr<llvm::MemoryBuffer> Get(const std::string& key);
+    void Put(const std::string& key, llvm::StringRef object);
+
+    void Prune();
+    void PrintStats(std::ostream& os) const;
+};
@@ -0,0 +1,262 @@
+#include "ParallelRuntime.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// the pool's threads are workers 1 to n-1, and whichever thread starts a loop from outside is 0
+thread_local unsigned workerId = 0;
+
+// loops this thread is inside, started by it or running a chunk of
+thread_local unsigned depth = 0;
+
+// Held by the thread outside the pool that is worker 0 for as long as its outermost loop runs, so
+// that others calling in at the same time don't share its ranges and partials line.
+std::mutex outside;
+
+struct Nested {
+    Nested() { depth++; }
+    ~Nested() { depth--; }
+};
+
+// The chunks [begin, end) a worker has left, packed in one word so that the owner taking chunks off
+// the front and thieves splitting off the back agree with a single compare-and-swap. A range only
+// ever shrinks, except for a thief refilling its own empty one, so the same word never comes back.
+struct alignas(64) ChunkRange {
+    std::atomic<std::uint64_t> bits{0};
+};
+
+std::uint64_t pack(std::uint32_t begin, std::uint32_t end) { return std::uint64_t(begin) << 32 | end; }
+std::uint32_t first(std::uint64_t bits) { return std::uint32_t(bits >> 32); }
+std::uint32_t last(std::uint64_t bits) { return std::uint32_t(bits); }
+
+// Chunks a loop is split into by default, enough for stealing to even out iterations of different
+// cost on any machine; at most kMaxChunks, which bounds the partials of a reduction.
+constexpr std::uint64_t kDefaultChunks = 256;
+constexpr std::uint64_t kMaxChunks = std::uint64_t(1) << 16;
+
+// the iterations in each chunk of a loop of trips
+std::uint64_t grainFor(std::uint64_t trips, std::uint64_t grain) {
+    if(grain == 0) grain = (trips + kDefaultChunks - 1) / kDefaultChunks;
+    return std::max(grain, (trips + kMaxChunks - 1) / kMaxChunks);
+}
+
+// one call of __kl_parallel_for
+struct Loop {
+    kl_chunk_fn fn;
+    void* ctx;
+    char* partials;
+    std::uint64_t stride;
+    std::uint64_t trips;
+    std::uint64_t grain;
+    std::uint32_t chunks;
+    unsigned workers;
+    std::unique_ptr<ChunkRange[]> ranges;  // by worker
+    std::atomic<std::uint32_t> done{0};    // chunks finished
+
+    // the next chunk of worker id: off its own range, or else from the back half of another's
+    bool take(unsigned id, std::uint32_t& chunk) {
+        auto& own = ranges[id].bits;
+        std::uint64_t r = own.load(std::memory_order_acquire);
+        while(first(r) < last(r)) {
+            if(own.compare_exchange_weak(r, pack(first(r) + 1, last(r)), std::memory_order_acq_rel)) {
+                chunk = first(r);
+                return true;
+            }
+        }
+
+        for(unsigned i = 1; i < workers; i++) {
+            auto& victim = ranges[(id + i) % workers].bits;
+            std::uint64_t v = victim.load(std::memory_order_acquire);
+            while(first(v) < last(v)) {
+                std::uint32_t mid = first(v) + (last(v) - first(v)) / 2;
+                if(victim.compare_exchange_weak(v, pack(first(v), mid), std::memory_order_acq_rel)) {
+                    chunk = mid;
+                    own.store(pack(mid + 1, last(v)), std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run(std::uint32_t chunk) {
+        std::uint64_t begin = std::uint64_t(chunk) * grain;
+        std::uint64_t end = trips - begin < grain ? trips : begin + grain;
+        fn(ctx, partials ? partials + chunk * stride : nullptr, std::int64_t(begin), std::int64_t(end));
+    }
+
+    // run chunks until there are none left to take, true if there were any
+    bool work(unsigned id) {
+        bool ran = false;
+        std::uint32_t chunk;
+        while(take(id, chunk)) {
+            run(chunk);
+            done.fetch_add(1, std::memory_order_release);
+            ran = true;
+        }
+        return ran;
+    }
+};
+
+// Threads that sleep until a loop starts and then work on every loop still running, innermost
+// first, until none has chunks left to take. A thread waiting for its own loop to finish only
+// waits on chunks other threads are running, which never wait on it in turn.
+class Pool {
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<Loop>> active;  // innermost last
+    std::uint64_t generation;                   // counts the loops started
+    bool stopping;
+
+    void work(unsigned id) {
+        workerId = id;
+        std::uint64_t seen = 0;
+        bool ran = false;
+
+        for(;;) {
+            std::vector<std::shared_ptr<Loop>> loops;
+            {
+                // after finding work, look again right away: a loop may have started meanwhile
+                std::unique_lock<std::mutex> lock(mutex);
+                if(!ran) cv.wait(lock, [&] { return stopping || generation != seen; });
+                if(stopping) return;
+                seen = generation;
+                loops = active;
+            }
+
+            ran = false;
+            for(auto it = loops.rbegin(); it != loops.rend(); ++it) ran = (*it)->work(id) || ran;
+        }
+    }
+
+public:
+    unsigned workers;
+
+    explicit Pool(unsigned workers) : generation(0), stopping(false), workers(0) { Start(workers); }
+    ~Pool() { Stop(); }
+
+    void Start(unsigned n) {
+        workers = std::max(1u, n);
+        stopping = false;
+        for(unsigned i = 1; i < workers; i++) threads.emplace_back([this, i] { work(i); });
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(auto& t : threads) t.join();
+        threads.clear();
+    }
+
+    // the lock also publishes the loop's context to the threads that pick it up
+    void Post(std::shared_ptr<Loop> loop) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active.push_back(std::move(loop));
+            generation++;
+        }
+        cv.notify_all();
+    }
+
+    // threads that still hold the loop only find nothing left to take in it
+    void Retire(const Loop* loop) {
+        std::lock_guard<std::mutex> lock(mutex);
+        active.erase(std::find_if(active.begin(), active.end(), [&](const auto& l) { return l.get() == loop; }));
+    }
+};
+
+unsigned defaultWorkers() {
+    if(const char* env = std::getenv("KL_NUM_THREADS")) {
+        long n = std::strtol(env, nullptr, 10);
+        if(n > 0) return unsigned(n);
+    }
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+Pool& pool() {
+    static Pool p(defaultWorkers());
+    return p;
+}
+
+}  // namespace
+
+extern "C" std::int64_t __kl_parallel_workers() {
+    return pool().workers;
+}
+
+extern "C" void __kl_parallel_set_workers(std::int64_t workers) {
+    Pool& p = pool();
+    p.Stop();
+    p.Start(unsigned(std::max<std::int64_t>(workers, 1)));
+}
+
+extern "C" std::uint64_t __kl_parallel_chunks(std::uint64_t trips, std::uint64_t grain) {
+    if(trips == 0) return 0;
+    grain = grainFor(trips, grain);
+    return trips / grain + (trips % grain != 0);
+}
+
+extern "C" void __kl_parallel_for(kl_chunk_fn fn, void* ctx, void* partials, std::uint64_t stride, std::uint64_t trips,
+                                  std::uint64_t grain) {
+    if(trips == 0) return;
+
+    Pool& p = pool();
+    unsigned workers = p.workers;
+    std::uint64_t chunks = __kl_parallel_chunks(trips, grain);
+    grain = grainFor(trips, grain);
+
+    std::unique_lock<std::mutex> lock(outside, std::defer_lock);
+    if(workerId == 0 && depth == 0) lock.lock();
+    Nested nested;
+
+    // chunk by chunk all the same when there are partials, which each chunk has its own of
+    char* lines = static_cast<char*>(partials);
+    unsigned id = workerId;
+    if(workers == 1 || chunks == 1) {
+        if(!lines) {
+            fn(ctx, nullptr, 0, std::int64_t(trips));
+            return;
+        }
+        for(std::uint64_t c = 0; c < chunks; c++) {
+            std::uint64_t begin = c * grain;
+            fn(ctx, lines + c * stride, std::int64_t(begin), std::int64_t(std::min(trips, begin + grain)));
+        }
+        return;
+    }
+
+    // an even share for each worker to start with
+    auto loop = std::make_shared<Loop>();
+    loop->fn = fn;
+    loop->ctx = ctx;
+    loop->partials = lines;
+    loop->stride = stride;
+    loop->trips = trips;
+    loop->grain = grain;
+    loop->chunks = std::uint32_t(chunks);
+    loop->workers = workers;
+    loop->ranges = std::make_unique<ChunkRange[]>(workers);
+    for(unsigned i = 0; i < workers; i++) {
+        loop->ranges[i].bits.store(pack(std::uint32_t(chunks * i / workers), std::uint32_t(chunks * (i + 1) / workers)),
+                                   std::memory_order_relaxed);
+    }
+    p.Post(loop);
+
+    // once nothing is left to take, the rest are being run by other workers
+    loop->work(id);
+    while(loop->done.load(std::memory_order_acquire) < loop->chunks) std::this_thread::yield();
+    p.Retire(loop.get());
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Runtime of parallel loops. LLVMGen outlines the body of each one into a chunk function and calls
+// __kl_parallel_for, which hands out chunks of iterations to a pool of threads that steal from each
+// other once they run out. The JIT links it in; objects that use parallel loops link libklrt.a.
+
+extern "C" {
+
+// runs iterations [begin, end) of a loop; partial is the chunk's own slot for its reduction
+// results, or null if the loop has no partials
+typedef void (*kl_chunk_fn)(void* ctx, void* partial, std::int64_t begin, std::int64_t end);
+
+// Threads in the pool, counting the one that calls __kl_parallel_for. Set by KL_NUM_THREADS,
+// otherwise one per hardware thread.
+std::int64_t __kl_parallel_workers();
+
+// Resize the pool, for benchmarks; not while a loop is running.
+void __kl_parallel_set_workers(std::int64_t workers);
+
+// The number of chunks __kl_parallel_for splits [0, trips) into for grain iterations each, 0 for the
+// runtime's default. It depends on nothing else, the number of threads included, so reductions
+// folded chunk by chunk come out the same however many threads run them.
+std::uint64_t __kl_parallel_chunks(std::uint64_t trips, std::uint64_t grain);
+
+// Run fn over iterations [0, trips) in chunks of grain and return once all are done. Chunk c gets
+// partials + c * stride as its partial, or null if partials is. Loops may nest: a worker that
+// starts one inside a chunk takes part in it like the thread that started the outer. Threads
+// outside the pool all take part as worker 0, so their outermost loops run one at a time.
+void __kl_parallel_for(kl_chunk_fn fn, void* ctx, void* partials, std::uint64_t stride, std::uint64_t trips,
+                       std::uint64_t grain);
+}
@@ -1,22 +1,37 @@
+#include <algorithm>
+#include <charconv>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
 #include "Parser.hpp"
 #include "ASTNode.hpp"
 #include "Token.hpp"
 
-Token Parser::current() {
-    return at_end() ? end_token : tokens[pos];
+// make sure there are at least n tokens from the current one on, pulling from the lexer if there is one
+bool Parser::fill(std::size_t n) {
+    while(tokens.size() - pos < n) {
+        if(!lexer || (!tokens.empty() && tokens.back().type == TokenType::END_PROG)) return false;
+        tokens.push_back(lexer->NextToken());
+    }
+    return true;
+}
+
+const Token& Parser::current() {
+    return fill(1) ? tokens[pos] : end_token;
 }
 
-Token Parser::lookahead(std::size_t ofs) {
-    size_t new_pos = pos + ofs;
-    return new_pos < tokens.size() ? tokens[new_pos] : end_token;
+const Token& Parser::lookahead(std::size_t ofs) {
+    return fill(ofs + 1) ? tokens[pos + ofs] : end_token;
 }
 
+// returns a copy since advancing can drop the current token from the window
 Token Parser::accept(TokenType expected) {
     if(!check(expected)) error(expected);
 
@@ -26,8 +41,7 @@ Token Parser::accept(TokenType expected) {
 }
 
 bool Parser::check(TokenType expected) {
-    Token curr = current();
-    return curr.type == expected;
+    return current().type == expected;
 }
 
 bool Parser::checkExpr() {
@@ -36,67 +50,82 @@ bool Parser::checkExpr() {
         check(TokenType::NUMBER) ||
         check(TokenType::IDENTIFIER) ||
         check(TokenType::LOOP) ||
+        check(TokenType::PARALLEL) ||
         check(TokenType::VAR);
 }
 
 bool Parser::at_end() {
-    return pos >= tokens.size() - 1;
+    return current().type == TokenType::END_PROG;
 }
 
 void Parser::advance() {
-    if(!at_end()) pos++;
+    if(at_end()) return;
+    pos++;
+
+    // when streaming, drop consumed tokens once enough of them pile up
+    constexpr std::size_t kMaxConsumed = 64;
+    if(lexer && pos >= kMaxConsumed) {
+        tokens.erase(tokens.begin(), tokens.begin() + pos);
+        pos = 0;
+    }
 }
 
 void Parser::error(TokenType expected) {
-    Token curr = current();
-    std::cerr << "Got " << string_of_token_type(curr.type) << " at " << curr.line << ":" << curr.col << " (expected " << string_of_token_type(expected) << ")" << std::endl;
+    const Token& curr = current();
+    *err << "Got " << string_of_token_type(curr.type) << " at " << curr.line << ":" << curr.col << " (expected " << string_of_token_type(expected) << ")" << std::endl;
     num_errors++;
 }
 
 void Parser::errorMultiple(std::vector<TokenType> expected) {
-    Token curr = current();
-    std::cerr << "Got " << string_of_token_type(curr.type) << " at " << curr.line << ":" << curr.col << " (expected ";
+    const Token& curr = current();
+    *err << "Got " << string_of_token_type(curr.type) << " at " << curr.line << ":" << curr.col << " (expected ";
 
     for(size_t i = 0; i < expected.size(); i++) {
-        if(i > 0) std::cerr << ", ";
-        std::cerr << string_of_token_type(expected[i]);
+        if(i > 0) *err << ", ";
+        *err << string_of_token_type(expected[i]);
     }
-    std::cerr << std::endl;
+    *err << std::endl;
     num_errors++;
 }
 
 void Parser::endProgError() {
-    std::cerr << "Reached end of file while parsing" << std::endl;
+    *err << "Reached end of file while parsing" << std::endl;
     num_errors++;
 }
 
-std::unique_ptr<Program> Parser::parseProgram() {
-    std::vector<std::unique_ptr<Extern>> externs;
+std::unique_ptr<Program> Parser::parseProgram(bool allow_externs) {
+    std::unique_ptr<Arena> owned;
+    if(use_arena) {
+        owned = std::make_unique<Arena>();
+        arena = owned.get();
+    }
 
-    while(check(TokenType::EXTERN)) {
+    std::pmr::vector<std::unique_ptr<Extern>> externs(memoryFor(arena));
+
+    while(allow_externs && check(TokenType::EXTERN)) {
         auto e = parseExtern();
         externs.push_back(std::move(e));
     }
 
-    std::vector<std::unique_ptr<FuncDef>> functions;
+    std::pmr::vector<std::unique_ptr<FuncDef>> functions(memoryFor(arena));
 
     while(!at_end()) {
         auto f = parseFuncDef();
         functions.push_back(std::move(f));
     }
 
-    return std::make_unique<Program>(std::move(externs), std::move(functions));
+    auto program = std::make_unique<Program>(std::move(externs), std::move(functions), std::move(owned));
+    arena = nullptr;
+    return program;
 }
 
 std::unique_ptr<FuncDef> Parser::parseFuncDef() {
     accept(TokenType::DEF);
-    Token nameToken = accept(TokenType::IDENTIFIER);
-    auto name = nameToken.data;
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
 
-    std::vector<std::string> params;
+    std::pmr::vector<Symbol> params(memoryFor(arena));
     while(check(TokenType::IDENTIFIER)) {
-        Token curr = current();
-        params.push_back(curr.data);
+        params.push_back(current().sym);
         advance();
     }
 
@@ -104,39 +133,37 @@ std::unique_ptr<FuncDef> Parser::parseFuncDef() {
     auto block = parseBlock();
     accept(TokenType::END);
 
-    return std::make_unique<FuncDef>(std::move(name), std::move(params), std::move(block));
+    return makeNode<FuncDef>(arena, name, std::move(params), std::move(block));
 }
 
 std::unique_ptr<Block> Parser::parseBlock() {
-    std::vector<std::unique_ptr<Expr>> exprs;
+    std::pmr::vector<std::unique_ptr<Expr>> exprs(memoryFor(arena));
 
     while(checkExpr()) {
         auto e = parseExpr();
         exprs.push_back(std::move(e));
     }
 
-    return std::make_unique<Block>(std::move(exprs));
+    return makeNode<Block>(arena, std::move(exprs));
 }
 
 std::unique_ptr<Extern> Parser::parseExtern() {
     accept(TokenType::EXTERN);
-    Token nameToken = accept(TokenType::IDENTIFIER);
-    auto name = nameToken.data;
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
 
-    std::vector<std::string> params;
+    std::pmr::vector<Symbol> params(memoryFor(arena));
     while(check(TokenType::IDENTIFIER)) {
-        Token curr = current();
-        params.push_back(curr.data);
+        params.push_back(current().sym);
         advance();
     }
 
     accept(TokenType::SEMICOLON);
-    return std::make_unique<Extern>(std::move(name), std::move(params));
+    return makeNode<Extern>(arena, name, std::move(params));
 }
 
 std::unique_ptr<Expr> Parser::parseExpr() {
     if(check(TokenType::IF)) return parseIfExpr();
-    else if(check(TokenType::LOOP)) return parseLoopExpr();
+    else if(check(TokenType::LOOP) || check(TokenType::PARALLEL)) return parseLoopExpr();
     else if(check(TokenType::VAR)) return parseVarInitExpr();
     else return parseExpr3();
 }
@@ -150,20 +177,18 @@ std::unique_ptr<IfExpr> Parser::parseIfExpr() {
     auto block2 = parseBlock();
     accept(TokenType::END);
 
-    return std::make_unique<IfExpr>(std::move(cond), std::move(block1), std::move(block2));
+    return makeNode<IfExpr>(arena, std::move(cond), std::move(block1), std::move(block2));
 }
 
 std::unique_ptr<VarExpr> Parser::parseVarExpr() {
-    Token curr = accept(TokenType::IDENTIFIER);
-    auto name = curr.data;
-    return std::make_unique<VarExpr>(std::move(name));
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
+    return makeNode<VarExpr>(arena, name);
 }
 
 std::unique_ptr<CallExpr> Parser::parseCallExpr() {
-    std::vector<std::unique_ptr<Expr>> args;
+    std::pmr::vector<std::unique_ptr<Expr>> args(memoryFor(arena));
 
-    Token name_tok = accept(TokenType::IDENTIFIER);
-    auto name = name_tok.data;
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
 
     accept(TokenType::LPAR);
     while(!check(TokenType::RPAR)) {
@@ -177,21 +202,26 @@ std::unique_ptr<CallExpr> Parser::parseCallExpr() {
     }
     accept(TokenType::RPAR);
 
-    return std::make_unique<CallExpr>(std::move(name), std::move(args));
+    return makeNode<CallExpr>(arena, name, std::move(args));
 }
 
 std::unique_ptr<NumLiteral> Parser::parseNumLiteral() {
-    Token curr = accept(TokenType::NUMBER);
-    std::string data = curr.data;
-    auto val = std::stoi(data);
-    return std::make_unique<NumLiteral>(val);
+    Token num = accept(TokenType::NUMBER);
+    int val = 0;
+    auto [ptr, ec] = std::from_chars(num.data.data(), num.data.data() + num.data.size(), val);
+    if(ec != std::errc() || ptr != num.data.data() + num.data.size()) {
+        *err << "Got number " << num.data << " at " << num.line << ":" << num.col << " (expected an integer that fits in an int)" << std::endl;
+        num_errors++;
+    }
+    return makeNode<NumLiteral>(arena, val);
 }
 
 std::unique_ptr<LoopExpr> Parser::parseLoopExpr() {
+    bool parallel = check(TokenType::PARALLEL);
+    if(parallel) advance();
     accept(TokenType::LOOP);
 
-    Token nameToken = accept(TokenType::IDENTIFIER);
-    auto name = nameToken.data;
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
 
     accept(TokenType::RANGE);
     auto start = parseExpr();
@@ -199,21 +229,45 @@ std::unique_ptr<LoopExpr> Parser::parseLoopExpr() {
     auto end = parseExpr();
     accept(TokenType::COMMA);
     auto step = parseExpr();
+
+    std::pmr::vector<Reduction> reductions(memoryFor(arena));
+    if(parallel && check(TokenType::REDUCE)) {
+        advance();
+        reductions.push_back(parseReduction());
+        while(check(TokenType::COMMA)) {
+            advance();
+            reductions.push_back(parseReduction());
+        }
+    }
+
     accept(TokenType::ARROW);
     auto block = parseBlock();
     accept(TokenType::END);
 
-    return std::make_unique<LoopExpr>(std::move(name), std::move(start), std::move(end), std::move(step), std::move(block));
+    return makeNode<LoopExpr>(arena, name, std::move(start), std::move(end), std::move(step), std::move(block), parallel, std::move(reductions));
+}
+
+// sum, min or max and the variable; the operators aren't keywords, so they stay usable as names
+Reduction Parser::parseReduction() {
+    Token op = accept(TokenType::IDENTIFIER);
+    Symbol var = accept(TokenType::IDENTIFIER).sym;
+
+    if(op.data == "sum") return {ReductionOp::Sum, var};
+    if(op.data == "min") return {ReductionOp::Min, var};
+    if(op.data == "max") return {ReductionOp::Max, var};
+
+    *err << "Got reduction " << op.data << " at " << op.line << ":" << op.col << " (expected sum, min or max)" << std::endl;
+    num_errors++;
+    return {ReductionOp::Sum, var};
 }
 
 std::unique_ptr<VarInitExpr> Parser::parseVarInitExpr() {
     accept(TokenType::VAR);
-    Token varName = accept(TokenType::IDENTIFIER);
-    auto name = varName.data;
+    Symbol name = accept(TokenType::IDENTIFIER).sym;
     accept(TokenType::ASSIGN);
     auto val = parseExpr();
 
-    return std::make_unique<VarInitExpr>(std::move(name), std::move(val));
+    return makeNode<VarInitExpr>(arena, name, std::move(val));
 }
 
 std::unique_ptr<Expr> Parser::parseExpr3() {
@@ -221,7 +275,7 @@ std::unique_ptr<Expr> Parser::parseExpr3() {
     if(check(TokenType::ASSIGN)) {
         advance();
         auto rhs = parseExpr3();
-        lhs = std::make_unique<AssignExpr>(std::move(lhs), std::move(rhs));
+        lhs = makeNode<AssignExpr>(arena, std::move(lhs), std::move(rhs));
     }
 
     return lhs;
@@ -233,7 +287,7 @@ std::unique_ptr<Expr> Parser::parseExpr2() {
     while(check(TokenType::LT)) {
         accept(TokenType::LT);
         auto rhs = parseExpr1();
-        lhs = std::make_unique<BinOp>(std::move(lhs), '<', std::move(rhs));
+        lhs = makeNode<BinOp>(arena, std::move(lhs), '<', std::move(rhs));
     }
 
     return lhs;
@@ -246,11 +300,11 @@ std::unique_ptr<Expr> Parser::parseExpr1() {
         if(check(TokenType::MINUS)) {
             advance();
             auto rhs = parseExpr0();
-            lhs = std::make_unique<BinOp>(std::move(lhs), '-', std::move(rhs));
+            lhs = makeNode<BinOp>(arena, std::move(lhs), '-', std::move(rhs));
         } else if(check(TokenType::PLUS)) {
             advance();
             auto rhs = parseExpr0();
-            lhs = std::make_unique<BinOp>(std::move(lhs), '+', std::move(rhs));
+            lhs = makeNode<BinOp>(arena, std::move(lhs), '+', std::move(rhs));
         } else {
             // shouldn't happen
             errorMultiple({TokenType::MINUS, TokenType::PLUS});
@@ -268,7 +322,7 @@ std::unique_ptr<Expr> Parser::parseExpr0() {
     }
 
     errorMultiple({TokenType::IF, TokenType::IDENTIFIER, TokenType::NUMBER});
-    return std::make_unique<VarExpr>("err");
+    return makeNode<VarExpr>(arena, Symbol::intern("err"));
 }
 
 std::unique_ptr<ASTNode> Parser::Parse(bool toplevel) {
@@ -278,16 +332,150 @@ std::unique_ptr<ASTNode> Parser::Parse(bool toplevel) {
     else if(checkExpr()) {
         // make anonymous funcdef from toplevel expr
         auto e = parseExpr();
-        std::vector<std::unique_ptr<Expr>> es;
-        std::vector<std::string> p;
+        std::pmr::vector<std::unique_ptr<Expr>> es(memoryFor(arena));
+        std::pmr::vector<Symbol> p(memoryFor(arena));
         es.push_back(std::move(e));
-        auto b = std::make_unique<Block>(std::move(es));
+        auto b = makeNode<Block>(arena, std::move(es));
 
-        return std::make_unique<FuncDef>("_expr", std::move(p), std::move(b));
+        return makeNode<FuncDef>(arena, Symbol::intern("_expr"), std::move(p), std::move(b));
     }
     else return nullptr;
 }
 
+std::unique_ptr<ASTNode> Parser::ParseNext() {
+    if(at_end()) return nullptr;
+    if(check(TokenType::EXTERN)) return parseExtern();
+    return parseFuncDef();
+}
+
+std::unique_ptr<Program> Parser::ParseParallel(ThreadPool& pool) {
+    // the split needs every token up front
+    tokens.erase(tokens.begin(), tokens.begin() + pos);
+    pos = 0;
+    while(fill(tokens.size() + 1)) {}
+    std::vector<TopLevelSpan> spans = SplitTopLevel(tokens);
+
+    // Group the definitions into runs of about kRunTokens tokens. The split depends only on the
+    // program, never on the pool size, and large programs still get plenty of runs to balance.
+    constexpr std::size_t kRunTokens = 4096;
+
+    struct Run {
+        std::size_t first_span, last_span;  // [first_span, last_span)
+        bool allow_externs;
+        std::unique_ptr<Program> program;
+        std::ostringstream errors;  // kept off err, the sequential parse reports them
+        int num_errors = 0;
+    };
+    std::vector<Run> runs;
+
+    // externs are only allowed before the first def, like in parseProgram
+    std::size_t first_def = 0;
+    while(first_def < spans.size() && tokens[spans[first_def].begin].type == TokenType::EXTERN) first_def++;
+
+    for(std::size_t i = 0; i < spans.size();) {
+        std::size_t j = i;
+        std::size_t size = 0;
+        while(j < spans.size() && (j == i || size < kRunTokens)) {
+            size += spans[j].end - spans[j].begin;
+            j++;
+        }
+
+        runs.emplace_back();
+        runs.back().first_span = i;
+        runs.back().last_span = j;
+        runs.back().allow_externs = i <= first_def;
+        i = j;
+    }
+
+    auto parseRun = [&](Run& run) {
+        std::size_t begin = spans[run.first_span].begin;
+        std::size_t end = spans[run.last_span - 1].end;
+
+        // end the run with an END_PROG where the next run starts, so errors at the boundary point
+        // at the same place they would in a sequential parse
+        std::vector<Token> chunk(tokens.begin() + begin, tokens.begin() + end);
+        const Token& next = end < tokens.size() ? tokens[end] : end_token;
+        chunk.push_back(Token(TokenType::END_PROG, "", next.line, next.col, next.offset));
+
+        Parser parser(std::move(chunk), use_arena);
+        parser.err = &run.errors;
+        run.program = parser.parseProgram(run.allow_externs);
+        run.num_errors = parser.num_errors;
+    };
+
+    if(runs.size() == 1) parseRun(runs[0]);
+    else {
+        std::vector<std::future<void>> done;
+        done.reserve(runs.size());
+        for(auto& run : runs) done.push_back(pool.Submit([&parseRun, &run] { parseRun(run); }));
+        for(auto& d : done) d.get();
+    }
+
+    // Recovery inside a run can't see past its end, so a program with errors is parsed again
+    // sequentially to report exactly what Parse() would.
+    bool failed = std::any_of(runs.begin(), runs.end(), [](const Run& run) { return run.num_errors > 0; });
+    if(failed) return parseProgram();
+
+    // merge in source order
+    std::unique_ptr<Arena> owned;
+    if(use_arena) owned = std::make_unique<Arena>();
+
+    std::pmr::vector<std::unique_ptr<Extern>> externs(memoryFor(owned.get()));
+    std::pmr::vector<std::unique_ptr<FuncDef>> functions(memoryFor(owned.get()));
+    std::vector<std::unique_ptr<Arena>> arenas;
+
+    for(auto& run : runs) {
+        Program& p = *run.program;
+        for(auto& e : p.externs) externs.push_back(std::move(e));
+        for(auto& fd : p.func_defs) functions.push_back(std::move(fd));
+        for(auto& a : p.arenas) arenas.push_back(std::move(a));
+        p.externs.clear();
+        p.func_defs.clear();
+        p.arenas.clear();
+        run.program.reset();
+    }
+
+    auto program = std::make_unique<Program>(std::move(externs), std::move(functions), std::move(owned));
+    for(auto& a : arenas) program->arenas.push_back(std::move(a));
+    return program;
+}
+
+std::vector<TopLevelSpan> Parser::SplitTopLevel(const std::vector<Token>& tokens) {
+    std::vector<TopLevelSpan> spans;
+    std::size_t i = 0;
+    auto more = [&]() { return i < tokens.size() && tokens[i].type != TokenType::END_PROG; };
+
+    while(more()) {
+        TopLevelSpan span{i, i, false};
+
+        if(tokens[i].type == TokenType::EXTERN) {
+            for(; more(); i++) {
+                if(tokens[i].type == TokenType::SEMICOLON) {
+                    i++;
+                    span.complete = true;
+                    break;
+                }
+            }
+        } else {
+            int depth = 0;
+            for(; more(); i++) {
+                TokenType t = tokens[i].type;
+                if(t == TokenType::DEF || t == TokenType::IF || t == TokenType::LOOP) depth++;
+                else if(t == TokenType::END && --depth <= 0) {
+                    i++;
+                    span.complete = true;
+                    break;
+                }
+            }
+        }
+
+        span.end = i;
+        spans.push_back(span);
+    }
+
+    return spans;
+}
+
 int Parser::Errors() {
     return num_errors;
 }
@@ -1,20 +1,38 @@
 #include <cstddef>
+#include <iostream>
 #include <vector>
 #include <memory>
 
 #include "Token.hpp"
 #include "ASTNode.hpp"
+#include "Lexer.hpp"
+#include "ThreadPool.hpp"
 
+// token index range [begin, end) of one top level definition
+struct TopLevelSpan {
+    std::size_t begin;
+    std::size_t end;
+    bool complete;  // false if the tokens ran out inside the definition
+};
+
+// Tokens come either from a vector lexed up front or are pulled from a Lexer on demand. In the
+// second case consumed tokens are dropped as parsing goes, so the window only holds the current
+// token, the lookahead and a small consumed prefix and memory doesn't grow with the input.
 class Parser {
 private:
+    Lexer* lexer;              // null when parsing a token vector
     std::vector<Token> tokens;
-    std::size_t pos;
-    Token end_token;  // dummy end token to use as current token if pos exceeds the size of tokens vector
+    std::size_t pos;  // index of the current token
+    Token end_token;  // dummy end token to use as current token if the token source runs out without an END_PROG
     int num_errors;
+    bool use_arena;
+    Arena* arena;  // where nodes are allocated, null for the heap
+    std::ostream* err;  // where syntax errors are reported
 
     // utility functions
-    Token current();
-    Token lookahead(std::size_t ofs = 1);
+    bool fill(std::size_t n);
+    const Token& current();
+    const Token& lookahead(std::size_t ofs = 1);
     Token accept(TokenType expected);
 
     bool check(TokenType expected);
@@ -26,7 +44,7 @@ private:
     void errorMultiple(std::vector<TokenType> expected);
     void endProgError();
 
-    std::unique_ptr<Program> parseProgram();
+    std::unique_ptr<Program> parseProgram(bool allow_externs = true);
     std::unique_ptr<FuncDef> parseFuncDef();
     std::unique_ptr<Block> parseBlock();
     std::unique_ptr<Extern> parseExtern();
@@ -42,12 +60,31 @@ private:
     std::unique_ptr<NumLiteral> parseNumLiteral();
     std::unique_ptr<IfExpr> parseIfExpr();
     std::unique_ptr<LoopExpr> parseLoopExpr();
+    Reduction parseReduction();
     std::unique_ptr<VarInitExpr> parseVarInitExpr();
 
 public:
-    explicit Parser(std::vector<Token> tokens)
-        : tokens(std::move(tokens)), pos(0), end_token(Token(TokenType::END_PROG, "", 0, 0)), num_errors(0) {}
+    // With use_arena, Parse() allocates the whole program from an Arena owned by the Program, so
+    // freeing it is a few bulk deallocations instead of a walk over every node. Nodes returned by
+    // ParseNext or a toplevel Parse are always heap allocated since they outlive any one Program.
+    explicit Parser(std::vector<Token> tokens, bool use_arena = false)
+        : lexer(nullptr), tokens(std::move(tokens)), pos(0), end_token(Token(TokenType::END_PROG, "", 0, 0)), num_errors(0), use_arena(use_arena), arena(nullptr), err(&std::cerr) {}
+
+    explicit Parser(Lexer& lexer, bool use_arena = false)
+        : lexer(&lexer), pos(0), end_token(Token(TokenType::END_PROG, "", 0, 0)), num_errors(0), use_arena(use_arena), arena(nullptr), err(&std::cerr) {}
 
     std::unique_ptr<ASTNode> Parse(bool toplevel = false);
+
+    // Parse the whole program like Parse(), but split it at top level definitions first and parse
+    // runs of definitions on the pool. The Program has the definitions in source order. If any run
+    // has errors the whole program is parsed again sequentially, so diagnostics match Parse().
+    std::unique_ptr<Program> ParseParallel(ThreadPool& pool);
+
+    // parse the next extern or function definition, null at the end of the input
+    std::unique_ptr<ASTNode> ParseNext();
+
+    // Find top level definition boundaries without parsing: an extern runs to its semicolon and
+    // a def to the END that closes it, counting the DEF/IF/LOOP ... END nesting in between.
+    static std::vector<TopLevelSpan> SplitTopLevel(const std::vector<Token>& tokens);
     int Errors();
 };
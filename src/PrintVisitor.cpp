@@ -3,6 +3,7 @@
 
 #include "PrintVisitor.hpp"
 #include "ASTNode.hpp"
+#include "FlatAST.hpp"
 
 void PrintVisitor::visit(Program& node) {
     std::cout << "Program\n";
@@ -61,7 +62,7 @@ void PrintVisitor::visit(VarExpr& node) {
 
 void PrintVisitor::visit(NumLiteral& node) {
     print_indent(indent_level);
-    std::cout << "NumLiteral(" << node.val << ")\n";
+    std::cout << "NumLiteral(" << node.val << (node.isDouble ? ".0" : "") << ")\n";
 }
 
 void PrintVisitor::visit(BinOp& node) {
@@ -112,7 +113,9 @@ void PrintVisitor::visit(CallExpr& node) {
 void PrintVisitor::visit(LoopExpr& node) {
     unsigned int curr_indent = indent_level;
     print_indent(indent_level);
-    std::cout << "Loop " << node.name << "\n";
+    std::cout << (node.parallel ? "ParallelLoop " : "Loop ") << node.name;
+    for(const auto& r : node.reductions) std::cout << " " << string_of_reduction_op(r.op) << " " << r.var;
+    std::cout << "\n";
 
     indent_level = curr_indent + 1;
     node.rangeStart->accept(*this);
@@ -154,6 +157,144 @@ void PrintVisitor::visit(AssignExpr& node) {
     indent_level = curr_indent;
 }
 
+// The flat visits print exactly what the tree visits above print for the same program.
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatFuncDef& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+
+    std::cout << "FuncDef " << node.name;
+
+    for(const auto& p : ast.symbolsIn(node.params)) std::cout << " " << p;
+    std::cout << "\n";
+
+    indent_level++;
+    ast.accept(node.block, *this);
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatExtern& node) {
+    print_indent(indent_level);
+    std::cout << "Extern " << node.name;
+    for(const auto& p : ast.symbolsIn(node.params)) std::cout << " " << p;
+    std::cout << "\n";
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatBlock& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+
+    std::cout << "Block\n";
+    for(Ref e : ast[node.exprs]) {
+        indent_level = curr_indent + 1;
+        ast.accept(e, *this);
+    }
+
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST&, const FlatVarExpr& node) {
+    print_indent(indent_level);
+    std::cout << "VarExpr(" << node.name << ")\n";
+}
+
+void PrintVisitor::visit(const FlatAST&, const FlatNumLiteral& node) {
+    print_indent(indent_level);
+    std::cout << "NumLiteral(" << node.val << (node.isDouble ? ".0" : "") << ")\n";
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatBinOp& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << "BinOp\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.left, *this);
+
+    print_indent(indent_level + 1);
+    std::cout << node.op << "\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.right, *this);
+
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatIfExpr& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << "If\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.cond, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.then, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.elss, *this);
+
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatCallExpr& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << "Call " << node.name << "\n";
+
+    for(Ref arg : ast[node.args]) {
+        indent_level = curr_indent + 1;
+        ast.accept(arg, *this);
+    }
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatLoopExpr& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << (node.parallel ? "ParallelLoop " : "Loop ") << node.name;
+    for(const auto& r : ast.reductionsIn(node.reductions)) std::cout << " " << string_of_reduction_op(r.op) << " " << r.var;
+    std::cout << "\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.rangeStart, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.rangeEnd, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.step, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.block, *this);
+
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatVarInitExpr& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << "VarInit " << node.name << "\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.val, *this);
+
+    indent_level = curr_indent;
+}
+
+void PrintVisitor::visit(const FlatAST& ast, const FlatAssignExpr& node) {
+    unsigned int curr_indent = indent_level;
+    print_indent(indent_level);
+    std::cout << "Assign\n";
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.lhs, *this);
+
+    indent_level = curr_indent + 1;
+    ast.accept(node.val, *this);
+
+    indent_level = curr_indent;
+}
+
 void PrintVisitor::print_indent(unsigned int level) {
     std::cout << std::string(level * 2, ' ');
 }
@@ -1,13 +1,14 @@
 #include "ASTNode.hpp"
+#include "FlatAST.hpp"
 
-class PrintVisitor : public Visitor {
+class PrintVisitor : public Visitor, public FlatVisitor {
 private:
     unsigned int indent_level;
 
     void print_indent(unsigned int level);
 public:
-    PrintVisitor()
-        : indent_level(0) {}
+    explicit PrintVisitor(unsigned int indent_level = 0)
+        : indent_level(indent_level) {}
 
     void visit(Program& node) override;
     void visit(FuncDef& node) override;
@@ -21,4 +22,16 @@ public:
     void visit(LoopExpr& node) override;
     void visit(VarInitExpr& node) override;
     void visit(AssignExpr& node) override;
+
+    void visit(const FlatAST& ast, const FlatFuncDef& node) override;
+    void visit(const FlatAST& ast, const FlatExtern& node) override;
+    void visit(const FlatAST& ast, const FlatBlock& node) override;
+    void visit(const FlatAST& ast, const FlatVarExpr& node) override;
+    void visit(const FlatAST& ast, const FlatNumLiteral& node) override;
+    void visit(const FlatAST& ast, const FlatBinOp& node) override;
+    void visit(const FlatAST& ast, const FlatIfExpr& node) override;
+    void visit(const FlatAST& ast, const FlatCallExpr& node) override;
+    void visit(const FlatAST& ast, const FlatLoopExpr& node) override;
+    void visit(const FlatAST& ast, const FlatVarInitExpr& node) override;
+    void visit(const FlatAST& ast, const FlatAssignExpr& node) override;
 };
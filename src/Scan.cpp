@@ -0,0 +1,121 @@
+#include "Scan.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+bool isIdentChar(unsigned char c) {
+    unsigned char lower = c | 0x20;
+    return (lower >= 'a' && lower <= 'z') || (c >= '0' && c <= '9');
+}
+
+bool isNumberChar(unsigned char c) {
+    return (c >= '0' && c <= '9') || c == '.';
+}
+
+bool isWhitespace(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// The vector classifiers produce a bitmask with bit i set if byte i is in the class. Bytes >= 0x80
+// compare as negative, so they never land inside a range check.
+#if defined(__AVX2__)
+constexpr int kWidth = 32;
+using Vec = __m256i;
+using Mask = unsigned int;
+
+Vec load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+Vec splat(char c) { return _mm256_set1_epi8(c); }
+Vec inRange(Vec v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, splat(lo - 1)), _mm256_cmpgt_epi8(splat(hi + 1), v));
+}
+Vec eq(Vec v, char c) { return _mm256_cmpeq_epi8(v, splat(c)); }
+Vec orv(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+Mask mask(Vec v) { return static_cast<Mask>(_mm256_movemask_epi8(v)); }
+constexpr Mask kFull = 0xFFFFFFFFu;
+#elif defined(__SSE2__)
+constexpr int kWidth = 16;
+using Vec = __m128i;
+using Mask = unsigned int;
+
+Vec load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+Vec splat(char c) { return _mm_set1_epi8(c); }
+Vec inRange(Vec v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, splat(lo - 1)), _mm_cmplt_epi8(v, splat(hi + 1)));
+}
+Vec eq(Vec v, char c) { return _mm_cmpeq_epi8(v, splat(c)); }
+Vec orv(Vec a, Vec b) { return _mm_or_si128(a, b); }
+Mask mask(Vec v) { return static_cast<Mask>(_mm_movemask_epi8(v)); }
+constexpr Mask kFull = 0xFFFFu;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+Mask identMask(Vec v) {
+    Vec lower = orv(v, splat(0x20));
+    return mask(orv(inRange(lower, 'a', 'z'), inRange(v, '0', '9')));
+}
+
+Mask numberMask(Vec v) {
+    return mask(orv(inRange(v, '0', '9'), eq(v, '.')));
+}
+
+Mask whitespaceMask(Vec v) {
+    // \t \n \v \f \r are contiguous
+    return mask(orv(eq(v, ' '), inRange(v, '\t', '\r')));
+}
+#endif
+
+}  // namespace
+
+const char* scanIdentifier(const char* p, const char* end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    while(end - p >= kWidth) {
+        Mask m = identMask(load(p));
+        if(m != kFull) return p + __builtin_ctz(~m);
+        p += kWidth;
+    }
+#endif
+    while(p != end && isIdentChar(*p)) p++;
+    return p;
+}
+
+const char* scanNumber(const char* p, const char* end) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    while(end - p >= kWidth) {
+        Mask m = numberMask(load(p));
+        if(m != kFull) return p + __builtin_ctz(~m);
+        p += kWidth;
+    }
+#endif
+    while(p != end && isNumberChar(*p)) p++;
+    return p;
+}
+
+const char* scanWhitespace(const char* p, const char* end, unsigned int& newlines, const char*& last_newline) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    while(end - p >= kWidth) {
+        Vec v = load(p);
+        Mask ws = whitespaceMask(v);
+        Mask run = ws == kFull ? kFull : ((1u << __builtin_ctz(~ws)) - 1);
+        Mask nl = mask(eq(v, '\n')) & run;
+
+        if(nl) {
+            newlines += __builtin_popcount(nl);
+            last_newline = p + (31 - __builtin_clz(nl));
+        }
+
+        if(ws != kFull) return p + __builtin_ctz(~ws);
+        p += kWidth;
+    }
+#endif
+    while(p != end && isWhitespace(*p)) {
+        if(*p == '\n') {
+            newlines++;
+            last_newline = p;
+        }
+        p++;
+    }
+    return p;
+}
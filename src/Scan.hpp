@@ -0,0 +1,15 @@
+#pragma once
+
+// Bulk character-class scanners for the lexer's hot loops. Each one returns a pointer to the
+// first byte in [p, end) that is outside its class. They classify 32 (AVX2) or 16 (SSE2) bytes
+// per step when the target supports it and fall back to a byte-at-a-time loop otherwise.
+
+// [A-Za-z0-9]
+const char* scanIdentifier(const char* p, const char* end);
+
+// [0-9.]
+const char* scanNumber(const char* p, const char* end);
+
+// ' ', '\t', '\r', '\n', '\v', '\f'. Newlines are counted into `newlines` and the position of
+// the last one is stored in `last_newline` (left untouched if there was none).
+const char* scanWhitespace(const char* p, const char* end, unsigned int& newlines, const char*& last_newline);
@@ -0,0 +1,81 @@
+#include "Symbol.hpp"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+class SymbolTable {
+private:
+    std::mutex mutex;
+    std::deque<std::string> spellings;  // deque so references stay valid as it grows
+    std::unordered_map<std::string_view, std::uint32_t> ids;  // keys view into spellings
+
+public:
+    SymbolTable() {
+        intern("");
+    }
+
+    std::uint32_t intern(std::string_view s) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = ids.find(s);
+        if(it != ids.end()) return it->second;
+
+        auto id = static_cast<std::uint32_t>(spellings.size());
+        const std::string& stored = spellings.emplace_back(s);
+        ids.emplace(stored, id);
+        return id;
+    }
+
+    const std::string& str(std::uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return spellings[id];
+    }
+
+    std::uint32_t count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return static_cast<std::uint32_t>(spellings.size());
+    }
+};
+
+SymbolTable& table() {
+    static SymbolTable t;
+    return t;
+}
+
+}  // namespace
+
+// Identifiers repeat a lot, so each thread keeps a small direct-mapped cache in front of the
+// shared table and only takes its lock on a miss.
+Symbol Symbol::intern(std::string_view s) {
+    struct Entry {
+        std::string_view spelling;  // points into the table's storage
+        std::uint32_t id;
+    };
+    constexpr std::size_t kCacheSize = 1024;
+    thread_local Entry cache[kCacheSize];
+
+    std::uint32_t h = 2166136261u;  // FNV-1a
+    for(char c : s) h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+
+    Entry& e = cache[h & (kCacheSize - 1)];
+    if(e.spelling == s) return Symbol(e.id);
+
+    std::uint32_t id = table().intern(s);
+    e = Entry{table().str(id), id};
+    return Symbol(id);
+}
+
+std::uint32_t Symbol::count() {
+    return table().count();
+}
+
+const std::string& Symbol::str() const {
+    return table().str(id);
+}
+
+std::ostream& operator<<(std::ostream& os, Symbol s) {
+    return os << s.str();
+}
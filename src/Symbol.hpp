@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// An interned identifier. Every spelling is stored once in a process-wide table and symbols
+// compare and hash as their 32-bit id, so the parser and codegen never copy or compare names.
+// Id 0 is the empty string.
+class Symbol {
+public:
+    std::uint32_t id;
+
+    Symbol() : id(0) {}
+    explicit Symbol(std::uint32_t id) : id(id) {}
+
+    // thread safe, returns the existing symbol if s has been interned before
+    static Symbol intern(std::string_view s);
+
+    // number of symbols interned so far, ids are dense in [0, count())
+    static std::uint32_t count();
+
+    // the spelling, valid for the lifetime of the program
+    const std::string& str() const;
+
+    bool empty() const { return id == 0; }
+    bool operator==(Symbol other) const { return id == other.id; }
+    bool operator!=(Symbol other) const { return id != other.id; }
+};
+
+std::ostream& operator<<(std::ostream& os, Symbol s);
+
+template<>
+struct std::hash<Symbol> {
+    std::size_t operator()(Symbol s) const noexcept { return s.id; }
+};
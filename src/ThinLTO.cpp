@@ -0,0 +1,68 @@
+#include "ThinLTO.hpp"
+#include "LLVMGen.hpp"
+#include <iostream>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/LTO/Config.h>
+#include <llvm/LTO/LTO.h>
+#include <llvm/Support/Caching.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBufferRef.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/TargetParser/Host.h>
+#include <memory>
+#include <utility>
+
+static bool error(const std::string& message) {
+    std::cerr << "ThinLTO: " << message << std::endl;
+    return false;
+}
+
+bool emitThinLTO(std::vector<ThinLTOInput>& inputs, const std::string& cpu, llvm::OptimizationLevel level,
+                 unsigned jobs, const std::string& output) {
+    llvm::lto::Config conf;
+    std::string features;
+    resolveCPU(cpu, conf.CPU, features);
+    if(!features.empty()) conf.MAttrs.push_back(features);
+    conf.RelocModel = llvm::Reloc::PIC_;
+    conf.DefaultTriple = llvm::sys::getDefaultTargetTriple();
+    conf.OptLevel = level.getSpeedupLevel();
+    conf.CGOptLevel = codeGenOptLevel(level);
+
+    auto backend = llvm::lto::createInProcessThinBackend(llvm::heavyweight_hardware_concurrency(jobs));
+    llvm::lto::LTO lto(std::move(conf), std::move(backend));
+
+    // first definition of a name wins, a second one is an error like it would be at link time
+    llvm::StringSet<> defined;
+    for(auto& input : inputs) {
+        auto file = llvm::lto::InputFile::create(llvm::MemoryBufferRef(
+            llvm::StringRef(input.bitcode.data(), input.bitcode.size()), input.path));
+        if(!file) return error(input.path + ": " + llvm::toString(file.takeError()));
+
+        std::vector<llvm::lto::SymbolResolution> resolutions;
+        for(const auto& sym : (*file)->symbols()) {
+            llvm::lto::SymbolResolution r;
+            if(!sym.isUndefined()) {
+                if(!defined.insert(sym.getName()).second) return error(input.path + ": redefinition of " + sym.getName().str());
+                r.Prevailing = true;
+            }
+            // the objects are linked with C code we can't see, which may call anything
+            r.VisibleToRegularObj = true;
+            resolutions.push_back(r);
+        }
+
+        if(auto err = lto.add(std::move(*file), resolutions)) return error(llvm::toString(std::move(err)));
+    }
+
+    // task 0 is the regular LTO partition, empty here since every input is thin
+    std::vector<llvm::SmallVector<char, 0>> objects(lto.getMaxTasks());
+    auto addStream = [&](unsigned task, const llvm::Twine&) -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>> {
+        return std::make_unique<llvm::CachedFileStream>(std::make_unique<llvm::raw_svector_ostream>(objects[task]));
+    };
+    if(auto err = lto.run(addStream)) return error(llvm::toString(std::move(err)));
+
+    if(auto err = writeObjectArchive(output, objects)) {
+        return error("failed to write " + output + ": " + llvm::toString(std::move(err)));
+    }
+    return true;
+}
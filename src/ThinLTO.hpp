@@ -0,0 +1,21 @@
+#pragma once
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <string>
+#include <vector>
+
+// One translation unit of a multi-file program: its path and its module written with a summary by
+// LLVMGen::WriteThinLTOBitcode.
+struct ThinLTOInput {
+    std::string path;
+    llvm::SmallVector<char, 0> bitcode;
+};
+
+// Link the inputs the way ThinLTO does. The combined summary decides which callees each module
+// imports from the others (as available_externally, so they can be inlined), then every module is
+// optimized and compiled on its own thread. The objects are written to the archive output in input
+// order. Every definition stays visible to non-Kaleidoscope objects. Returns false on failure,
+// after reporting it.
+bool emitThinLTO(std::vector<ThinLTOInput>& inputs, const std::string& cpu, llvm::OptimizationLevel level,
+                 unsigned jobs, const std::string& output);
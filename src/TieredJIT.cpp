@@ -0,0 +1,198 @@
+#include "TieredJIT.hpp"
+#include "LLVMGen.hpp"
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/AbsoluteSymbols.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/MemoryBufferRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <utility>
+
+extern "C" void __kl_tier_up(TieredJIT* jit, std::uint32_t id) {
+    jit->TierUp(id);
+}
+
+TieredJIT::TieredJIT(std::uint64_t threshold) : threshold(threshold ? threshold : 1), stopping(false), compiler(1) {
+    if(fail) return;
+
+    stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(jit->getTargetTriple())();
+    if(!stubs) {
+        error("no indirection stubs for " + jit->getTargetTriple().str());
+        return;
+    }
+
+    auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if(!jtmb) {
+        error(jtmb.takeError());
+        return;
+    }
+    jtmb->setCodeGenOptLevel(llvm::CodeGenOptLevel::Aggressive);
+    auto t = jtmb->createTargetMachine();
+    if(!t) {
+        error(t.takeError());
+        return;
+    }
+    tm = std::move(*t);
+
+    llvm::orc::SymbolMap runtime;
+    auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+    runtime[jit->mangleAndIntern("__kl_tier_up")] = {llvm::orc::ExecutorAddr::fromPtr(&__kl_tier_up), flags};
+    if(auto err = jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(runtime)))) {
+        error(std::move(err));
+    }
+}
+
+TieredJIT::~TieredJIT() {
+    // compiles still queued when the program is done aren't worth finishing
+    stopping = true;
+}
+
+// Move every body to NAME.tier0 and leave NAME as a declaration that will resolve to the stub, then
+// count calls at the entry and iterations at every back-edge (only loops have them). The count
+// reaching the threshold calls back into TierUp, exactly once per function. Internal functions,
+// the chunks of parallel loops, stay as they are and go along with their callers to tier 1.
+void TieredJIT::instrument(llvm::Module& mod) {
+    auto& ctx = mod.getContext();
+    auto* i64 = llvm::Type::getInt64Ty(ctx);
+    auto* ptrTy = llvm::PointerType::getUnqual(ctx);
+    auto tierUp = mod.getOrInsertFunction("__kl_tier_up", llvm::Type::getVoidTy(ctx), ptrTy, llvm::Type::getInt32Ty(ctx));
+    auto* self = llvm::ConstantExpr::getIntToPtr(llvm::ConstantInt::get(i64, reinterpret_cast<std::uintptr_t>(this)), ptrTy);
+    auto* unlikely = llvm::MDBuilder(ctx).createUnlikelyBranchWeights();
+
+    std::vector<llvm::Function*> defined;
+    for(auto& f : mod) {
+        if(!f.isDeclaration() && !f.hasLocalLinkage()) defined.push_back(&f);
+    }
+
+    for(auto* f : defined) {
+        auto id = std::uint32_t(names.size());
+        std::string name = f->getName().str();
+        names.push_back(name);
+
+        auto* decl = llvm::Function::Create(f->getFunctionType(), llvm::Function::ExternalLinkage, "", &mod);
+        f->replaceAllUsesWith(decl);
+        f->setName(name + ".tier0");
+        decl->setName(name);
+
+        auto* counter = new llvm::GlobalVariable(mod, i64, false, llvm::GlobalValue::InternalLinkage,
+                                                 llvm::ConstantInt::get(i64, 0), name + ".count");
+
+        llvm::SmallVector<std::pair<const llvm::BasicBlock*, const llvm::BasicBlock*>, 4> backedges;
+        llvm::FindFunctionBackedges(*f, backedges);
+
+        llvm::SmallPtrSet<llvm::Instruction*, 8> points;
+        for(auto& edge : backedges) points.insert(const_cast<llvm::BasicBlock*>(edge.first)->getTerminator());
+        points.insert(&*f->getEntryBlock().getFirstNonPHIOrDbgOrAlloca());
+
+        for(auto* at : points) {
+            llvm::IRBuilder<> b(at);
+            auto* old = b.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, b.getInt64(1), llvm::MaybeAlign(8),
+                                          llvm::AtomicOrdering::Monotonic);
+            auto* hot = b.CreateICmpEQ(old, b.getInt64(threshold - 1), "hot");
+            auto* then = llvm::SplitBlockAndInsertIfThen(hot, at, false, unlikely);
+            b.SetInsertPoint(then);
+            b.CreateCall(tierUp, {self, b.getInt32(id)});
+        }
+    }
+}
+
+void TieredJIT::Add(std::unique_ptr<llvm::Module> mod, std::unique_ptr<llvm::LLVMContext> ctx) {
+    if(fail) return;
+    if(!names.empty()) {
+        error("a tiered JIT runs a single program");
+        return;
+    }
+
+    mod->setDataLayout(jit->getDataLayout());
+    mod->setTargetTriple(jit->getTargetTriple());
+    {
+        llvm::raw_svector_ostream os(bitcode);
+        llvm::WriteBitcodeToFile(*mod, os);
+    }
+
+    instrument(*mod);
+
+    // The stubs have to exist before tier 0 is linked against them, and tier 0 has to be linked
+    // before the stubs can point at it, so they start out null and are filled in after the lookup.
+    llvm::orc::StubInitsMap inits;
+    auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+    for(const auto& name : names) inits[name] = {llvm::orc::ExecutorAddr(), flags};
+    if(auto err = stubs->createStubs(inits)) {
+        error(std::move(err));
+        return;
+    }
+
+    llvm::orc::SymbolMap stubSymbols;
+    for(const auto& name : names) stubSymbols[jit->mangleAndIntern(name)] = stubs->findStub(name, true);
+    if(auto err = jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(stubSymbols)))) {
+        error(std::move(err));
+        return;
+    }
+
+    JIT::Add(std::move(mod), std::move(ctx));
+    if(fail) return;
+
+    for(const auto& name : names) {
+        auto addr = jit->lookup(name + ".tier0");
+        if(!addr) {
+            error(addr.takeError());
+            return;
+        }
+        if(auto err = stubs->updatePointer(name, *addr)) {
+            error(std::move(err));
+            return;
+        }
+    }
+}
+
+void TieredJIT::TierUp(std::uint32_t id) {
+    compiler.Submit([this, id] { recompile(id); });
+}
+
+// Tier 1 gets the whole uninstrumented program with every other function made internal, so the
+// optimizer can inline them; callees it doesn't inline run as their own -O3 copies. Recursive calls
+// stay inside the module.
+void TieredJIT::recompile(std::uint32_t id) {
+    if(stopping) return;
+
+    const std::string& name = names[id];
+    auto ctx = std::make_unique<llvm::LLVMContext>();
+    auto buf = llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), "kl");
+    auto mod = llvm::parseBitcodeFile(buf, *ctx);
+    if(!mod) {
+        error(mod.takeError());
+        return;
+    }
+
+    for(auto& f : **mod) {
+        if(!f.isDeclaration() && f.getName() != name) f.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+    (*mod)->getFunction(name)->setName(name + ".tier1");
+
+    optimizeModule(**mod, llvm::OptimizationLevel::O3, tm.get());
+
+    JIT::Add(std::move(*mod), std::move(ctx));
+    if(fail) return;
+
+    auto addr = jit->lookup(name + ".tier1");
+    if(!addr) {
+        error(addr.takeError());
+        return;
+    }
+
+    // the stub jumps through a pointer sized slot, which is replaced with a single aligned store
+    if(auto err = stubs->updatePointer(name, *addr)) error(std::move(err));
+}
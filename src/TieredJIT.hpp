@@ -0,0 +1,48 @@
+#pragma once
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "JIT.hpp"
+#include "ThreadPool.hpp"
+
+// JIT that compiles everything quickly first and spends -O3 only on code that turns out to be hot.
+//
+// Every function is called through an indirection stub. The stub starts out pointing at a tier 0
+// body compiled without optimization, which counts its calls and loop back-edges. When the count
+// reaches the threshold the function is recompiled at -O3 from the untouched IR on a background
+// thread and its stub is repointed at the optimized body. Calls already running in the tier 0 body
+// finish there; every call after the switch gets the new code.
+class TieredJIT : public JIT {
+private:
+    std::uint64_t threshold;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+    std::unique_ptr<llvm::TargetMachine> tm;  // for tier 1, only used on the background thread
+
+    // the program before instrumentation, every tier 1 module is parsed from it into a fresh context
+    llvm::SmallVector<char, 0> bitcode;
+    std::vector<std::string> names;  // defined functions, indexed by the ids in tier 0 code
+
+    std::atomic<bool> stopping;
+    ThreadPool compiler;  // declared last so pending compiles finish before anything else goes away
+
+    void instrument(llvm::Module& mod);
+    void recompile(std::uint32_t id);
+
+public:
+    explicit TieredJIT(std::uint64_t threshold = 1000);
+    ~TieredJIT() override;
+
+    void Add(std::unique_ptr<llvm::Module> mod, std::unique_ptr<llvm::LLVMContext> ctx) override;
+
+    // called by tier 0 code when function id gets hot
+    void TierUp(std::uint32_t id);
+};
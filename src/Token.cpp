@@ -2,10 +2,21 @@
 
 #include <string>
 
-Token::Token(TokenType type, std::string data, unsigned int line, unsigned int col) 
-    : type(type), data(data), line(line), col(col) {}
+Token::Token(TokenType type, std::string_view data, unsigned int line, unsigned int col, unsigned int offset, Symbol sym)
+    : type(type), data(data), sym(sym), line(line), col(col), offset(offset) {}
 
-std::string Token::to_string() {
+#define X(name, spelling) case TokenType::name: return sizeof(spelling) - 1;
+static unsigned int spelling_length(TokenType type) {
+    switch(type) { TOKEN_TYPES }
+    return 0;
+}
+#undef X
+
+unsigned int Token::length() const {
+    return data.empty() ? spelling_length(type) : data.size();
+}
+
+std::string Token::to_string() const {
     std::string s;
 
     s += std::to_string(line);
@@ -24,7 +35,7 @@ std::string Token::to_string() {
     return s;
 }
 
-#define X(name) case TokenType::name: return #name;
+#define X(name, spelling) case TokenType::name: return #name;
 const char* string_of_token_type(TokenType type) {
     switch(type) { TOKEN_TYPES }
     return "unknown";
@@ -1,34 +1,41 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
+#include "Symbol.hpp"
+
+// X(name, spelling): tokens with a fixed spelling are keywords (alphabetic) or operators.
+// The lexer builds its keyword hash and operator DFA from these at compile time.
 #define TOKEN_TYPES \
-    X(IDENTIFIER) \
-    X(NUMBER) \
-    X(DEF) \
-    X(IF) \
-    X(THEN) \
-    X(ELSE) \
-    X(LOOP) \
-    X(RANGE) \
-    X(COMMA) \
-    X(EXTERN) \
-    X(PLUS) \
-    X(MINUS) \
-    X(LT) \
-    X(LE) \
-    X(GT) \
-    X(GE) \
-    X(LPAR) \
-    X(RPAR) \
-    X(SEMICOLON) \
-    X(END) \
-    X(ARROW) \
-    X(VAR) \
-    X(ASSIGN) \
-    X(END_PROG)
-
-#define X(name) name,
+    X(IDENTIFIER, "") \
+    X(NUMBER, "") \
+    X(DEF, "def") \
+    X(IF, "if") \
+    X(THEN, "then") \
+    X(ELSE, "else") \
+    X(LOOP, "loop") \
+    X(PARALLEL, "parallel") \
+    X(RANGE, "range") \
+    X(REDUCE, "reduce") \
+    X(COMMA, ",") \
+    X(EXTERN, "extern") \
+    X(PLUS, "+") \
+    X(MINUS, "-") \
+    X(LT, "<") \
+    X(LE, "<=") \
+    X(GT, ">") \
+    X(GE, ">=") \
+    X(LPAR, "(") \
+    X(RPAR, ")") \
+    X(SEMICOLON, ";") \
+    X(END, "end") \
+    X(ARROW, "->") \
+    X(VAR, "var") \
+    X(ASSIGN, "=") \
+    X(END_PROG, "")
+
+#define X(name, spelling) name,
 enum class TokenType {
     TOKEN_TYPES
 };
@@ -39,10 +46,15 @@ const char* string_of_token_type(TokenType type);
 class Token {
 public:
     TokenType type;
-    std::string data;
+    std::string_view data;  // view into the lexer's source buffer, empty for punctuation and keywords
+    Symbol sym;             // interned spelling of IDENTIFIER tokens
     unsigned int line;
     unsigned int col;
+    unsigned int offset;    // from the start of the source buffer
+
+    Token(TokenType type, std::string_view data, unsigned int line, unsigned int col, unsigned int offset = 0, Symbol sym = Symbol());
 
-    Token(TokenType type, std::string data, unsigned int line, unsigned int col);
-    std::string to_string();
+    // length of the token's text in the source
+    unsigned int length() const;
+    std::string to_string() const;
 };
@@ -0,0 +1,211 @@
+#include "TypeInference.hpp"
+
+#include <optional>
+
+template<typename Params, typename Body>
+std::vector<ValueType> TypeInference::infer(const Params& params, Body body) {
+    types.clear();
+    do {
+        changed = false;
+        next = 0;
+        env.clear();
+        for(Symbol p : params) declare(p, ValueType::Double);
+        body();
+    } while(changed);
+
+    // only a variable in unreachable code can be left without a type
+    for(auto& t : types) {
+        if(t == ValueType::None) t = ValueType::Int;
+    }
+    return types;
+}
+
+std::vector<ValueType> TypeInference::Function(FuncDef& node, Annotations* annotations) {
+    // every walk overwrites the notes, so the last one leaves the final types
+    notes = annotations;
+    auto types = infer(node.params, [&] { node.block->accept(*this); });
+    notes = nullptr;
+    return types;
+}
+
+std::vector<ValueType> TypeInference::Function(const FlatAST& ast, const FlatFuncDef& node) {
+    notes = nullptr;
+    return infer(ast.symbolsIn(node.params), [&] { ast.accept(node.block, *this); });
+}
+
+void TypeInference::note(const Expr& node) {
+    if(notes) notes->types[&node] = res;
+}
+
+std::size_t TypeInference::declare(Symbol name, ValueType type) {
+    std::size_t var = next++;
+    if(var == types.size()) types.push_back(ValueType::None);
+    assign(var, type);
+    env[name.id] = var;
+    return var;
+}
+
+void TypeInference::assign(std::size_t var, ValueType type) {
+    ValueType joined = join(types[var], type);
+    if(joined != types[var]) {
+        types[var] = joined;
+        changed = true;
+    }
+}
+
+template<typename Range, typename Body, typename Step>
+std::size_t TypeInference::loop(Symbol name, Range range, Body body, Step step) {
+    range();
+    ValueType start = res;
+
+    auto old = env.find(name.id);
+    std::optional<std::size_t> oldVar;
+    if(old != env.end()) oldVar = old->second;
+
+    // the variable is stepped by adding to it, so it is at least an integer
+    std::size_t var = declare(name, join(ValueType::Int, start));
+    body();
+    step();
+    assign(var, res);
+
+    if(oldVar) env[name.id] = *oldVar;
+    else env.erase(name.id);
+
+    res = ValueType::Int;
+    return var;
+}
+
+void TypeInference::visit(Program&) {}
+void TypeInference::visit(FuncDef&) {}
+void TypeInference::visit(Extern&) {}
+
+void TypeInference::visit(Block& node) {
+    res = ValueType::None;
+    for(auto& e : node.exprs) e->accept(*this);
+}
+
+void TypeInference::visit(VarExpr& node) {
+    auto it = env.find(node.name.id);
+    res = it == env.end() ? ValueType::None : types[it->second];
+    note(node);
+}
+
+void TypeInference::visit(NumLiteral& node) {
+    res = node.isDouble ? ValueType::Double : ValueType::Int;
+    note(node);
+}
+
+void TypeInference::visit(BinOp& node) {
+    node.left->accept(*this);
+    ValueType left = res;
+    node.right->accept(*this);
+    res = node.op == '<' ? ValueType::Bool : join(ValueType::Int, join(left, res));
+    note(node);
+}
+
+void TypeInference::visit(IfExpr& node) {
+    node.cond->accept(*this);
+    node.then->accept(*this);
+    ValueType then = res;
+    node.elss->accept(*this);
+    res = join(then, res);
+    note(node);
+}
+
+void TypeInference::visit(CallExpr& node) {
+    for(auto& a : node.args) a->accept(*this);
+    res = ValueType::Double;
+    note(node);
+}
+
+void TypeInference::visit(LoopExpr& node) {
+    std::size_t var = loop(node.name,
+                           [&] {
+                               node.rangeStart->accept(*this);
+                               ValueType start = res;
+                               node.rangeEnd->accept(*this);
+                               res = start;
+                           },
+                           [&] { node.block->accept(*this); },
+                           [&] { node.step->accept(*this); });
+    note(node);
+    if(notes) notes->vars[&node] = var;
+}
+
+void TypeInference::visit(VarInitExpr& node) {
+    node.val->accept(*this);
+    std::size_t var = declare(node.name, res);
+    note(node);
+    if(notes) notes->vars[&node] = var;
+}
+
+void TypeInference::visit(AssignExpr& node) {
+    node.val->accept(*this);
+    if(auto* var = dynamic_cast<VarExpr*>(node.lhs.get())) {
+        auto it = env.find(var->name.id);
+        if(it != env.end()) assign(it->second, res);
+    }
+    note(node);
+}
+
+void TypeInference::visit(const FlatAST&, const FlatFuncDef&) {}
+void TypeInference::visit(const FlatAST&, const FlatExtern&) {}
+
+void TypeInference::visit(const FlatAST& ast, const FlatBlock& node) {
+    res = ValueType::None;
+    for(Ref e : ast[node.exprs]) ast.accept(e, *this);
+}
+
+void TypeInference::visit(const FlatAST&, const FlatVarExpr& node) {
+    auto it = env.find(node.name.id);
+    res = it == env.end() ? ValueType::None : types[it->second];
+}
+
+void TypeInference::visit(const FlatAST&, const FlatNumLiteral& node) {
+    res = node.isDouble ? ValueType::Double : ValueType::Int;
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatBinOp& node) {
+    ast.accept(node.left, *this);
+    ValueType left = res;
+    ast.accept(node.right, *this);
+    res = node.op == '<' ? ValueType::Bool : join(ValueType::Int, join(left, res));
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatIfExpr& node) {
+    ast.accept(node.cond, *this);
+    ast.accept(node.then, *this);
+    ValueType then = res;
+    ast.accept(node.elss, *this);
+    res = join(then, res);
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatCallExpr& node) {
+    for(Ref a : ast[node.args]) ast.accept(a, *this);
+    res = ValueType::Double;
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatLoopExpr& node) {
+    loop(node.name,
+         [&] {
+             ast.accept(node.rangeStart, *this);
+             ValueType start = res;
+             ast.accept(node.rangeEnd, *this);
+             res = start;
+         },
+         [&] { ast.accept(node.block, *this); },
+         [&] { ast.accept(node.step, *this); });
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatVarInitExpr& node) {
+    ast.accept(node.val, *this);
+    declare(node.name, res);
+}
+
+void TypeInference::visit(const FlatAST& ast, const FlatAssignExpr& node) {
+    ast.accept(node.val, *this);
+    if(node.lhs.kind() == NodeKind::VarExpr) {
+        auto it = env.find(ast.var_exprs[node.lhs.index()].name.id);
+        if(it != env.end()) assign(it->second, res);
+    }
+}
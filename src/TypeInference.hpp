@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "FlatAST.hpp"
+#include "Symbol.hpp"
+
+// The types a value can have, ordered so that joining two takes the larger: a bool takes part in
+// arithmetic as 0 or 1, and an integer that meets a double becomes one. None is a variable nothing
+// has been assigned to yet.
+enum class ValueType : std::uint8_t { None, Bool, Int, Double };
+
+inline ValueType join(ValueType a, ValueType b) { return std::max(a, b); }
+
+// Infers the type of every local variable of a function. Parameters and call results are doubles,
+// the calling convention all functions and externs share. Literals are integers, comparisons are
+// bools, and +/- on integers and bools stays integer. A variable gets the join of every value
+// assigned to it; since a loop can feed a variable back into itself, the body is walked until no
+// type changes. Variables are numbered in the order LLVMGen creates them: parameters, then each
+// declaration as the body is generated (a loop's variable after its start and end, before its body).
+class TypeInference : public Visitor, public FlatVisitor {
+public:
+    // the type of every expression of a tree AST function and the variable each var and loop
+    // declares, for running the function with the same types as its compiled code (see Evaluator)
+    struct Annotations {
+        std::unordered_map<const Expr*, ValueType> types;
+        std::unordered_map<const Expr*, std::size_t> vars;
+    };
+
+private:
+    std::vector<ValueType> types;
+    std::size_t next;  // number of the next declaration in this walk
+    std::unordered_map<std::uint32_t, std::size_t> env;
+    ValueType res;
+    bool changed;
+    Annotations* notes;
+
+    void note(const Expr& node);
+
+    std::size_t declare(Symbol name, ValueType type);
+    void assign(std::size_t var, ValueType type);
+
+    template<typename Params, typename Body>
+    std::vector<ValueType> infer(const Params& params, Body body);
+
+    // the loop's variable is declared between generating the range and the body
+    template<typename Range, typename Body, typename Step>
+    std::size_t loop(Symbol name, Range range, Body body, Step step);
+
+public:
+    // parameters first, then the variables the body declares
+    std::vector<ValueType> Function(FuncDef& node, Annotations* annotations = nullptr);
+    std::vector<ValueType> Function(const FlatAST& ast, const FlatFuncDef& node);
+
+    void visit(Program& node) override;
+    void visit(FuncDef& node) override;
+    void visit(Block& node) override;
+    void visit(Extern& node) override;
+    void visit(VarExpr& node) override;
+    void visit(NumLiteral& node) override;
+    void visit(BinOp& node) override;
+    void visit(IfExpr& node) override;
+    void visit(CallExpr& node) override;
+    void visit(LoopExpr& node) override;
+    void visit(VarInitExpr& node) override;
+    void visit(AssignExpr& node) override;
+
+    void visit(const FlatAST& ast, const FlatFuncDef& node) override;
+    void visit(const FlatAST& ast, const FlatExtern& node) override;
+    void visit(const FlatAST& ast, const FlatBlock& node) override;
+    void visit(const FlatAST& ast, const FlatVarExpr& node) override;
+    void visit(const FlatAST& ast, const FlatNumLiteral& node) override;
+    void visit(const FlatAST& ast, const FlatBinOp& node) override;
+    void visit(const FlatAST& ast, const FlatIfExpr& node) override;
+    void visit(const FlatAST& ast, const FlatCallExpr& node) override;
+    void visit(const FlatAST& ast, const FlatLoopExpr& node) override;
+    void visit(const FlatAST& ast, const FlatVarInitExpr& node) override;
+    void visit(const FlatAST& ast, const FlatAssignExpr& node) override;
+};
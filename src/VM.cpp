@@ -0,0 +1,138 @@
+#include "VM.hpp"
+
+#include <cstdint>
+#include <iostream>
+
+#if defined(__GNUC__)
+#define KL_COMPUTED_GOTO 1
+#else
+#define KL_COMPUTED_GOTO 0
+#endif
+
+// natives take the arguments as an array of doubles, read straight from the registers
+static_assert(sizeof(Reg) == sizeof(double), "registers must be laid out like doubles");
+
+namespace {
+
+std::int64_t imm32(const Instr& in) {
+    return std::int32_t(std::uint32_t(in.b) | std::uint32_t(in.c) << 16);
+}
+
+std::int64_t imm16(const Instr& in) {
+    return std::int16_t(in.c);
+}
+
+}  // namespace
+
+VM::VM(const BytecodeModule& module, std::size_t stack_regs, std::size_t max_depth)
+    : module(module), stack(new Reg[stack_regs]), stack_regs(stack_regs), max_depth(max_depth), fail(false) {}
+
+void VM::error(std::string message) {
+    fail = true;
+    std::cerr << "VM: " << message << std::endl;
+}
+
+std::optional<double> VM::Run(const std::string& name) {
+    const auto* f = module.Find(Symbol::intern(name));
+    if(!f) {
+        error("no function " + name);
+        return std::nullopt;
+    }
+    if(f->params) {
+        error(name + " takes arguments");
+        return std::nullopt;
+    }
+    return execute(*f);
+}
+
+std::optional<double> VM::execute(const BytecodeFunction& entry) {
+    if(entry.regs > stack_regs) {
+        error("stack overflow in " + entry.name.str());
+        return std::nullopt;
+    }
+
+    const BytecodeFunction* f = &entry;
+    const Instr* ip = f->code.data();
+    const Instr* in;
+    Reg* r = stack.get();
+    Reg* const end = stack.get() + stack_regs;
+    frames.clear();
+
+#if KL_COMPUTED_GOTO
+#define X(name) &&op_##name,
+    static const void* const labels[] = { BYTECODE_OPS };
+#undef X
+#define OP(name) op_##name:
+#define NEXT() do { in = ip++; goto *labels[std::size_t(in->op)]; } while(0)
+    NEXT();
+#else
+#define OP(name) case Op::name:
+#define NEXT() goto dispatch
+dispatch:
+    in = ip++;
+    switch(in->op) {
+#endif
+
+    OP(LOADI) r[in->a].i = imm32(*in); NEXT();
+    OP(LOADI_D) r[in->a].d = double(imm32(*in)); NEXT();
+    OP(MOV) r[in->a] = r[in->b]; NEXT();
+    OP(I2D) r[in->a].d = double(r[in->b].i); NEXT();
+
+    // + and - on i64 wrap
+    OP(ADD_I) r[in->a].i = std::int64_t(std::uint64_t(r[in->b].i) + std::uint64_t(r[in->c].i)); NEXT();
+    OP(SUB_I) r[in->a].i = std::int64_t(std::uint64_t(r[in->b].i) - std::uint64_t(r[in->c].i)); NEXT();
+    OP(ADDK_I) r[in->a].i = std::int64_t(std::uint64_t(r[in->b].i) + std::uint64_t(imm16(*in))); NEXT();
+    OP(LT_I) r[in->a].i = r[in->b].i < r[in->c].i; NEXT();
+
+    OP(ADD_D) r[in->a].d = r[in->b].d + r[in->c].d; NEXT();
+    OP(SUB_D) r[in->a].d = r[in->b].d - r[in->c].d; NEXT();
+    OP(ADDK_D) r[in->a].d = r[in->b].d + double(imm16(*in)); NEXT();
+    OP(LT_D) r[in->a].i = !(r[in->b].d >= r[in->c].d); NEXT();
+    OP(TRUE_D) r[in->a].i = r[in->b].d < 0 || r[in->b].d > 0; NEXT();
+
+    OP(JMP) ip = f->code.data() + in->c; NEXT();
+    OP(JF) if(!r[in->a].i) ip = f->code.data() + in->c; NEXT();
+    OP(JNLT_I) if(!(r[in->a].i < r[in->b].i)) ip = f->code.data() + in->c; NEXT();
+    OP(JNLT_D) if(r[in->a].d >= r[in->b].d) ip = f->code.data() + in->c; NEXT();
+    OP(JNE_I) if(r[in->a].i != r[in->b].i) ip = f->code.data() + in->c; NEXT();
+    OP(JNE_D) if(r[in->a].d < r[in->b].d || r[in->a].d > r[in->b].d) ip = f->code.data() + in->c; NEXT();
+
+    OP(CALL) {
+        const BytecodeFunction* callee = &module.functions[in->b];
+        Reg* regs = r + in->c;
+        if(std::size_t(end - regs) < callee->regs || frames.size() == max_depth) {
+            error("stack overflow in " + callee->name.str());
+            return std::nullopt;
+        }
+        frames.push_back({f, ip, r, in->a});
+        f = callee;
+        r = regs;
+        ip = f->code.data();
+        NEXT();
+    }
+
+    OP(NATIVE) {
+        r[in->a].d = module.natives[in->b].fn(reinterpret_cast<const double*>(r + in->c));
+        NEXT();
+    }
+
+    OP(RET) {
+        Reg res = r[in->a];
+        if(frames.empty()) return res.d;
+
+        const Frame& caller = frames.back();
+        f = caller.f;
+        ip = caller.ip;
+        r = caller.regs;
+        r[caller.dest] = res;
+        frames.pop_back();
+        NEXT();
+    }
+
+#if !KL_COMPUTED_GOTO
+    }
+    return std::nullopt;
+#endif
+#undef OP
+#undef NEXT
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Bytecode.hpp"
+
+// Runs a BytecodeModule. Frames live on one preallocated register stack: a call's frame starts at
+// its first argument in the caller's frame, so arguments are never copied, and returning pops back
+// to the caller's. Dispatch is a computed goto through a table of labels where the compiler has
+// them (GCC, Clang) and a switch elsewhere.
+class VM {
+private:
+    struct Frame {
+        const BytecodeFunction* f;
+        const Instr* ip;  // where the caller resumes
+        Reg* regs;
+        unsigned dest;
+    };
+
+    const BytecodeModule& module;
+    std::unique_ptr<Reg[]> stack;  // left uninitialized, so only what runs touches it
+    std::size_t stack_regs;
+    std::vector<Frame> frames;
+    std::size_t max_depth;
+    bool fail;
+
+    void error(std::string message);
+    std::optional<double> execute(const BytecodeFunction& entry);
+
+public:
+    explicit VM(const BytecodeModule& module, std::size_t stack_regs = 1 << 20, std::size_t max_depth = 1 << 16);
+
+    bool Failed() const { return fail; }
+
+    // call a function taking no arguments, nothing if it can't be found or overflows the stack
+    std::optional<double> Run(const std::string& name);
+};
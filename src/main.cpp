@@ -1,42 +1,414 @@
+#include <charconv>
+#include <cstdint>
+#include <future>
 #include <iostream>
-#include <fstream>
 #include <memory>
-#include <sstream>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
 #include "Lexer.hpp"
+#include "MappedFile.hpp"
 #include "Token.hpp"
 #include "Parser.hpp"
 #include "PrintVisitor.hpp"
+#include "ASTOptimizer.hpp"
 #include "LLVMGen.hpp"
+#include "MLIRGen.hpp"
+#include "BytecodeGen.hpp"
+#include "VM.hpp"
+#include "JIT.hpp"
+#include "ObjectCache.hpp"
+#include "ThinLTO.hpp"
+#include "TieredJIT.hpp"
+#include "ThreadPool.hpp"
+
+#include <llvm/IR/Function.h>
+#include <llvm/Passes/OptimizationLevel.h>
+
+static std::optional<llvm::OptimizationLevel> parseOptLevel(std::string_view arg) {
+    if(arg == "-O0") return llvm::OptimizationLevel::O0;
+    if(arg == "-O1") return llvm::OptimizationLevel::O1;
+    if(arg == "-O2") return llvm::OptimizationLevel::O2;
+    if(arg == "-O3") return llvm::OptimizationLevel::O3;
+    if(arg == "-Os") return llvm::OptimizationLevel::Os;
+    return std::nullopt;
+}
+
+// the value of a numeric option, false unless all of arg is a number that fits out
+template<typename T>
+static bool parseNumber(std::string_view arg, T& out) {
+    auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), out);
+    return !arg.empty() && ec == std::errc() && ptr == arg.data() + arg.size();
+}
+
+// comma separated list
+static std::vector<std::string> splitList(std::string_view arg) {
+    std::vector<std::string> items;
+    while(!arg.empty()) {
+        size_t comma = arg.find(',');
+        items.emplace_back(arg.substr(0, comma));
+        if(comma == std::string_view::npos) break;
+        arg.remove_prefix(comma + 1);
+    }
+    return items;
+}
+
+struct Options {
+    llvm::OptimizationLevel opt_level = llvm::OptimizationLevel::O0;
+    std::string cpu;                        // empty for the default of the mode
+    std::vector<std::string> multiversion;  // x86-64 levels to clone every function for
+    bool ast_opt = true;                    // fold, prune and inline on the AST before codegen
+    unsigned memoize = 0;                   // memo table entries per pure recursive function, 0 for none
+    std::uint64_t parallel_grain = 0;       // iterations per chunk of a parallel loop, 0 for the runtime to choose
+    bool run = false;                       // execute main in the JIT instead of writing out.o
+    bool tiered = false;                    // run with the tiered JIT
+    bool vm = false;                        // interpret main on the bytecode VM, without LLVM
+    bool mlir = false;                      // generate code through the kl MLIR dialect instead of LLVMGen
+    std::uint64_t tier_threshold = 1000;    // calls plus loop iterations before a function is recompiled
+    unsigned jobs = 0;                      // backend threads, 0 for one per file or one per core with several files;
+                                            // more than one for a single file writes out.a instead of out.o
+    std::string cache_dir;                  // reuse compiled objects from here, empty for no cache
+    std::uint64_t cache_max_mb = 1024;
+    bool cache_stats = false;
+    bool dump_tokens = false;
+    bool dump_ast = false;
+    bool dump_ir = false;
+    bool dump_bytecode = false;
+    bool dump_mlir = false;
+};
+
+// everything after the whole program has been lowered into gen's module
+static int finish(LLVMGen& gen, const Options& opts) {
+    if(opts.memoize) gen.Memoize(opts.memoize);
+    if(!opts.multiversion.empty()) {
+        gen.Multiversion(opts.multiversion);
+        if(gen.Failed()) return 1;
+    }
+
+    std::unique_ptr<ObjectCache> cache;
+    if(!opts.cache_dir.empty()) cache = std::make_unique<ObjectCache>(opts.cache_dir, opts.cache_max_mb << 20);
+
+    int status = 0;
+    if(opts.run) {
+        // the tiered JIT picks its own optimization level per function, and with a cache the JIT
+        // only optimizes what it has to compile
+        std::unique_ptr<JIT> jit;
+        if(opts.tiered) {
+            jit = std::make_unique<TieredJIT>(opts.tier_threshold);
+        }
+        else if(cache) {
+            jit = std::make_unique<JIT>(cache.get(), opts.opt_level);
+        }
+        else {
+            gen.Optimize();
+            jit = std::make_unique<JIT>();
+        }
+
+        jit->Add(std::move(gen.mod), std::move(gen.ctx));
+        auto result = jit->Run("main");
+        if(result) std::cout << *result << std::endl;
+        else status = 1;
+    }
+    else if(opts.jobs > 1 || cache) {
+        // each part is optimized on its own, so the IR printed here is unoptimized
+        if(opts.dump_ir) gen.mod->print(llvm::outs(), nullptr);
+        gen.EmitObjectParallel(opts.jobs, cache.get());
+        if(gen.Failed()) status = 1;
+    }
+    else {
+        gen.Optimize();
+        if(opts.dump_ir) gen.mod->print(llvm::outs(), nullptr);
+        gen.EmitObject();
+        if(gen.Failed()) status = 1;
+    }
+
+    if(cache && opts.cache_stats) cache->PrintStats(std::cerr);
+    return status;
+}
+
+// the whole of a single file, dumped and optimized on the AST as the options ask; f stays open
+// while the program is in use
+static std::unique_ptr<Program> parseProgram(const MappedFile& f, const Options& opts) {
+    if(opts.dump_tokens) {
+        Lexer dumpLexer(f.contents());
+        for(Token token = dumpLexer.NextToken(); token.type != TokenType::END_PROG; token = dumpLexer.NextToken()) {
+            std::cout << token.to_string() << "\n";
+        }
+    }
+
+    Lexer lexer(f.contents());
+    Parser parser(lexer, true);
+    auto root = parser.Parse();
+    if(!root || parser.Errors()) {
+        std::cerr << "parsing failed: " << parser.Errors() << " errors" << std::endl;
+        return nullptr;
+    }
+    std::unique_ptr<Program> program(static_cast<Program*>(root.release()));
+
+    if(opts.dump_ast) {
+        PrintVisitor printer;
+        program->accept(printer);
+    }
+
+    if(opts.ast_opt) {
+        ASTOptimizer optimizer;
+        program->accept(optimizer);
+    }
+    return program;
+}
+
+// --vm: the whole program is parsed and compiled to bytecode, and main runs on the VM right away,
+// for when getting a result quickly matters more than how fast the program runs
+static int runVM(const char* path, const Options& opts) {
+    MappedFile f(path);
+    if(!f.is_open()) {
+        std::cerr << "Unable to open file: " << path << std::endl;
+        return 1;
+    }
+
+    auto program = parseProgram(f, opts);
+    if(!program) return 1;
+
+    NativeRegistry natives;
+    BytecodeGen gen(natives);
+    program->accept(gen);
+    if(gen.Failed()) return 1;
+    if(opts.dump_bytecode) gen.module.Print(std::cout);
+
+    VM vm(gen.module);
+    auto result = vm.Run("main");
+    if(!result) return 1;
+
+    std::cout << *result << std::endl;
+    return 0;
+}
+
+// --mlir: the program is emitted in the kl dialect and lowered through affine and scf to LLVM IR,
+// which then goes the same way as LLVMGen's module
+static int compileMLIR(const char* path, const Options& opts) {
+    MappedFile f(path);
+    if(!f.is_open()) {
+        std::cerr << "Unable to open file: " << path << std::endl;
+        return 1;
+    }
+
+    auto program = parseProgram(f, opts);
+    if(!program) return 1;
+
+    MLIRGen mlir;
+    program->accept(mlir);
+    if(mlir.Failed()) return 1;
+    if(opts.dump_mlir) mlir.Print(llvm::outs());
+
+    LLVMGen gen(opts.opt_level, opts.cpu);
+    gen.mod = mlir.Lower(*gen.ctx);
+    if(!gen.mod) return 1;
+    return finish(gen, opts);
+}
+
+// Several files: each one is parsed and lowered into its own module on the pool, and the modules
+// are linked with ThinLTO into out.a, or all added to one JIT with --run. A file calls a function of
+// another file by declaring it with an extern.
+static int compileFiles(const std::vector<const char*>& paths, const Options& opts) {
+    struct Unit {
+        std::unique_ptr<MappedFile> file;
+        std::unique_ptr<Program> program;
+        std::unique_ptr<LLVMGen> gen;
+        ThinLTOInput lto;
+    };
+    std::vector<Unit> units(paths.size());
+    ThreadPool pool(opts.jobs);
+
+    auto parallel = [&](auto f) {
+        std::vector<std::future<bool>> results;
+        for(size_t i = 0; i < units.size(); i++) results.push_back(pool.Submit([&f, i] { return f(i); }));
+
+        bool ok = true;
+        for(auto& r : results) ok = r.get() && ok;
+        return ok;
+    };
+
+    bool parsed = parallel([&](size_t i) {
+        auto& u = units[i];
+        u.file = std::make_unique<MappedFile>(paths[i]);
+        if(!u.file->is_open()) {
+            std::cerr << "Unable to open file: " << paths[i] << std::endl;
+            return false;
+        }
+
+        Lexer lexer(u.file->contents());
+        Parser parser(lexer, true);
+        auto root = parser.Parse();
+        if(!root || parser.Errors()) {
+            std::cerr << paths[i] << ": parsing failed: " << parser.Errors() << " errors" << std::endl;
+            return false;
+        }
+        u.program.reset(static_cast<Program*>(root.release()));
+        return true;
+    });
+    if(!parsed) return 1;
+
+    // dumps are printed one file at a time, in order
+    for(size_t i = 0; i < units.size(); i++) {
+        if(opts.dump_tokens) {
+            Lexer dumpLexer(units[i].file->contents());
+            for(Token token = dumpLexer.NextToken(); token.type != TokenType::END_PROG; token = dumpLexer.NextToken()) {
+                std::cout << token.to_string() << "\n";
+            }
+        }
+        if(opts.dump_ast) {
+            PrintVisitor printer;
+            units[i].program->accept(printer);
+        }
+    }
+
+    bool generated = parallel([&](size_t i) {
+        auto& u = units[i];
+        if(opts.ast_opt) {
+            ASTOptimizer optimizer;
+            u.program->accept(optimizer);
+        }
+
+        u.gen = std::make_unique<LLVMGen>(opts.opt_level, opts.cpu);
+        u.gen->parallelGrain = opts.parallel_grain;
+        u.gen->mod->setModuleIdentifier(paths[i]);
+        u.program->accept(*u.gen);
+        if(opts.memoize) u.gen->Memoize(opts.memoize);
+        if(!opts.multiversion.empty()) u.gen->Multiversion(opts.multiversion);
+        if(u.gen->Failed()) return false;
+
+        if(opts.run) u.gen->Optimize();
+        else u.gen->WriteThinLTOBitcode(u.lto.bitcode);
+        u.lto.path = paths[i];
+        return !u.gen->Failed();
+    });
+    if(!generated) return 1;
+
+    if(opts.dump_ir) {
+        for(auto& u : units) u.gen->mod->print(llvm::outs(), nullptr);
+    }
+
+    if(opts.run) {
+        // modules are added as they are, without inlining between them
+        JIT jit;
+        for(auto& u : units) jit.Add(std::move(u.gen->mod), std::move(u.gen->ctx));
+        auto result = jit.Run("main");
+        if(!result) return 1;
+
+        std::cout << *result << std::endl;
+        return 0;
+    }
+
+    std::vector<ThinLTOInput> inputs;
+    for(auto& u : units) inputs.push_back(std::move(u.lto));
+    return emitThinLTO(inputs, opts.cpu, opts.opt_level, opts.jobs, "out.a") ? 0 : 1;
+}
 
 int main(int argc, char* argv[]) {
-    if(argc < 2) {
+    std::vector<const char*> paths;
+    unsigned parse_threads = 0;  // 0 streams the program through a single parser
+    Options opts;
+
+    for(int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        bool ok = true;  // for the options that take a number
+        if(arg.substr(0, 16) == "--parse-threads=") ok = parseNumber(arg.substr(16), parse_threads);
+        else if(auto level = parseOptLevel(arg)) opts.opt_level = *level;
+        else if(arg == "-march=native") opts.cpu = "native";
+        else if(arg.substr(0, 6) == "-mcpu=") opts.cpu = arg.substr(6);
+        else if(arg == "--multiversion") opts.multiversion = {"x86-64-v2", "x86-64-v3", "x86-64-v4"};
+        else if(arg.substr(0, 15) == "--multiversion=") opts.multiversion = splitList(arg.substr(15));
+        else if(arg == "-fno-ast-opt") opts.ast_opt = false;
+        else if(arg == "-fmemoize") opts.memoize = 4096;
+        else if(arg.substr(0, 10) == "-fmemoize=") ok = parseNumber(arg.substr(10), opts.memoize);
+        else if(arg.substr(0, 17) == "-fparallel-grain=") ok = parseNumber(arg.substr(17), opts.parallel_grain);
+        else if(arg.substr(0, 2) == "-j" && arg.size() > 2) ok = parseNumber(arg.substr(2), opts.jobs);
+        else if(arg == "--cache") opts.cache_dir = ObjectCache::DefaultDir();
+        else if(arg.substr(0, 8) == "--cache=") opts.cache_dir = arg.substr(8);
+        else if(arg.substr(0, 15) == "--cache-max-mb=") ok = parseNumber(arg.substr(15), opts.cache_max_mb);
+        else if(arg == "--cache-stats") opts.cache_stats = true;
+        else if(arg == "--run") opts.run = true;
+        else if(arg == "--tiered") opts.run = opts.tiered = true;
+        else if(arg == "--vm") opts.vm = true;
+        else if(arg == "--mlir") opts.mlir = true;
+        else if(arg.substr(0, 17) == "--tier-threshold=") ok = parseNumber(arg.substr(17), opts.tier_threshold);
+        else if(arg == "--dump-tokens") opts.dump_tokens = true;
+        else if(arg == "--dump-ast") opts.dump_ast = true;
+        else if(arg == "--dump-ir") opts.dump_ir = true;
+        else if(arg == "--dump-bytecode") opts.dump_bytecode = true;
+        else if(arg == "--dump-mlir") opts.dump_mlir = true;
+        else paths.push_back(argv[i]);
+
+        if(!ok) {
+            std::cerr << "expected a non-negative integer in " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    // jitted code only ever runs here, so it can use everything the host has
+    if(opts.cpu.empty()) opts.cpu = opts.run ? "native" : "generic";
+
+    if(opts.run && !opts.multiversion.empty()) {
+        std::cerr << "--multiversion only applies to emitted objects, not --run" << std::endl;
+        return 1;
+    }
+
+    if(opts.tiered && opts.memoize) {
+        std::cerr << "-fmemoize doesn't apply to --tiered, which recompiles functions on their own" << std::endl;
+        return 1;
+    }
+
+    if(opts.vm) {
+        if(paths.size() != 1 || opts.run) {
+            std::cerr << "--vm takes a single file and doesn't combine with --run or --tiered" << std::endl;
+            return 1;
+        }
+        return runVM(paths[0], opts);
+    }
+
+    if(opts.mlir) {
+        if(paths.size() != 1 || opts.tiered) {
+            std::cerr << "--mlir takes a single file and doesn't combine with --tiered" << std::endl;
+            return 1;
+        }
+        return compileMLIR(paths[0], opts);
+    }
+
+    if(paths.size() > 1) {
+        if(opts.tiered || !opts.cache_dir.empty()) {
+            std::cerr << "--tiered and --cache take a single file" << std::endl;
+            return 1;
+        }
+        return compileFiles(paths, opts);
+    }
+
+    if(paths.empty()) {
         // Top level
         std::string line;
-        LLVMGen gen;
+        ASTOptimizer optimizer;
+        LLVMGen gen(opts.opt_level, opts.cpu);
+        gen.parallelGrain = opts.parallel_grain;
 
         std::cout << "> ";
         while(std::getline(std::cin, line)) {
-            std::istringstream iss(line);
-            Lexer lexer(iss);
-            std::vector<Token> tokens;
-            Token token = lexer.NextToken();
-            tokens.push_back(token);
-            while(token.type != TokenType::END_PROG) {
-                token = lexer.NextToken();
-                tokens.push_back(token);
-            }
-
-            Parser parser(std::move(tokens));
+            Lexer lexer(line);
+            Parser parser(lexer);
             auto root = parser.Parse(true);
             if(!root || parser.Errors()) {
                 std::cerr << "parsing error" << std::endl;
                 return 1;
             }
 
+            if(opts.ast_opt) root->accept(optimizer);
             root->accept(gen);
+
+            // The module keeps growing, so each definition is optimized on its own as it comes in.
+            // res is the function just generated, which a name lookup can miss: a repeated _expr
+            // gets renamed and the name still finds the old one.
+            if(auto* f = llvm::dyn_cast_or_null<llvm::Function>(gen.res)) gen.OptimizeFunction(*f);
             gen.PrintRes();
 
             std::cout << "> ";
@@ -46,45 +418,79 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
-    std::ifstream f;
-    f.open(argv[1]);
+    // tokens point into the mapped file, so it stays open until parsing is done
+    const char* path = paths[0];
+    MappedFile f(path);
     if(!f.is_open()) {
-        std::cout << "Unable to open file: " << argv[1] << std::endl;
+        std::cout << "Unable to open file: " << path << std::endl;
         return 1;
     }
 
-    std::vector<Token> tokens;
-    Lexer lexer(f);
-    Token token = lexer.NextToken();
-    tokens.push_back(token);
-    while(token.type != TokenType::END_PROG) {
-        std::cout << token.to_string() << "\n";
-        token = lexer.NextToken();
-        tokens.push_back(token);
+    // the token dump re-lexes instead of keeping the tokens around
+    if(opts.dump_tokens) {
+        Lexer dumpLexer(f.contents());
+        for(Token token = dumpLexer.NextToken(); token.type != TokenType::END_PROG; token = dumpLexer.NextToken()) {
+            std::cout << token.to_string() << "\n";
+        }
     }
-    f.close();
 
-    Parser parser(std::move(tokens));
-    auto root = parser.Parse();
-    if(parser.Errors()) {
-        std::cerr << "parsing failed: " << parser.Errors() << " errors" << std::endl;
-        return 1;
+    if(parse_threads) {
+        // parse the top level definitions in parallel, then print and lower the whole program
+        Lexer lexer(f.contents());
+        Parser parser(lexer);
+        ThreadPool pool(parse_threads);
+        auto program = parser.ParseParallel(pool);
+        if(parser.Errors()) {
+            std::cerr << "parsing failed: " << parser.Errors() << " errors" << std::endl;
+            return 1;
+        }
+
+        if(opts.dump_ast) {
+            PrintVisitor printer;
+            program->accept(printer);
+        }
+
+        if(opts.ast_opt) {
+            ASTOptimizer optimizer;
+            program->accept(optimizer);
+        }
+
+        LLVMGen gen(opts.opt_level, opts.cpu);
+        gen.parallelGrain = opts.parallel_grain;
+        program->accept(gen);
+        if(gen.Failed()) return 1;
+
+        return finish(gen, opts);
     }
 
-    PrintVisitor printer;
-    root->accept(printer);
+    // stream the program through the pipeline one top level definition at a time: the parser pulls
+    // tokens from the lexer as it needs them, and each definition's AST is freed once it has been
+    // printed and lowered into the module
+    Lexer lexer(f.contents());
+    Parser parser(lexer);
+    PrintVisitor printer(1);
+    ASTOptimizer optimizer;
+    LLVMGen gen(opts.opt_level, opts.cpu);
+    gen.parallelGrain = opts.parallel_grain;
+
+    if(opts.dump_ast) std::cout << "Program\n";
+    while(auto node = parser.ParseNext()) {
+        if(parser.Errors()) {
+            std::cerr << "parsing failed: " << parser.Errors() << " errors" << std::endl;
+            return 1;
+        }
+
+        if(opts.dump_ast) node->accept(printer);
+
+        if(opts.ast_opt) node->accept(optimizer);
+        node->accept(gen);
+        if(gen.Failed()) {
+            std::cerr << "LLVMGen: prog gen failed" << std::endl;
+            return 1;
+        }
+    }
+    if(opts.dump_ast) std::cout << std::endl;
 
-    LLVMGen gen;
-    // gen.visit(*root);
-    root->accept(gen);
-    gen.mod->print(llvm::outs(), nullptr);
-    gen.EmitObject();
+    return finish(gen, opts);
 }
 
-// // test mlir
-// #include "mlirtest.cpp"
-// int main() {
-//     MLIRTest m;
-//     m.gen42();
-//     m.dump();
-// }